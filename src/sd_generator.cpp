@@ -10,6 +10,7 @@ SDGenerator::~SDGenerator() {
     if (gen_thread_ && gen_thread_->joinable()) {
         gen_thread_->join();
     }
+    sd_cancel_token_free(cancel_token_);
     unloadModel();
 }
 
@@ -63,12 +64,16 @@ void SDGenerator::generateAsync(const GenerationParams& params, ProgressCallback
     }
     
     should_cancel_ = false;
+    sd_cancel_token_free(cancel_token_);
+    cancel_token_ = sd_cancel_token_new();
     gen_thread_ = std::make_unique<std::thread>(
         &SDGenerator::generateThread, this, params, progress_cb);
 }
 
 void SDGenerator::cancelGeneration() {
     should_cancel_ = true;
+    // stops generate_image at the next sampling step instead of waiting for it to finish
+    sd_cancel_token_cancel(cancel_token_);
     if (gen_thread_ && gen_thread_->joinable()) {
         gen_thread_->join();
     }
@@ -93,6 +98,7 @@ void SDGenerator::generateThread(GenerationParams params, ProgressCallback progr
         gen_params.height = params.height;
         gen_params.seed = params.seed < 0 ? time(nullptr) : params.seed;
         gen_params.batch_count = 1;
+        gen_params.cancel_token = cancel_token_;
         
         gen_params.sample_params.sample_steps = params.steps;
         gen_params.sample_params.guidance.txt_cfg = params.cfg_scale;
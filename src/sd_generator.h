@@ -54,6 +54,7 @@ private:
     bool model_loaded_ = false;
     std::atomic<bool> is_generating_{false};
     std::atomic<bool> should_cancel_{false};
+    sd_cancel_token_t* cancel_token_ = nullptr;
     std::string last_error_;
     std::string model_info_;
     ImageResult last_result_;
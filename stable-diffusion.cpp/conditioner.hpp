@@ -1,6 +1,9 @@
 #ifndef __CONDITIONER_HPP__
 #define __CONDITIONER_HPP__
 
+#include <list>
+#include <mutex>
+
 #include "clip.hpp"
 #include "llm.hpp"
 #include "t5.hpp"
@@ -34,7 +37,11 @@ struct Conditioner {
     virtual void free_params_buffer()                                                      = 0;
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors)    = 0;
     virtual size_t get_params_buffer_size()                                                = 0;
+    // upper bound of the work_ctx memory get_learned_condition allocates for these params
+    virtual size_t get_condition_mem_size(const ConditionerParams& conditioner_params)     = 0;
     virtual void set_weight_adapter(const std::shared_ptr<WeightAdapter>& adapter) {}
+    // text encoder runners, their params may be shared with other contexts
+    virtual std::vector<std::shared_ptr<GGMLRunner>> get_runners() { return {}; }
     virtual std::tuple<SDCondition, std::vector<bool>> get_learned_condition_with_trigger(ggml_context* work_ctx,
                                                                                           int n_threads,
                                                                                           const ConditionerParams& conditioner_params) {
@@ -46,6 +53,119 @@ struct Conditioner {
     }
 };
 
+// LRU cache of learned conditions, kept in host memory outside of any ggml context.
+// The caller builds the key from everything that affects the text encoder output.
+struct ConditionCache {
+    struct CachedTensor {
+        bool valid = false;
+        int64_t ne[4];
+        std::vector<float> data;
+    };
+
+    struct Entry {
+        std::string key;
+        CachedTensor c_crossattn;
+        CachedTensor c_vector;
+        CachedTensor c_concat;
+        size_t nbytes = 0;
+    };
+
+    size_t max_bytes = 0;
+    size_t cur_bytes = 0;
+    uint64_t hits    = 0;
+    uint64_t misses  = 0;
+
+    std::list<Entry> entries;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+
+    ConditionCache(size_t max_bytes = 0)
+        : max_bytes(max_bytes) {}
+
+    bool enabled() const {
+        return max_bytes > 0;
+    }
+
+    static bool save_tensor(ggml_tensor* tensor, CachedTensor& cached) {
+        if (tensor == nullptr) {
+            return true;
+        }
+        if (tensor->type != GGML_TYPE_F32 || tensor->data == nullptr || !ggml_is_contiguous(tensor)) {
+            return false;
+        }
+        cached.valid = true;
+        for (int i = 0; i < 4; i++) {
+            cached.ne[i] = tensor->ne[i];
+        }
+        cached.data.resize(ggml_nelements(tensor));
+        memcpy(cached.data.data(), tensor->data, ggml_nbytes(tensor));
+        return true;
+    }
+
+    static ggml_tensor* load_tensor(ggml_context* work_ctx, const CachedTensor& cached) {
+        if (!cached.valid) {
+            return nullptr;
+        }
+        ggml_tensor* tensor = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, cached.ne[0], cached.ne[1], cached.ne[2], cached.ne[3]);
+        memcpy(tensor->data, cached.data.data(), ggml_nbytes(tensor));
+        return tensor;
+    }
+
+    bool get(const std::string& key, ggml_context* work_ctx, SDCondition& cond) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = index.find(key);
+        if (iter == index.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, iter->second);
+        const Entry& entry = *iter->second;
+        cond.c_crossattn   = load_tensor(work_ctx, entry.c_crossattn);
+        cond.c_vector      = load_tensor(work_ctx, entry.c_vector);
+        cond.c_concat      = load_tensor(work_ctx, entry.c_concat);
+        return true;
+    }
+
+    void put(const std::string& key, const SDCondition& cond) {
+        Entry entry;
+        entry.key = key;
+        if (!save_tensor(cond.c_crossattn, entry.c_crossattn) ||
+            !save_tensor(cond.c_vector, entry.c_vector) ||
+            !save_tensor(cond.c_concat, entry.c_concat)) {
+            return;
+        }
+        entry.nbytes = key.size() +
+                       (entry.c_crossattn.data.size() + entry.c_vector.data.size() + entry.c_concat.data.size()) * sizeof(float);
+        if (entry.nbytes > max_bytes) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            cur_bytes -= iter->second->nbytes;
+            entries.erase(iter->second);
+            index.erase(iter);
+        }
+        while (!entries.empty() && cur_bytes + entry.nbytes > max_bytes) {
+            cur_bytes -= entries.back().nbytes;
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        cur_bytes += entry.nbytes;
+        entries.push_front(std::move(entry));
+        index[key] = entries.begin();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        cur_bytes = 0;
+    }
+};
+
 // ldm.modules.encoders.modules.FrozenCLIPEmbedder
 // Ref: https://github.com/AUTOMATIC1111/stable-diffusion-webui/blob/cad87bf4e3e0b0a759afa94e933527c3123d59bc/modules/sd_hijack_clip.py#L283
 struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
@@ -122,6 +242,10 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         }
     }
 
+    std::vector<std::shared_ptr<GGMLRunner>> get_runners() override {
+        return {text_model, text_model2};
+    }
+
     bool load_embedding(std::string embd_name, std::string embd_path, std::vector<int32_t>& bpe_tokens) {
         ModelLoader model_loader;
         if (!model_loader.init_from_file_and_convert_name(embd_path)) {
@@ -635,6 +759,18 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
                                             conditioner_params.adm_in_channels,
                                             conditioner_params.zero_out_masked);
     }
+
+    size_t get_condition_mem_size(const ConditionerParams& conditioner_params) override {
+        // the trigger word of photomaker may push the prompt into one more chunk
+        auto tokens_and_weights = tokenize(conditioner_params.text, true);
+        size_t n_token          = tokens_and_weights.first.size() + text_model->model.n_token;
+        size_t hidden_size      = text_model->model.hidden_size;
+        if (text_model2) {
+            hidden_size += text_model2->model.hidden_size;
+        }
+        // encoder outputs, their concat, the weighted chunk and the final hidden states
+        return 4 * n_token * hidden_size * sizeof(float);
+    }
 };
 
 struct FrozenCLIPVisionEmbedder : public GGMLRunner {
@@ -795,6 +931,10 @@ struct SD3CLIPEmbedder : public Conditioner {
         }
     }
 
+    std::vector<std::shared_ptr<GGMLRunner>> get_runners() override {
+        return {clip_l, clip_g, t5};
+    }
+
     std::vector<std::pair<std::vector<int>, std::vector<float>>> tokenize(std::string text,
                                                                           size_t max_length = 0,
                                                                           bool padding      = false) {
@@ -1114,6 +1254,16 @@ struct SD3CLIPEmbedder : public Conditioner {
                                             conditioner_params.clip_skip,
                                             conditioner_params.zero_out_masked);
     }
+
+    size_t get_condition_mem_size(const ConditionerParams& conditioner_params) override {
+        auto tokens_and_weights = tokenize(conditioner_params.text, 77, true);
+        size_t n_token          = 256;
+        for (auto& token_and_weights : tokens_and_weights) {
+            n_token = std::max(n_token, token_and_weights.first.size());
+        }
+        // clip_l, clip_g, t5 and the padded clip_lg outputs, their concat and the final hidden states
+        return n_token * (768 + 1280 + 4096 + 4096 + 2 * 4096 + 2 * 4096) * sizeof(float);
+    }
 };
 
 struct FluxCLIPEmbedder : public Conditioner {
@@ -1200,6 +1350,10 @@ struct FluxCLIPEmbedder : public Conditioner {
         }
     }
 
+    std::vector<std::shared_ptr<GGMLRunner>> get_runners() override {
+        return {clip_l, t5};
+    }
+
     std::vector<std::pair<std::vector<int>, std::vector<float>>> tokenize(std::string text,
                                                                           size_t max_length = 0,
                                                                           bool padding      = false) {
@@ -1382,6 +1536,13 @@ struct FluxCLIPEmbedder : public Conditioner {
                                             conditioner_params.clip_skip,
                                             conditioner_params.zero_out_masked);
     }
+
+    size_t get_condition_mem_size(const ConditionerParams& conditioner_params) override {
+        auto tokens_and_weights = tokenize(conditioner_params.text, chunk_len, true);
+        size_t n_token          = std::max(chunk_len, tokens_and_weights[1].first.size());
+        // t5 outputs and the final hidden states
+        return 2 * n_token * 4096 * sizeof(float);
+    }
 };
 
 struct T5CLIPEmbedder : public Conditioner {
@@ -1446,6 +1607,10 @@ struct T5CLIPEmbedder : public Conditioner {
         }
     }
 
+    std::vector<std::shared_ptr<GGMLRunner>> get_runners() override {
+        return {t5};
+    }
+
     std::tuple<std::vector<int>, std::vector<float>, std::vector<float>> tokenize(std::string text,
                                                                                   size_t max_length = 0,
                                                                                   bool padding      = false) {
@@ -1599,6 +1764,13 @@ struct T5CLIPEmbedder : public Conditioner {
                                             conditioner_params.clip_skip,
                                             conditioner_params.zero_out_masked);
     }
+
+    size_t get_condition_mem_size(const ConditionerParams& conditioner_params) override {
+        auto tokens_and_weights = tokenize(conditioner_params.text, chunk_len, true);
+        size_t n_token          = std::max(chunk_len, std::get<0>(tokens_and_weights).size());
+        // t5 outputs, the final hidden states and the attention mask
+        return n_token * (2 * 4096 + 1) * sizeof(float);
+    }
 };
 
 struct LLMEmbedder : public Conditioner {
@@ -1656,6 +1828,10 @@ struct LLMEmbedder : public Conditioner {
         }
     }
 
+    std::vector<std::shared_ptr<GGMLRunner>> get_runners() override {
+        return {llm};
+    }
+
     std::tuple<std::vector<int>, std::vector<float>> tokenize(std::string text,
                                                               std::pair<int, int> attn_range,
                                                               size_t max_length = 0,
@@ -1745,7 +1921,7 @@ struct LLMEmbedder : public Conditioner {
                 image.data = nullptr;
 
                 ggml_tensor* image_tensor = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, resized_image.width, resized_image.height, 3, 1);
-                sd_image_f32_to_ggml_tensor(resized_image, image_tensor, false);
+                sd_image_f32_to_ggml_tensor(resized_image, image_tensor, false, n_threads);
                 free(resized_image.data);
                 resized_image.data = nullptr;
 
@@ -1892,6 +2068,26 @@ struct LLMEmbedder : public Conditioner {
         LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
         return {new_hidden_states, nullptr, nullptr};
     }
+
+    size_t get_condition_mem_size(const ConditionerParams& conditioner_params) override {
+        // byte level BPE yields at most one token per byte, the prompt templates stay below 512 bytes
+        size_t n_token    = conditioner_params.text.size() + 512;
+        size_t image_size = 0;
+        if (llm->enable_vision) {
+            // ref images are resized to at most 560x560 pixels, see get_learned_condition
+            size_t max_pixels     = 560 * 560;
+            size_t factor         = llm->params.vision.patch_size * llm->params.vision.spatial_merge_size;
+            size_t n_image_tokens = max_pixels / (factor * factor);
+            n_token += conditioner_params.ref_images.size() * (n_image_tokens + 16);
+            image_size += conditioner_params.ref_images.size() * (3 * max_pixels + n_image_tokens * llm->params.hidden_size) * sizeof(float);
+        }
+        if (sd_version_is_flux2(version)) {
+            n_token = std::max<size_t>(n_token, 512);
+        }
+        // the llm output of all out_layers and its trimmed/padded copy
+        size_t n_layers = sd_version_is_flux2(version) ? 3 : 1;
+        return 2 * n_token * n_layers * llm->params.hidden_size * sizeof(float) + image_size;
+    }
 };
 
 #endif
@@ -663,6 +663,344 @@ struct Flux2FlowDenoiser : public FluxFlowDenoiser {
     }
 };
 
+/*================================================ Latent update kernels =================================================*/
+
+// Element-wise latent updates the samplers are built from. Each kernel makes one pass over
+// contiguous f32 tensors with loops simple enough for the compiler to vectorize, and large
+// latents (video, high resolutions) are split between n_threads.
+struct LatentKernels {
+    int n_threads = 1;
+
+    explicit LatentKernels(int n_threads)
+        : n_threads(std::max(1, n_threads)) {}
+
+    // calls fn(begin, end) on disjoint ranges covering [0, n), chunks start on a cache line
+    template <typename F>
+    void parallel_for(int64_t n, F fn) const {
+        sd_parallel_for(n_threads, n, 1, fn, 16);
+    }
+
+    static float* data(ggml_tensor* t) {
+        if (t == nullptr) {
+            return nullptr;
+        }
+        GGML_ASSERT(t->type == GGML_TYPE_F32 && ggml_is_contiguous(t));
+        return (float*)t->data;
+    }
+
+    // x *= a
+    void scale(ggml_tensor* x, float a) const {
+        float* vec_x = data(x);
+        parallel_for(ggml_nelements(x), [=](int64_t begin, int64_t end) {
+            for (int64_t j = begin; j < end; j++) {
+                vec_x[j] *= a;
+            }
+        });
+    }
+
+    // out = a * x + b * y
+    void axpby(ggml_tensor* out, float a, ggml_tensor* x, float b, ggml_tensor* y) const {
+        float* vec_out = data(out);
+        float* vec_x   = data(x);
+        float* vec_y   = data(y);
+        parallel_for(ggml_nelements(out), [=](int64_t begin, int64_t end) {
+            for (int64_t j = begin; j < end; j++) {
+                vec_out[j] = a * vec_x[j] + b * vec_y[j];
+            }
+        });
+    }
+
+    // out = a * x - c * y, c * y is evaluated in double as in the DPM++ 2S reference
+    void axmcy(ggml_tensor* out, float a, ggml_tensor* x, double c, ggml_tensor* y) const {
+        float* vec_out = data(out);
+        float* vec_x   = data(x);
+        float* vec_y   = data(y);
+        parallel_for(ggml_nelements(out), [=](int64_t begin, int64_t end) {
+            for (int64_t j = begin; j < end; j++) {
+                vec_out[j] = a * vec_x[j] - c * vec_y[j];
+            }
+        });
+    }
+
+    // d = (x - denoised) / sigma, out = base + d * dt + noise * noise_scale
+    // d is kept in d_out if set, noise is optional and can't be combined with d_out
+    void euler_step(ggml_tensor* out,
+                    ggml_tensor* base,
+                    ggml_tensor* x,
+                    ggml_tensor* denoised,
+                    float sigma,
+                    float dt,
+                    ggml_tensor* d_out = nullptr,
+                    ggml_tensor* noise = nullptr,
+                    float noise_scale  = 0.f) const {
+        float* vec_out      = data(out);
+        float* vec_base     = data(base);
+        float* vec_x        = data(x);
+        float* vec_denoised = data(denoised);
+        float* vec_d        = data(d_out);
+        float* vec_noise    = data(noise);
+        GGML_ASSERT(vec_d == nullptr || vec_noise == nullptr);
+        parallel_for(ggml_nelements(out), [=](int64_t begin, int64_t end) {
+            if (vec_noise != nullptr) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d    = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_out[j] = vec_base[j] + d * dt + vec_noise[j] * noise_scale;
+                }
+            } else if (vec_d != nullptr) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d    = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_d[j]   = d;
+                    vec_out[j] = vec_base[j] + d * dt;
+                }
+            } else {
+                for (int64_t j = begin; j < end; j++) {
+                    float d    = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_out[j] = vec_base[j] + d * dt;
+                }
+            }
+        });
+    }
+
+    // Heun correction: d = (d + (x2 - denoised) / sigma) / 2, x += d * dt
+    void heun_step(ggml_tensor* x, ggml_tensor* d, ggml_tensor* x2, ggml_tensor* denoised, float sigma, float dt) const {
+        float* vec_x        = data(x);
+        float* vec_d        = data(d);
+        float* vec_x2       = data(x2);
+        float* vec_denoised = data(denoised);
+        parallel_for(ggml_nelements(x), [=](int64_t begin, int64_t end) {
+            for (int64_t j = begin; j < end; j++) {
+                float d2 = (vec_x2[j] - vec_denoised[j]) / sigma;
+                vec_d[j] = (vec_d[j] + d2) / 2;
+                vec_x[j] = vec_x[j] + vec_d[j] * dt;
+            }
+        });
+    }
+
+    // Linear multistep (iPNDM): d = (x - denoised) / sigma is kept in d_out and
+    // x += h * (c[0] * d + c[1] * history[0] + c[2] * history[1] + ...), history newest first.
+    // d_out may be the oldest history entry used, it is read before being overwritten.
+    void multistep(ggml_tensor* x,
+                   ggml_tensor* denoised,
+                   float sigma,
+                   ggml_tensor* d_out,
+                   float h,
+                   const std::vector<float>& c,
+                   const std::vector<ggml_tensor*>& history) const {
+        GGML_ASSERT(c.size() >= 1 && c.size() <= 4 && history.size() >= c.size() - 1);
+        float* vec_x        = data(x);
+        float* vec_denoised = data(denoised);
+        float* vec_d        = data(d_out);
+        float* vec_d1       = c.size() > 1 ? data(history[0]) : nullptr;
+        float* vec_d2       = c.size() > 2 ? data(history[1]) : nullptr;
+        float* vec_d3       = c.size() > 3 ? data(history[2]) : nullptr;
+        const int order     = (int)c.size();
+        const float c0      = c[0];
+        const float c1      = order > 1 ? c[1] : 0.f;
+        const float c2      = order > 2 ? c[2] : 0.f;
+        const float c3      = order > 3 ? c[3] : 0.f;
+        parallel_for(ggml_nelements(x), [=](int64_t begin, int64_t end) {
+            switch (order) {
+                case 1:
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + h * (c0 * d);
+                        vec_d[j] = d;
+                    }
+                    break;
+                case 2:
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + h * (c0 * d + c1 * vec_d1[j]);
+                        vec_d[j] = d;
+                    }
+                    break;
+                case 3:
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + h * (c0 * d + c1 * vec_d1[j] + c2 * vec_d2[j]);
+                        vec_d[j] = d;
+                    }
+                    break;
+                default:
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + h * (c0 * d + c1 * vec_d1[j] + c2 * vec_d2[j] + c3 * vec_d3[j]);
+                        vec_d[j] = d;
+                    }
+                    break;
+            }
+        });
+    }
+
+    // DPM++ (2M): x = a * x - b * (c_cur * denoised - c_old * old_denoised), then old_denoised = denoised.
+    // Without history (use_old false) x = a * x - b * denoised.
+    void dpmpp_2m_step(ggml_tensor* x,
+                       ggml_tensor* denoised,
+                       ggml_tensor* old_denoised,
+                       float a,
+                       float b,
+                       float c_cur,
+                       float c_old,
+                       bool use_old) const {
+        float* vec_x            = data(x);
+        float* vec_denoised     = data(denoised);
+        float* vec_old_denoised = data(old_denoised);
+        parallel_for(ggml_nelements(x), [=](int64_t begin, int64_t end) {
+            if (use_old) {
+                for (int64_t j = begin; j < end; j++) {
+                    float denoised_d    = c_cur * vec_denoised[j] - c_old * vec_old_denoised[j];
+                    vec_x[j]            = a * vec_x[j] - b * denoised_d;
+                    vec_old_denoised[j] = vec_denoised[j];
+                }
+            } else {
+                for (int64_t j = begin; j < end; j++) {
+                    vec_x[j]            = a * vec_x[j] - b * vec_denoised[j];
+                    vec_old_denoised[j] = vec_denoised[j];
+                }
+            }
+        });
+    }
+
+    // true if a = a * mask + b * (1 - mask) can run on the flat data: all f32 and contiguous,
+    // b shaped like a and mask matching the leading dimensions of a and 1 in the others
+    static bool can_blend(ggml_tensor* a, ggml_tensor* b, ggml_tensor* mask) {
+        for (ggml_tensor* t : {a, b, mask}) {
+            if (t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t)) {
+                return false;
+            }
+        }
+        if (!ggml_are_same_shape(a, b)) {
+            return false;
+        }
+        int d = 0;
+        while (d < GGML_MAX_DIMS && mask->ne[d] == a->ne[d]) {
+            d++;
+        }
+        for (; d < GGML_MAX_DIMS; d++) {
+            if (mask->ne[d] != 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // calls fn(j, end, m) for the runs of [begin, end) that see the mask from index m on
+    template <typename F>
+    static void for_mask_runs(int64_t begin, int64_t end, int64_t mask_n, F fn) {
+        int64_t m = begin % mask_n;
+        for (int64_t j = begin; j < end; m = 0) {
+            int64_t run_end = std::min(end, j + (mask_n - m));
+            fn(j, run_end, m);
+            j = run_end;
+        }
+    }
+
+    // Guided denoiser output from the model outputs (each nelements(denoised) floats):
+    //   out = w_cond * cond + w_uncond * uncond + w_img * img_cond + w_skip * skip
+    //   denoised = out * c_out + input * c_skip
+    // then denoised = denoised * mask + init * (1 - mask) if mask is set (see can_blend).
+    // Unused inputs may be nullptr with a zero weight.
+    void guided_denoise(ggml_tensor* denoised,
+                        ggml_tensor* input,
+                        const float* cond,
+                        const float* uncond,
+                        const float* img_cond,
+                        const float* skip,
+                        float w_cond,
+                        float w_uncond,
+                        float w_img,
+                        float w_skip,
+                        float c_out,
+                        float c_skip,
+                        ggml_tensor* init = nullptr,
+                        ggml_tensor* mask = nullptr) const {
+        float* vec_denoised = data(denoised);
+        float* vec_input    = data(input);
+        float* vec_init     = data(init);
+        float* vec_mask     = data(mask);
+        // an absent input reads cond again, which is already in cache, with a zero weight
+        const float* vec_cond     = cond;
+        const float* vec_uncond   = uncond != nullptr ? uncond : cond;
+        const float* vec_img_cond = img_cond != nullptr ? img_cond : cond;
+        const float* vec_skip     = skip != nullptr ? skip : cond;
+        w_uncond                  = uncond != nullptr ? w_uncond : 0.f;
+        w_img                     = img_cond != nullptr ? w_img : 0.f;
+        w_skip                    = skip != nullptr ? w_skip : 0.f;
+        GGML_ASSERT(vec_mask == nullptr || can_blend(denoised, init, mask));
+        int64_t mask_n = vec_mask != nullptr ? ggml_nelements(mask) : 0;
+        parallel_for(ggml_nelements(denoised), [=](int64_t begin, int64_t end) {
+            if (vec_mask == nullptr) {
+                for (int64_t j = begin; j < end; j++) {
+                    float out       = w_cond * vec_cond[j] + w_uncond * vec_uncond[j] + w_img * vec_img_cond[j] + w_skip * vec_skip[j];
+                    vec_denoised[j] = out * c_out + vec_input[j] * c_skip;
+                }
+                return;
+            }
+            for_mask_runs(begin, end, mask_n, [&](int64_t run_begin, int64_t run_end, int64_t m) {
+                const float* vec_run_mask = vec_mask + m;
+                for (int64_t j = run_begin; j < run_end; j++) {
+                    float out       = w_cond * vec_cond[j] + w_uncond * vec_uncond[j] + w_img * vec_img_cond[j] + w_skip * vec_skip[j];
+                    float value     = out * c_out + vec_input[j] * c_skip;
+                    float mask      = vec_run_mask[j - run_begin];
+                    vec_denoised[j] = value * mask + vec_init[j] * (1 - mask);
+                }
+            });
+        });
+    }
+
+    // a = a * mask + b * (1 - mask), see can_blend
+    void blend_mask(ggml_tensor* a, ggml_tensor* b, ggml_tensor* mask) const {
+        GGML_ASSERT(can_blend(a, b, mask));
+        float* vec_a    = data(a);
+        float* vec_b    = data(b);
+        float* vec_mask = data(mask);
+        int64_t mask_n  = ggml_nelements(mask);
+        parallel_for(ggml_nelements(a), [=](int64_t begin, int64_t end) {
+            for_mask_runs(begin, end, mask_n, [&](int64_t run_begin, int64_t run_end, int64_t m) {
+                const float* vec_run_mask = vec_mask + m;
+                for (int64_t j = run_begin; j < run_end; j++) {
+                    float mask = vec_run_mask[j - run_begin];
+                    vec_a[j]   = vec_a[j] * mask + vec_b[j] * (1 - mask);
+                }
+            });
+        });
+    }
+
+    // DDIM/TCD update from the k-diffusion denoiser output:
+    // eps = (x - denoised) / sigma, x0 = (x / x_div - sqrt_beta * eps) / sqrt_alpha,
+    // x = c_x0 * x0 + c_eps * eps, then x = keep * x + noise_scale * noise if noise is set
+    void ddim_step(ggml_tensor* x,
+                   ggml_tensor* denoised,
+                   float sigma,
+                   float x_div,
+                   float sqrt_beta,
+                   float sqrt_alpha,
+                   float c_x0,
+                   float c_eps,
+                   ggml_tensor* noise = nullptr,
+                   float keep         = 1.f,
+                   float noise_scale  = 0.f) const {
+        float* vec_x        = data(x);
+        float* vec_denoised = data(denoised);
+        float* vec_noise    = data(noise);
+        parallel_for(ggml_nelements(x), [=](int64_t begin, int64_t end) {
+            if (vec_noise != nullptr) {
+                for (int64_t j = begin; j < end; j++) {
+                    float eps = (vec_x[j] - vec_denoised[j]) * (1 / sigma);
+                    float x0  = (vec_x[j] / x_div - sqrt_beta * eps) * (1 / sqrt_alpha);
+                    vec_x[j]  = keep * (c_x0 * x0 + c_eps * eps) + noise_scale * vec_noise[j];
+                }
+            } else {
+                for (int64_t j = begin; j < end; j++) {
+                    float eps = (vec_x[j] - vec_denoised[j]) * (1 / sigma);
+                    float x0  = (vec_x[j] / x_div - sqrt_beta * eps) * (1 / sqrt_alpha);
+                    vec_x[j]  = c_x0 * x0 + c_eps * eps;
+                }
+            }
+        });
+    }
+};
+
 typedef std::function<ggml_tensor*(ggml_tensor*, float, int)> denoise_cb_t;
 
 // k diffusion reverse ODE: dx = (x - D(x;\sigma)) / \sigma dt; \sigma(t) = t
@@ -672,13 +1010,14 @@ static bool sample_k_diffusion(sample_method_t method,
                                ggml_tensor* x,
                                std::vector<float> sigmas,
                                std::shared_ptr<RNG> rng,
-                               float eta) {
+                               float eta,
+                               int n_threads) {
     size_t steps = sigmas.size() - 1;
+    LatentKernels kernels(n_threads);
     // sample_euler_ancestral
     switch (method) {
         case EULER_A_SAMPLE_METHOD: {
             struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, x);
-            struct ggml_tensor* d     = ggml_dup_tensor(work_ctx, x);
 
             for (int i = 0; i < steps; i++) {
                 float sigma = sigmas[i];
@@ -689,17 +1028,6 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                // d = (x - denoised) / sigma
-                {
-                    float* vec_d        = (float*)d->data;
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-
-                    for (int i = 0; i < ggml_nelements(d); i++) {
-                        vec_d[i] = (vec_x[i] - vec_denoised[i]) / sigma;
-                    }
-                }
-
                 // get_ancestral_step
                 float sigma_up   = std::min(sigmas[i + 1],
                                             std::sqrt(sigmas[i + 1] * sigmas[i + 1] * (sigmas[i] * sigmas[i] - sigmas[i + 1] * sigmas[i + 1]) / (sigmas[i] * sigmas[i])));
@@ -707,35 +1035,19 @@ static bool sample_k_diffusion(sample_method_t method,
 
                 // Euler method
                 float dt = sigma_down - sigmas[i];
-                // x = x + d * dt
-                {
-                    float* vec_d = (float*)d->data;
-                    float* vec_x = (float*)x->data;
-
-                    for (int i = 0; i < ggml_nelements(x); i++) {
-                        vec_x[i] = vec_x[i] + vec_d[i] * dt;
-                    }
-                }
-
                 if (sigmas[i + 1] > 0) {
-                    // x = x + noise_sampler(sigmas[i], sigmas[i + 1]) * s_noise * sigma_up
-                    ggml_ext_im_set_randn_f32(noise, rng);
+                    // x = x + d * dt + noise_sampler(sigmas[i], sigmas[i + 1]) * s_noise * sigma_up
+                    ggml_ext_im_set_randn_f32(noise, rng, n_threads);
                     // noise = load_tensor_from_file(work_ctx, "./rand" + std::to_string(i+1) + ".bin");
-                    {
-                        float* vec_x     = (float*)x->data;
-                        float* vec_noise = (float*)noise->data;
-
-                        for (int i = 0; i < ggml_nelements(x); i++) {
-                            vec_x[i] = vec_x[i] + vec_noise[i] * sigma_up;
-                        }
-                    }
+                    kernels.euler_step(x, x, x, denoised, sigma, dt, nullptr, noise, sigma_up);
+                } else {
+                    // x = x + d * dt
+                    kernels.euler_step(x, x, x, denoised, sigma, dt);
                 }
             }
         } break;
         case EULER_SAMPLE_METHOD:  // Implemented without any sigma churn
         {
-            struct ggml_tensor* d = ggml_dup_tensor(work_ctx, x);
-
             for (int i = 0; i < steps; i++) {
                 float sigma = sigmas[i];
 
@@ -745,27 +1057,9 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                // d = (x - denoised) / sigma
-                {
-                    float* vec_d        = (float*)d->data;
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-
-                    for (int j = 0; j < ggml_nelements(d); j++) {
-                        vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigma;
-                    }
-                }
-
+                // d = (x - denoised) / sigma, x = x + d * dt
                 float dt = sigmas[i + 1] - sigma;
-                // x = x + d * dt
-                {
-                    float* vec_d = (float*)d->data;
-                    float* vec_x = (float*)x->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                    }
-                }
+                kernels.euler_step(x, x, x, denoised, sigma, dt);
             }
         } break;
         case HEUN_SAMPLE_METHOD: {
@@ -779,53 +1073,25 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                // d = (x - denoised) / sigma
-                {
-                    float* vec_d        = (float*)d->data;
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigmas[i];
-                    }
-                }
-
                 float dt = sigmas[i + 1] - sigmas[i];
                 if (sigmas[i + 1] == 0) {
                     // Euler step
                     // x = x + d * dt
-                    float* vec_d = (float*)d->data;
-                    float* vec_x = (float*)x->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                    }
+                    kernels.euler_step(x, x, x, denoised, sigmas[i], dt);
                 } else {
                     // Heun step
-                    float* vec_d  = (float*)d->data;
-                    float* vec_d2 = (float*)d->data;
-                    float* vec_x  = (float*)x->data;
-                    float* vec_x2 = (float*)x2->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x2[j] = vec_x[j] + vec_d[j] * dt;
-                    }
+                    // x2 = x + d * dt
+                    kernels.euler_step(x2, x, x, denoised, sigmas[i], dt, d);
 
                     ggml_tensor* denoised = model(x2, sigmas[i + 1], i + 1);
                     if (denoised == nullptr) {
                         return false;
                     }
-                    float* vec_denoised = (float*)denoised->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        float d2 = (vec_x2[j] - vec_denoised[j]) / sigmas[i + 1];
-                        vec_d[j] = (vec_d[j] + d2) / 2;
-                        vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                    }
+                    kernels.heun_step(x, d, x2, denoised, sigmas[i + 1], dt);
                 }
             }
         } break;
         case DPM2_SAMPLE_METHOD: {
-            struct ggml_tensor* d  = ggml_dup_tensor(work_ctx, x);
             struct ggml_tensor* x2 = ggml_dup_tensor(work_ctx, x);
 
             for (int i = 0; i < steps; i++) {
@@ -835,49 +1101,26 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                // d = (x - denoised) / sigma
-                {
-                    float* vec_d        = (float*)d->data;
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigmas[i];
-                    }
-                }
-
                 if (sigmas[i + 1] == 0) {
                     // Euler step
                     // x = x + d * dt
-                    float dt     = sigmas[i + 1] - sigmas[i];
-                    float* vec_d = (float*)d->data;
-                    float* vec_x = (float*)x->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                    }
+                    float dt = sigmas[i + 1] - sigmas[i];
+                    kernels.euler_step(x, x, x, denoised, sigmas[i], dt);
                 } else {
                     // DPM-Solver-2
                     float sigma_mid = exp(0.5f * (log(sigmas[i]) + log(sigmas[i + 1])));
                     float dt_1      = sigma_mid - sigmas[i];
                     float dt_2      = sigmas[i + 1] - sigmas[i];
 
-                    float* vec_d  = (float*)d->data;
-                    float* vec_x  = (float*)x->data;
-                    float* vec_x2 = (float*)x2->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x2[j] = vec_x[j] + vec_d[j] * dt_1;
-                    }
+                    // x2 = x + d * dt_1
+                    kernels.euler_step(x2, x, x, denoised, sigmas[i], dt_1);
 
                     ggml_tensor* denoised = model(x2, sigma_mid, i + 1);
                     if (denoised == nullptr) {
                         return false;
                     }
-                    float* vec_denoised = (float*)denoised->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        float d2 = (vec_x2[j] - vec_denoised[j]) / sigma_mid;
-                        vec_x[j] = vec_x[j] + d2 * dt_2;
-                    }
+                    // x = x + d2 * dt_2, d2 = (x2 - denoised) / sigma_mid
+                    kernels.euler_step(x, x, x2, denoised, sigma_mid, dt_2);
                 }
             }
 
@@ -905,12 +1148,7 @@ static bool sample_k_diffusion(sample_method_t method,
                     // dt = sigma_down - sigmas[i];
                     // x += d * dt;
                     // => x = denoised
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = vec_denoised[j];
-                    }
+                    memcpy(x->data, denoised->data, ggml_nbytes(x));
                 } else {
                     // DPM-Solver++(2S)
                     float t      = t_fn(sigmas[i]);
@@ -918,37 +1156,22 @@ static bool sample_k_diffusion(sample_method_t method,
                     float h      = t_next - t;
                     float s      = t + 0.5f * h;
 
-                    float* vec_x        = (float*)x->data;
-                    float* vec_x2       = (float*)x2->data;
-                    float* vec_denoised = (float*)denoised->data;
-
                     // First half-step
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x2[j] = (sigma_fn(s) / sigma_fn(t)) * vec_x[j] - (exp(-h * 0.5f) - 1) * vec_denoised[j];
-                    }
+                    kernels.axmcy(x2, sigma_fn(s) / sigma_fn(t), x, exp(-h * 0.5f) - 1, denoised);
 
-                    ggml_tensor* denoised = model(x2, sigmas[i + 1], i + 1);
-                    if (denoised == nullptr) {
+                    // the second half-step keeps using the tensor of the first model call
+                    if (model(x2, sigmas[i + 1], i + 1) == nullptr) {
                         return false;
                     }
 
                     // Second half-step
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = (sigma_fn(t_next) / sigma_fn(t)) * vec_x[j] - (exp(-h) - 1) * vec_denoised[j];
-                    }
+                    kernels.axmcy(x, sigma_fn(t_next) / sigma_fn(t), x, exp(-h) - 1, denoised);
                 }
 
                 // Noise addition
                 if (sigmas[i + 1] > 0) {
-                    ggml_ext_im_set_randn_f32(noise, rng);
-                    {
-                        float* vec_x     = (float*)x->data;
-                        float* vec_noise = (float*)noise->data;
-
-                        for (int i = 0; i < ggml_nelements(x); i++) {
-                            vec_x[i] = vec_x[i] + vec_noise[i] * sigma_up;
-                        }
-                    }
+                    ggml_ext_im_set_randn_f32(noise, rng, n_threads);
+                    kernels.axpby(x, 1.f, x, sigma_up, noise);
                 }
             }
         } break;
@@ -965,32 +1188,19 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                float t                 = t_fn(sigmas[i]);
-                float t_next            = t_fn(sigmas[i + 1]);
-                float h                 = t_next - t;
-                float a                 = sigmas[i + 1] / sigmas[i];
-                float b                 = exp(-h) - 1.f;
-                float* vec_x            = (float*)x->data;
-                float* vec_denoised     = (float*)denoised->data;
-                float* vec_old_denoised = (float*)old_denoised->data;
+                float t      = t_fn(sigmas[i]);
+                float t_next = t_fn(sigmas[i + 1]);
+                float h      = t_next - t;
+                float a      = sigmas[i + 1] / sigmas[i];
+                float b      = exp(-h) - 1.f;
 
                 if (i == 0 || sigmas[i + 1] == 0) {
                     // Simpler step for the edge cases
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = a * vec_x[j] - b * vec_denoised[j];
-                    }
+                    kernels.dpmpp_2m_step(x, denoised, old_denoised, a, b, 1.f, 0.f, false);
                 } else {
                     float h_last = t - t_fn(sigmas[i - 1]);
                     float r      = h_last / h;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        float denoised_d = (1.f + 1.f / (2.f * r)) * vec_denoised[j] - (1.f / (2.f * r)) * vec_old_denoised[j];
-                        vec_x[j]         = a * vec_x[j] - b * denoised_d;
-                    }
-                }
-
-                // old_denoised = denoised
-                for (int j = 0; j < ggml_nelements(x); j++) {
-                    vec_old_denoised[j] = vec_denoised[j];
+                    kernels.dpmpp_2m_step(x, denoised, old_denoised, a, b, 1.f + 1.f / (2.f * r), 1.f / (2.f * r), true);
                 }
             }
         } break;
@@ -1007,20 +1217,15 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                float t                 = t_fn(sigmas[i]);
-                float t_next            = t_fn(sigmas[i + 1]);
-                float h                 = t_next - t;
-                float a                 = sigmas[i + 1] / sigmas[i];
-                float* vec_x            = (float*)x->data;
-                float* vec_denoised     = (float*)denoised->data;
-                float* vec_old_denoised = (float*)old_denoised->data;
+                float t      = t_fn(sigmas[i]);
+                float t_next = t_fn(sigmas[i + 1]);
+                float h      = t_next - t;
+                float a      = sigmas[i + 1] / sigmas[i];
 
                 if (i == 0 || sigmas[i + 1] == 0) {
                     // Simpler step for the edge cases
                     float b = exp(-h) - 1.f;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = a * vec_x[j] - b * vec_denoised[j];
-                    }
+                    kernels.dpmpp_2m_step(x, denoised, old_denoised, a, b, 1.f, 0.f, false);
                 } else {
                     float h_last = t - t_fn(sigmas[i - 1]);
                     float h_min  = std::min(h_last, h);
@@ -1028,174 +1233,102 @@ static bool sample_k_diffusion(sample_method_t method,
                     float r      = h_max / h_min;
                     float h_d    = (h_max + h_min) / 2.f;
                     float b      = exp(-h_d) - 1.f;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        float denoised_d = (1.f + 1.f / (2.f * r)) * vec_denoised[j] - (1.f / (2.f * r)) * vec_old_denoised[j];
-                        vec_x[j]         = a * vec_x[j] - b * denoised_d;
-                    }
-                }
-
-                // old_denoised = denoised
-                for (int j = 0; j < ggml_nelements(x); j++) {
-                    vec_old_denoised[j] = vec_denoised[j];
+                    kernels.dpmpp_2m_step(x, denoised, old_denoised, a, b, 1.f + 1.f / (2.f * r), 1.f / (2.f * r), true);
                 }
             }
         } break;
         case IPNDM_SAMPLE_METHOD:  // iPNDM sampler from https://github.com/zju-pi/diff-sampler/tree/main/diff-solvers-main
         {
-            int max_order       = 4;
-            ggml_tensor* x_next = x;
-            std::vector<ggml_tensor*> buffer_model;
+            int max_order = 4;
+            std::vector<ggml_tensor*> buffer_model;  // newest first
 
             for (int i = 0; i < steps; i++) {
                 float sigma      = sigmas[i];
                 float sigma_next = sigmas[i + 1];
 
-                ggml_tensor* x_cur = x_next;
-                float* vec_x_cur   = (float*)x_cur->data;
-                float* vec_x_next  = (float*)x_next->data;
-
                 // Denoising step
-                ggml_tensor* denoised = model(x_cur, sigma, i + 1);
+                ggml_tensor* denoised = model(x, sigma, i + 1);
                 if (denoised == nullptr) {
                     return false;
                 }
-                float* vec_denoised = (float*)denoised->data;
-                // d_cur = (x_cur - denoised) / sigma
-                struct ggml_tensor* d_cur = ggml_dup_tensor(work_ctx, x_cur);
-                float* vec_d_cur          = (float*)d_cur->data;
-
-                for (int j = 0; j < ggml_nelements(d_cur); j++) {
-                    vec_d_cur[j] = (vec_x_cur[j] - vec_denoised[j]) / sigma;
-                }
+                // the oldest history entry is no longer needed once it has been used
+                struct ggml_tensor* d_cur = buffer_model.size() == max_order - 1 ? buffer_model.back() : ggml_dup_tensor(work_ctx, x);
 
                 int order = std::min(max_order, i + 1);
 
-                // Calculate vec_x_next based on the order
+                // d_cur = (x - denoised) / sigma, x += (sigma_next - sigma) * sum(c * d)
+                std::vector<float> c;
                 switch (order) {
                     case 1:  // First Euler step
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x_next[j] = vec_x_cur[j] + (sigma_next - sigma) * vec_d_cur[j];
-                        }
+                        c = {1.f};
                         break;
-
                     case 2:  // Use one history point
-                    {
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x_next[j] = vec_x_cur[j] + (sigma_next - sigma) * (3 * vec_d_cur[j] - vec_d_prev1[j]) / 2;
-                        }
-                    } break;
-
+                        c = {3.f / 2, -1.f / 2};
+                        break;
                     case 3:  // Use two history points
-                    {
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        float* vec_d_prev2 = (float*)buffer_model[buffer_model.size() - 2]->data;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x_next[j] = vec_x_cur[j] + (sigma_next - sigma) * (23 * vec_d_cur[j] - 16 * vec_d_prev1[j] + 5 * vec_d_prev2[j]) / 12;
-                        }
-                    } break;
-
+                        c = {23.f / 12, -16.f / 12, 5.f / 12};
+                        break;
                     case 4:  // Use three history points
-                    {
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        float* vec_d_prev2 = (float*)buffer_model[buffer_model.size() - 2]->data;
-                        float* vec_d_prev3 = (float*)buffer_model[buffer_model.size() - 3]->data;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x_next[j] = vec_x_cur[j] + (sigma_next - sigma) * (55 * vec_d_cur[j] - 59 * vec_d_prev1[j] + 37 * vec_d_prev2[j] - 9 * vec_d_prev3[j]) / 24;
-                        }
-                    } break;
+                        c = {55.f / 24, -59.f / 24, 37.f / 24, -9.f / 24};
+                        break;
                 }
+                kernels.multistep(x, denoised, sigma, d_cur, sigma_next - sigma, c, buffer_model);
 
                 // Manage buffer_model
                 if (buffer_model.size() == max_order - 1) {
-                    // Shift elements to the left
-                    for (int k = 0; k < max_order - 2; k++) {
-                        buffer_model[k] = buffer_model[k + 1];
-                    }
-                    buffer_model.back() = d_cur;  // Replace the last element with d_cur
-                } else {
-                    buffer_model.push_back(d_cur);
+                    buffer_model.pop_back();
                 }
+                buffer_model.insert(buffer_model.begin(), d_cur);
             }
         } break;
         case IPNDM_V_SAMPLE_METHOD:  // iPNDM_v sampler from https://github.com/zju-pi/diff-sampler/tree/main/diff-solvers-main
         {
             int max_order = 4;
-            std::vector<ggml_tensor*> buffer_model;
-            ggml_tensor* x_next = x;
+            std::vector<ggml_tensor*> buffer_model;  // newest first
 
             for (int i = 0; i < steps; i++) {
                 float sigma  = sigmas[i];
                 float t_next = sigmas[i + 1];
 
                 // Denoising step
-                ggml_tensor* denoised     = model(x, sigma, i + 1);
-                float* vec_denoised       = (float*)denoised->data;
-                struct ggml_tensor* d_cur = ggml_dup_tensor(work_ctx, x);
-                float* vec_d_cur          = (float*)d_cur->data;
-                float* vec_x              = (float*)x->data;
-
-                // d_cur = (x - denoised) / sigma
-                for (int j = 0; j < ggml_nelements(d_cur); j++) {
-                    vec_d_cur[j] = (vec_x[j] - vec_denoised[j]) / sigma;
+                ggml_tensor* denoised = model(x, sigma, i + 1);
+                if (denoised == nullptr) {
+                    return false;
                 }
+                struct ggml_tensor* d_cur = buffer_model.size() == max_order - 1 ? buffer_model.back() : ggml_dup_tensor(work_ctx, x);
 
                 int order   = std::min(max_order, i + 1);
                 float h_n   = t_next - sigma;
                 float h_n_1 = (i > 0) ? (sigma - sigmas[i - 1]) : h_n;
 
+                // d_cur = (x - denoised) / sigma, x += h_n * sum(c * d)
+                std::vector<float> c;
                 switch (order) {
                     case 1:  // First Euler step
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x[j] += vec_d_cur[j] * h_n;
-                        }
+                        c = {1.f};
                         break;
-
-                    case 2: {
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x[j] += h_n * ((2 + (h_n / h_n_1)) * vec_d_cur[j] - (h_n / h_n_1) * vec_d_prev1[j]) / 2;
-                        }
+                    case 2:
+                        c = {(2 + (h_n / h_n_1)) / 2, -(h_n / h_n_1) / 2};
                         break;
-                    }
-
-                    case 3: {
-                        float h_n_2        = (i > 1) ? (sigmas[i - 1] - sigmas[i - 2]) : h_n_1;
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        float* vec_d_prev2 = (buffer_model.size() > 1) ? (float*)buffer_model[buffer_model.size() - 2]->data : vec_d_prev1;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x[j] += h_n * ((23 * vec_d_cur[j] - 16 * vec_d_prev1[j] + 5 * vec_d_prev2[j]) / 12);
-                        }
+                    case 3:
+                        c = {23.f / 12, -16.f / 12, 5.f / 12};
                         break;
-                    }
-
-                    case 4: {
-                        float h_n_2        = (i > 1) ? (sigmas[i - 1] - sigmas[i - 2]) : h_n_1;
-                        float h_n_3        = (i > 2) ? (sigmas[i - 2] - sigmas[i - 3]) : h_n_2;
-                        float* vec_d_prev1 = (float*)buffer_model.back()->data;
-                        float* vec_d_prev2 = (buffer_model.size() > 1) ? (float*)buffer_model[buffer_model.size() - 2]->data : vec_d_prev1;
-                        float* vec_d_prev3 = (buffer_model.size() > 2) ? (float*)buffer_model[buffer_model.size() - 3]->data : vec_d_prev2;
-                        for (int j = 0; j < ggml_nelements(x_next); j++) {
-                            vec_x[j] += h_n * ((55 * vec_d_cur[j] - 59 * vec_d_prev1[j] + 37 * vec_d_prev2[j] - 9 * vec_d_prev3[j]) / 24);
-                        }
+                    case 4:
+                        c = {55.f / 24, -59.f / 24, 37.f / 24, -9.f / 24};
                         break;
-                    }
                 }
+                kernels.multistep(x, denoised, sigma, d_cur, h_n, c, buffer_model);
 
                 // Manage buffer_model
                 if (buffer_model.size() == max_order - 1) {
-                    buffer_model.erase(buffer_model.begin());
+                    buffer_model.pop_back();
                 }
-                buffer_model.push_back(d_cur);
-
-                // Prepare the next d tensor
-                d_cur = ggml_dup_tensor(work_ctx, x_next);
+                buffer_model.insert(buffer_model.begin(), d_cur);
             }
         } break;
         case LCM_SAMPLE_METHOD:  // Latent Consistency Models
         {
             struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, x);
-            struct ggml_tensor* d     = ggml_dup_tensor(work_ctx, x);
 
             for (int i = 0; i < steps; i++) {
                 float sigma = sigmas[i];
@@ -1206,27 +1339,14 @@ static bool sample_k_diffusion(sample_method_t method,
                     return false;
                 }
 
-                // x = denoised
-                {
-                    float* vec_x        = (float*)x->data;
-                    float* vec_denoised = (float*)denoised->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] = vec_denoised[j];
-                    }
-                }
-
                 if (sigmas[i + 1] > 0) {
-                    // x += sigmas[i + 1] * noise_sampler(sigmas[i], sigmas[i + 1])
-                    ggml_ext_im_set_randn_f32(noise, rng);
+                    // x = denoised + sigmas[i + 1] * noise_sampler(sigmas[i], sigmas[i + 1])
+                    ggml_ext_im_set_randn_f32(noise, rng, n_threads);
                     // noise = load_tensor_from_file(res_ctx, "./rand" + std::to_string(i+1) + ".bin");
-                    {
-                        float* vec_x     = (float*)x->data;
-                        float* vec_noise = (float*)noise->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = vec_x[j] + sigmas[i + 1] * vec_noise[j];
-                        }
-                    }
+                    kernels.axpby(x, 1.f, denoised, sigmas[i + 1], noise);
+                } else {
+                    // x = denoised
+                    memcpy(x->data, denoised->data, ggml_nbytes(x));
                 }
             }
         } break;
@@ -1262,8 +1382,6 @@ static bool sample_k_diffusion(sample_method_t method,
                               alphas_cumprod[i]);
             }
 
-            struct ggml_tensor* pred_original_sample =
-                ggml_dup_tensor(work_ctx, x);
             struct ggml_tensor* variance_noise =
                 ggml_dup_tensor(work_ctx, x);
 
@@ -1309,21 +1427,14 @@ static bool sample_k_diffusion(sample_method_t method,
                     // the first call has to be prescaled as x <- x /
                     // (c_in * sigma) with the k-diffusion pipeline
                     // and CompVisDenoiser.
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] *= std::sqrt(sigma * sigma + 1) /
-                                    sigma;
-                    }
+                    kernels.scale(x, std::sqrt(sigma * sigma + 1) / sigma);
                 } else {
                     // For the subsequent steps after the first one,
                     // at this point x = latents or x = sample, and
                     // needs to be prescaled with x <- sample / c_in
                     // to compensate for model() applying the scale
                     // c_in before the U-net F_theta
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] *= std::sqrt(sigma * sigma + 1);
-                    }
+                    kernels.scale(x, std::sqrt(sigma * sigma + 1));
                 }
                 // Note (also noise_pred in Diffuser's pipeline)
                 // model_output = model() is the D(x, sigma) as
@@ -1331,23 +1442,16 @@ static bool sample_k_diffusion(sample_method_t method,
                 // p. 8 (7), compare also p. 38 (226) therein.
                 struct ggml_tensor* model_output =
                     model(x, sigma, i + 1);
+                if (model_output == nullptr) {
+                    return false;
+                }
                 // Here model_output is still the k-diffusion denoiser
                 // output, not the U-net output F_theta(c_in(sigma) x;
                 // ...) in Karras et al. (2022), whereas Diffusers'
-                // model_output is F_theta(...). Recover the actual
+                // model_output is F_theta(...). The actual
                 // model_output, which is also referred to as the
                 // "Karras ODE derivative" d or d_cur in several
-                // samplers above.
-                {
-                    float* vec_x = (float*)x->data;
-                    float* vec_model_output =
-                        (float*)model_output->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_model_output[j] =
-                            (vec_x[j] - vec_model_output[j]) *
-                            (1 / sigma);
-                    }
-                }
+                // samplers above, is recovered inside ddim_step.
                 // 2. compute alphas, betas
                 float alpha_prod_t = alphas_cumprod[timestep];
                 // Note final_alpha_cumprod = alphas_cumprod[0] due to
@@ -1357,22 +1461,9 @@ static bool sample_k_diffusion(sample_method_t method,
                 // 3. compute predicted original sample from predicted
                 // noise also called "predicted x_0" of formula (12)
                 // from https://arxiv.org/pdf/2010.02502.pdf
-                {
-                    float* vec_x = (float*)x->data;
-                    float* vec_model_output =
-                        (float*)model_output->data;
-                    float* vec_pred_original_sample =
-                        (float*)pred_original_sample->data;
-                    // Note the substitution of latents or sample = x
-                    // * c_in = x / sqrt(sigma^2 + 1)
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_pred_original_sample[j] =
-                            (vec_x[j] / std::sqrt(sigma * sigma + 1) -
-                             std::sqrt(beta_prod_t) *
-                                 vec_model_output[j]) *
-                            (1 / std::sqrt(alpha_prod_t));
-                    }
-                }
+                //
+                // Note the substitution of latents or sample = x *
+                // c_in = x / sqrt(sigma^2 + 1)
                 // Assuming the "epsilon" prediction type, where below
                 // pred_epsilon = model_output is inserted, and is not
                 // defined/copied explicitly.
@@ -1389,33 +1480,23 @@ static bool sample_k_diffusion(sample_method_t method,
                 // 6. compute "direction pointing to x_t" of formula
                 // (12) from https://arxiv.org/pdf/2010.02502.pdf
                 // 7. compute x_t without "random noise" of formula
-                // (12) from https://arxiv.org/pdf/2010.02502.pdf
-                {
-                    float* vec_model_output = (float*)model_output->data;
-                    float* vec_pred_original_sample =
-                        (float*)pred_original_sample->data;
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        // Two step inner loop without an explicit
-                        // tensor
-                        float pred_sample_direction =
-                            std::sqrt(1 - alpha_prod_t_prev -
-                                      std::pow(std_dev_t, 2)) *
-                            vec_model_output[j];
-                        vec_x[j] = std::sqrt(alpha_prod_t_prev) *
-                                       vec_pred_original_sample[j] +
-                                   pred_sample_direction;
-                    }
-                }
+                // (12) from https://arxiv.org/pdf/2010.02502.pdf,
+                // then add std_dev_t * noise. Steps 3 to 7 run as
+                // one pass over the latent.
                 if (eta > 0) {
-                    ggml_ext_im_set_randn_f32(variance_noise, rng);
-                    float* vec_variance_noise =
-                        (float*)variance_noise->data;
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] += std_dev_t * vec_variance_noise[j];
-                    }
+                    ggml_ext_im_set_randn_f32(variance_noise, rng, n_threads);
                 }
+                kernels.ddim_step(x,
+                                  model_output,
+                                  sigma,
+                                  std::sqrt(sigma * sigma + 1),
+                                  std::sqrt(beta_prod_t),
+                                  std::sqrt(alpha_prod_t),
+                                  std::sqrt(alpha_prod_t_prev),
+                                  std::sqrt(1 - alpha_prod_t_prev - std::pow(std_dev_t, 2)),
+                                  eta > 0 ? variance_noise : nullptr,
+                                  1.f,
+                                  std_dev_t);
                 // See the note above: x = latents or sample here, and
                 // is not scaled by the c_in. For the final output
                 // this is correct, but for subsequent iterations, x
@@ -1452,8 +1533,6 @@ static bool sample_k_diffusion(sample_method_t method,
             }
             int original_steps = 50;
 
-            struct ggml_tensor* pred_original_sample =
-                ggml_dup_tensor(work_ctx, x);
             struct ggml_tensor* noise =
                 ggml_dup_tensor(work_ctx, x);
 
@@ -1477,28 +1556,14 @@ static bool sample_k_diffusion(sample_method_t method,
                 // as in DDIM (and see there for detailed comments)
                 float sigma = compvis_sigmas[timestep];
                 if (i == 0) {
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] *= std::sqrt(sigma * sigma + 1) /
-                                    sigma;
-                    }
+                    kernels.scale(x, std::sqrt(sigma * sigma + 1) / sigma);
                 } else {
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_x[j] *= std::sqrt(sigma * sigma + 1);
-                    }
+                    kernels.scale(x, std::sqrt(sigma * sigma + 1));
                 }
                 struct ggml_tensor* model_output =
                     model(x, sigma, i + 1);
-                {
-                    float* vec_x = (float*)x->data;
-                    float* vec_model_output =
-                        (float*)model_output->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_model_output[j] =
-                            (vec_x[j] - vec_model_output[j]) *
-                            (1 / sigma);
-                    }
+                if (model_output == nullptr) {
+                    return false;
                 }
                 // 2. compute alphas, betas
                 //
@@ -1527,43 +1592,15 @@ static bool sample_k_diffusion(sample_method_t method,
                 // the model parameterization
                 //
                 // This section is also exactly the same as DDIM
-                {
-                    float* vec_x = (float*)x->data;
-                    float* vec_model_output =
-                        (float*)model_output->data;
-                    float* vec_pred_original_sample =
-                        (float*)pred_original_sample->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_pred_original_sample[j] =
-                            (vec_x[j] / std::sqrt(sigma * sigma + 1) -
-                             std::sqrt(beta_prod_t) *
-                                 vec_model_output[j]) *
-                            (1 / std::sqrt(alpha_prod_t));
-                    }
-                }
                 // This consistency function step can be difficult to
                 // decipher from Algorithm 4, as it is simply stated
                 // using a consistency function. This step is the
                 // modified DDIM, i.e. p. 8 (32) in Zheng et
                 // al. (2024), with eta set to 0 (see the paragraph
                 // immediately thereafter that states this somewhat
-                // obliquely).
-                {
-                    float* vec_pred_original_sample =
-                        (float*)pred_original_sample->data;
-                    float* vec_model_output =
-                        (float*)model_output->data;
-                    float* vec_x = (float*)x->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        // Substituting x = pred_noised_sample and
-                        // pred_epsilon = model_output
-                        vec_x[j] =
-                            std::sqrt(alpha_prod_s) *
-                                vec_pred_original_sample[j] +
-                            std::sqrt(beta_prod_s) *
-                                vec_model_output[j];
-                    }
-                }
+                // obliquely). Substituting x = pred_noised_sample
+                // and pred_epsilon = model_output.
+                //
                 // 4. Sample and inject noise z ~ N(0, I) for
                 // MultiStep Inference Noise is not used on the final
                 // timestep of the timestep schedule. This also means
@@ -1573,25 +1610,25 @@ static bool sample_k_diffusion(sample_method_t method,
                 // step. When eta = 0, it represents deterministic
                 // sampling, whereas eta = 1 indicates full stochastic
                 // sampling.
-                if (eta > 0 && i != steps - 1) {
-                    // In this case, x is still pred_noised_sample,
-                    // continue in-place
-                    ggml_ext_im_set_randn_f32(noise, rng);
-                    float* vec_x     = (float*)x->data;
-                    float* vec_noise = (float*)noise->data;
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        // Corresponding to (35) in Zheng et
-                        // al. (2024), substituting x =
-                        // pred_noised_sample
-                        vec_x[j] =
-                            std::sqrt(alpha_prod_t_prev /
-                                      alpha_prod_s) *
-                                vec_x[j] +
-                            std::sqrt(1 - alpha_prod_t_prev /
-                                              alpha_prod_s) *
-                                vec_noise[j];
-                    }
+                //
+                // The noise step corresponds to (35) in Zheng et
+                // al. (2024), substituting x = pred_noised_sample,
+                // and is fused with the steps above.
+                bool add_noise = eta > 0 && i != steps - 1;
+                if (add_noise) {
+                    ggml_ext_im_set_randn_f32(noise, rng, n_threads);
                 }
+                kernels.ddim_step(x,
+                                  model_output,
+                                  sigma,
+                                  std::sqrt(sigma * sigma + 1),
+                                  std::sqrt(beta_prod_t),
+                                  std::sqrt(alpha_prod_t),
+                                  std::sqrt(alpha_prod_s),
+                                  std::sqrt(beta_prod_s),
+                                  add_noise ? noise : nullptr,
+                                  std::sqrt(alpha_prod_t_prev / alpha_prod_s),
+                                  std::sqrt(1 - alpha_prod_t_prev / alpha_prod_s));
             }
         } break;
 
@@ -31,6 +31,8 @@ struct DiffusionModel {
                          DiffusionParams diffusion_params,
                          struct ggml_tensor** output     = nullptr,
                          struct ggml_context* output_ctx = nullptr)                     = 0;
+    virtual void map_params(ModelLoader& model_loader,
+                            const std::map<std::string, struct ggml_tensor*>& tensors) = 0;
     virtual void alloc_params_buffer()                                                  = 0;
     virtual void free_params_buffer()                                                   = 0;
     virtual void free_compute_buffer()                                                  = 0;
@@ -39,22 +41,30 @@ struct DiffusionModel {
     virtual void set_weight_adapter(const std::shared_ptr<WeightAdapter>& adapter){};
     virtual int64_t get_adm_in_channels()             = 0;
     virtual void set_flash_attn_enabled(bool enabled) = 0;
+    // whether x/context/y/c_concat/timesteps may carry several conditions stacked along the batch dim
+    virtual bool supports_batched_conditions() { return false; }
 };
 
 struct UNetModel : public DiffusionModel {
     UNetModelRunner unet;
+    SDVersion version;
 
     UNetModel(ggml_backend_t backend,
               bool offload_params_to_cpu,
               const String2TensorStorage& tensor_storage_map = {},
               SDVersion version                              = VERSION_SD1)
-        : unet(backend, offload_params_to_cpu, tensor_storage_map, "model.diffusion_model", version) {
+        : unet(backend, offload_params_to_cpu, tensor_storage_map, "model.diffusion_model", version), version(version) {
     }
 
     std::string get_desc() override {
         return unet.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        unet.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         unet.alloc_params_buffer();
     }
@@ -87,6 +97,11 @@ struct UNetModel : public DiffusionModel {
         unet.set_flash_attention_enabled(enabled);
     }
 
+    bool supports_batched_conditions() override {
+        // SVD already uses the batch dim for video frames
+        return version != VERSION_SVD;
+    }
+
     bool compute(int n_threads,
                  DiffusionParams diffusion_params,
                  struct ggml_tensor** output     = nullptr,
@@ -116,6 +131,11 @@ struct MMDiTModel : public DiffusionModel {
         return mmdit.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        mmdit.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         mmdit.alloc_params_buffer();
     }
@@ -148,6 +168,10 @@ struct MMDiTModel : public DiffusionModel {
         mmdit.set_flash_attention_enabled(enabled);
     }
 
+    bool supports_batched_conditions() override {
+        return true;
+    }
+
     bool compute(int n_threads,
                  DiffusionParams diffusion_params,
                  struct ggml_tensor** output     = nullptr,
@@ -178,6 +202,11 @@ struct FluxModel : public DiffusionModel {
         return flux.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        flux.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         flux.alloc_params_buffer();
     }
@@ -245,6 +274,11 @@ struct WanModel : public DiffusionModel {
         return wan.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        wan.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         wan.alloc_params_buffer();
     }
@@ -311,6 +345,11 @@ struct QwenImageModel : public DiffusionModel {
         return qwen_image.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        qwen_image.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         qwen_image.alloc_params_buffer();
     }
@@ -374,6 +413,11 @@ struct ZImageModel : public DiffusionModel {
         return z_image.get_desc();
     }
 
+    void map_params(ModelLoader& model_loader,
+                    const std::map<std::string, struct ggml_tensor*>& tensors) override {
+        z_image.map_params(model_loader, tensors);
+    }
+
     void alloc_params_buffer() override {
         z_image.alloc_params_buffer();
     }
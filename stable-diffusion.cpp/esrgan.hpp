@@ -363,6 +363,18 @@ struct ESRGAN : public GGMLRunner {
         };
         return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
+
+    bool compute_tiles(const int n_threads,
+                       const std::vector<struct ggml_tensor*>& inputs,
+                       const std::vector<struct ggml_tensor*>& outputs) {
+        std::vector<get_graph_cb_t> get_graphs;
+        for (auto x : inputs) {
+            get_graphs.push_back([this, x]() -> struct ggml_cgraph* {
+                return build_graph(x);
+            });
+        }
+        return compute_parallel(get_graphs, n_threads, outputs);
+    }
 };
 
 #endif  // __ESRGAN_HPP__
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <time.h>
 #include <cctype>
 #include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
@@ -37,6 +38,7 @@ struct SDCliParams {
     int preview_interval     = 1;
     std::string preview_path = "preview.png";
     int preview_fps          = 16;
+    std::string profile_path;
     bool taesd_preview       = false;
     bool preview_noisy       = false;
     bool color               = false;
@@ -55,6 +57,10 @@ struct SDCliParams {
              "--preview-path",
              "path to write preview image to (default: ./preview.png)",
              &preview_path},
+            {"",
+             "--profile",
+             "profile every graph node and write a Chrome trace to this path (slows down generation)",
+             &profile_path},
         };
 
         options.int_options = {
@@ -179,7 +185,8 @@ struct SDCliParams {
             << "  preview_path: \"" << preview_path << "\",\n"
             << "  preview_fps: " << preview_fps << ",\n"
             << "  taesd_preview: " << (taesd_preview ? "true" : "false") << ",\n"
-            << "  preview_noisy: " << (preview_noisy ? "true" : "false") << "\n"
+            << "  preview_noisy: " << (preview_noisy ? "true" : "false") << ",\n"
+            << "  profile_path: \"" << profile_path << "\"\n"
             << "}";
         return oss.str();
     }
@@ -338,6 +345,74 @@ void step_callback(int step, int frame_count, sd_image_t* image, bool is_noisy,
     }
 }
 
+// Writes the frames of generate_video to an AVI as they are decoded. A video of a single
+// frame is kept and saved as an image instead.
+struct VideoFrameSink {
+    std::string path;
+    int fps = 16;
+    MjpgAviWriter writer;
+    sd_image_t single_frame = {0, 0, 0, nullptr};
+
+    ~VideoFrameSink() {
+        free(single_frame.data);
+    }
+};
+
+void video_frame_callback(int frame_index, int frame_count, const sd_image_t* frame, void* data) {
+    VideoFrameSink* sink = (VideoFrameSink*)data;
+    if (frame_count == 1) {
+        size_t size             = (size_t)frame->width * frame->height * frame->channel;
+        sink->single_frame      = *frame;
+        sink->single_frame.data = (uint8_t*)malloc(size);
+        if (sink->single_frame.data != nullptr) {
+            memcpy(sink->single_frame.data, frame->data, size);
+        }
+        return;
+    }
+    if (frame_index == 0 && !sink->writer.open(sink->path.c_str(), frame->width, frame->height, frame->channel, sink->fps)) {
+        LOG_ERROR("open '%s' for writing failed", sink->path.c_str());
+    }
+    sink->writer.add_frame(*frame);
+}
+
+// writes the Chrome trace of the last generation and logs where the time went
+void write_profile(const std::string& path) {
+    char* trace = sd_profile_chrome_trace();
+    if (trace != nullptr) {
+        std::ofstream file(path, std::ios::binary);
+        file << trace;
+        free(trace);
+        if (file) {
+            LOG_INFO("profile trace saved to '%s'", path.c_str());
+        } else {
+            LOG_ERROR("write profile trace to '%s' failed", path.c_str());
+        }
+    }
+
+    char* report_str = sd_profile_report_json(10);
+    if (report_str == nullptr) {
+        return;
+    }
+    json report = json::parse(report_str);
+    free(report_str);
+    LOG_INFO("profiled %d graphs, %d nodes, %.2fms", report["graphs"].get<int>(), report["nodes"].get<int>(), report["total_ms"].get<double>());
+    size_t num_ops = std::min<size_t>(report["by_op"].size(), 10);
+    for (size_t i = 0; i < num_ops; i++) {
+        const auto& item = report["by_op"][i];
+        LOG_INFO("  op %-24s %8.2fms %5.1f%% (%d)",
+                 item["op"].get<std::string>().c_str(),
+                 item["ms"].get<double>(),
+                 item["percent"].get<double>(),
+                 item["count"].get<int>());
+    }
+    for (const auto& item : report["by_block"]) {
+        LOG_INFO("  block %s %.2fms %.1f%%",
+                 item["block"].get<std::string>().c_str(),
+                 item["ms"].get<double>(),
+                 item["percent"].get<double>());
+    }
+}
+
 int main(int argc, const char* argv[]) {
     if (argc > 1 && std::string(argv[1]) == "--version") {
         std::cout << version_string() << "\n";
@@ -375,6 +450,7 @@ int main(int argc, const char* argv[]) {
                             !cli_params.preview_noisy,
                             cli_params.preview_noisy,
                             (void*)&cli_params);
+    sd_set_profiling(!cli_params.profile_path.empty());
 
     LOG_DEBUG("version: %s", version_string().c_str());
     LOG_DEBUG("%s", sd_get_system_info());
@@ -495,7 +571,8 @@ int main(int argc, const char* argv[]) {
                              0.08f,
                              0.8f,
                              1.0f,
-                             false);
+                             false,
+                             ctx_params.n_threads);
         }
     }
 
@@ -547,6 +624,53 @@ int main(int argc, const char* argv[]) {
 
     sd_ctx_params_t sd_ctx_params = ctx_params.to_sd_ctx_params_t(vae_decode_only, true, cli_params.taesd_preview);
 
+    // create directory if not exists
+    {
+        const fs::path out_path = cli_params.output_path;
+        if (const fs::path out_dir = out_path.parent_path(); !out_dir.empty()) {
+            std::error_code ec;
+            fs::create_directories(out_dir, ec);  // OK if already exists
+            if (ec) {
+                LOG_ERROR("failed to create directory '%s': %s",
+                          out_dir.string().c_str(), ec.message().c_str());
+                return 1;
+            }
+        }
+    }
+
+    std::string base_path;
+    std::string file_ext;
+    std::string file_ext_lower;
+    bool is_jpg;
+    size_t last_dot_pos   = cli_params.output_path.find_last_of(".");
+    size_t last_slash_pos = std::min(cli_params.output_path.find_last_of("/"),
+                                     cli_params.output_path.find_last_of("\\"));
+    if (last_dot_pos != std::string::npos && (last_slash_pos == std::string::npos || last_dot_pos > last_slash_pos)) {  // filename has extension
+        base_path = cli_params.output_path.substr(0, last_dot_pos);
+        file_ext = file_ext_lower = cli_params.output_path.substr(last_dot_pos);
+        std::transform(file_ext.begin(), file_ext.end(), file_ext_lower.begin(), ::tolower);
+        is_jpg = (file_ext_lower == ".jpg" || file_ext_lower == ".jpeg" || file_ext_lower == ".jpe");
+    } else {
+        base_path = cli_params.output_path;
+        file_ext = file_ext_lower = "";
+        is_jpg                    = false;
+    }
+
+    std::string vid_output_path = cli_params.output_path;
+    if (file_ext_lower == ".png") {
+        vid_output_path = base_path + ".avi";
+    }
+
+    // frames are written as they are decoded unless they still have to be upscaled
+    VideoFrameSink video_sink;
+    bool upscale_results = ctx_params.esrgan_path.size() > 0 && gen_params.upscale_repeats > 0;
+    bool stream_video    = cli_params.mode == VID_GEN && !upscale_results;
+    if (stream_video) {
+        video_sink.path = vid_output_path;
+        video_sink.fps  = gen_params.fps;
+        sd_set_video_frame_callback(video_frame_callback, &video_sink);
+    }
+
     sd_image_t* results = nullptr;
     int num_results     = 0;
 
@@ -646,20 +770,29 @@ int main(int argc, const char* argv[]) {
             free_sd_ctx(sd_ctx);
             return 1;
         }
+        if (video_sink.single_frame.data != nullptr && num_results == 1) {
+            results[0].data              = video_sink.single_frame.data;
+            video_sink.single_frame.data = nullptr;
+        }
+
+        if (!cli_params.profile_path.empty()) {
+            write_profile(cli_params.profile_path);
+        }
 
         free_sd_ctx(sd_ctx);
     }
 
     int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
     if (ctx_params.esrgan_path.size() > 0 && gen_params.upscale_repeats > 0) {
-        upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx(ctx_params.esrgan_path.c_str(),
-                                                        ctx_params.offload_params_to_cpu,
-                                                        ctx_params.diffusion_conv_direct,
-                                                        ctx_params.n_threads,
-                                                        gen_params.upscale_tile_size);
+        upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx_ex(ctx_params.esrgan_path.c_str(),
+                                                           ctx_params.offload_params_to_cpu,
+                                                           ctx_params.diffusion_conv_direct,
+                                                           ctx_params.n_threads,
+                                                           gen_params.upscale_tile_size,
+                                                           gen_params.upscale_tile_parallel);
 
         if (upscaler_ctx == nullptr) {
-            LOG_ERROR("new_upscaler_ctx failed");
+            LOG_ERROR("new_upscaler_ctx_ex failed");
         } else {
             for (int i = 0; i < num_results; i++) {
                 if (results[i].data == nullptr) {
@@ -680,45 +813,11 @@ int main(int argc, const char* argv[]) {
         }
     }
 
-    // create directory if not exists
-    {
-        const fs::path out_path = cli_params.output_path;
-        if (const fs::path out_dir = out_path.parent_path(); !out_dir.empty()) {
-            std::error_code ec;
-            fs::create_directories(out_dir, ec);  // OK if already exists
-            if (ec) {
-                LOG_ERROR("failed to create directory '%s': %s",
-                          out_dir.string().c_str(), ec.message().c_str());
-                return 1;
-            }
-        }
-    }
-
-    std::string base_path;
-    std::string file_ext;
-    std::string file_ext_lower;
-    bool is_jpg;
-    size_t last_dot_pos   = cli_params.output_path.find_last_of(".");
-    size_t last_slash_pos = std::min(cli_params.output_path.find_last_of("/"),
-                                     cli_params.output_path.find_last_of("\\"));
-    if (last_dot_pos != std::string::npos && (last_slash_pos == std::string::npos || last_dot_pos > last_slash_pos)) {  // filename has extension
-        base_path = cli_params.output_path.substr(0, last_dot_pos);
-        file_ext = file_ext_lower = cli_params.output_path.substr(last_dot_pos);
-        std::transform(file_ext.begin(), file_ext.end(), file_ext_lower.begin(), ::tolower);
-        is_jpg = (file_ext_lower == ".jpg" || file_ext_lower == ".jpeg" || file_ext_lower == ".jpe");
-    } else {
-        base_path = cli_params.output_path;
-        file_ext = file_ext_lower = "";
-        is_jpg                    = false;
-    }
-
     if (cli_params.mode == VID_GEN && num_results > 1) {
-        std::string vid_output_path = cli_params.output_path;
-        if (file_ext_lower == ".png") {
-            vid_output_path = base_path + ".avi";
-        }
-        create_mjpg_avi_from_sd_images(vid_output_path.c_str(), results, num_results, gen_params.fps);
-        LOG_INFO("save result MJPG AVI video to '%s'\n", vid_output_path.c_str());
+        int write_ok = stream_video
+                           ? video_sink.writer.close()
+                           : create_mjpg_avi_from_sd_images(vid_output_path.c_str(), results, num_results, gen_params.fps);
+        LOG_INFO("save result MJPG AVI video to '%s' (%s)", vid_output_path.c_str(), write_ok == 0 ? "success" : "failure");
     } else {
         // appending ".png" to absent or unknown extension
         if (!is_jpg && file_ext_lower != ".png") {
@@ -439,15 +439,25 @@ struct SDContextParams {
     std::map<std::string, std::string> embedding_map;
     std::vector<sd_embedding_t> embedding_vec;
 
-    rng_type_t rng_type         = CUDA_RNG;
-    rng_type_t sampler_rng_type = RNG_TYPE_COUNT;
-    bool offload_params_to_cpu  = false;
-    bool control_net_cpu        = false;
-    bool clip_on_cpu            = false;
-    bool vae_on_cpu             = false;
-    bool diffusion_flash_attn   = false;
-    bool diffusion_conv_direct  = false;
-    bool vae_conv_direct        = false;
+    rng_type_t rng_type           = CUDA_RNG;
+    rng_type_t sampler_rng_type   = RNG_TYPE_COUNT;
+    bool offload_params_to_cpu    = false;
+    bool control_net_cpu          = false;
+    bool clip_on_cpu              = false;
+    bool vae_on_cpu               = false;
+    bool diffusion_flash_attn     = false;
+    bool diffusion_conv_direct    = false;
+    bool diffusion_batched_cfg    = false;
+    bool diffusion_batched_images = false;
+    bool vae_conv_direct          = false;
+    bool vae_pipeline             = false;
+    bool enable_mmap              = true;
+    int prompt_cache_mb           = 64;
+    int lora_cache_mb             = 0;
+    bool lora_snapshots           = false;
+    std::string cpu_mask;
+    int numa_node       = -1;
+    int threadpool_poll = 50;
 
     bool chroma_use_dit_mask = true;
     bool chroma_use_t5_mask  = false;
@@ -456,7 +466,7 @@ struct SDContextParams {
     prediction_t prediction           = PREDICTION_COUNT;
     lora_apply_mode_t lora_apply_mode = LORA_APPLY_AUTO;
 
-    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f};
+    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f, 1};
     bool force_sdxl_vae_conv_scale       = false;
 
     float flow_shift = INFINITY;
@@ -543,6 +553,10 @@ struct SDContextParams {
              "--upscale-model",
              "path to esrgan model.",
              &esrgan_path},
+            {"",
+             "--cpu-mask",
+             "CPUs the compute threads run on, e.g. \"0-7,16-23\" (default: any)",
+             &cpu_mask},
         };
 
         options.int_options = {
@@ -555,6 +569,26 @@ struct SDContextParams {
              "--chroma-t5-mask-pad",
              "t5 mask pad size of chroma",
              &chroma_t5_mask_pad},
+            {"",
+             "--prompt-cache-mb",
+             "memory budget in MB for cached prompt embeddings, 0 to disable (default: 64)",
+             &prompt_cache_mb},
+            {"",
+             "--lora-cache-mb",
+             "memory budget in MB for LoRAs kept loaded after they are no longer used, 0 keeps only the LoRAs in use (default: 0)",
+             &lora_cache_mb},
+            {"",
+             "--numa-node",
+             "keep the compute threads on the CPUs of this NUMA node, -1 for any (default: -1)",
+             &numa_node},
+            {"",
+             "--threadpool-poll",
+             "how long idle compute threads busy wait for the next graph, 0 (sleep) to 100 (default: 50)",
+             &threadpool_poll},
+            {"",
+             "--vae-tile-parallel",
+             "number of vae tiles processed concurrently, CPU backend only (default: 1)",
+             &vae_tiling_params.parallel_tiles},
         };
 
         options.float_options = {
@@ -601,10 +635,30 @@ struct SDContextParams {
              "--diffusion-conv-direct",
              "use ggml_conv2d_direct in the diffusion model",
              true, &diffusion_conv_direct},
+            {"",
+             "--diffusion-batched-cfg",
+             "run cond/uncond through the diffusion model as one batch (UNet/MMDiT only, uses more memory)",
+             true, &diffusion_batched_cfg},
+            {"",
+             "--diffusion-batched-images",
+             "sample all images of a batch in one diffusion model batch (UNet/MMDiT only, uses more memory)",
+             true, &diffusion_batched_images},
+            {"",
+             "--vae-pipeline",
+             "decode finished images while the next one is sampled (CPU VAE only, uses more memory)",
+             true, &vae_pipeline},
+            {"",
+             "--lora-snapshots",
+             "with --lora-apply-mode immediately, keep a copy of the weights LoRAs modify so changing LoRAs restores them exactly (uses more RAM)",
+             true, &lora_snapshots},
             {"",
              "--vae-conv-direct",
              "use ggml_conv2d_direct in the vae model",
              true, &vae_conv_direct},
+            {"",
+             "--disable-mmap",
+             "read model weights with buffered file reads instead of memory-mapping them",
+             false, &enable_mmap},
             {"",
              "--chroma-disable-dit-mask",
              "disable dit mask for chroma",
@@ -867,7 +921,17 @@ struct SDContextParams {
             << "  vae_on_cpu: " << (vae_on_cpu ? "true" : "false") << ",\n"
             << "  diffusion_flash_attn: " << (diffusion_flash_attn ? "true" : "false") << ",\n"
             << "  diffusion_conv_direct: " << (diffusion_conv_direct ? "true" : "false") << ",\n"
+            << "  diffusion_batched_cfg: " << (diffusion_batched_cfg ? "true" : "false") << ",\n"
+            << "  diffusion_batched_images: " << (diffusion_batched_images ? "true" : "false") << ",\n"
             << "  vae_conv_direct: " << (vae_conv_direct ? "true" : "false") << ",\n"
+            << "  vae_pipeline: " << (vae_pipeline ? "true" : "false") << ",\n"
+            << "  enable_mmap: " << (enable_mmap ? "true" : "false") << ",\n"
+            << "  prompt_cache_mb: " << prompt_cache_mb << ",\n"
+            << "  lora_cache_mb: " << lora_cache_mb << ",\n"
+            << "  lora_snapshots: " << (lora_snapshots ? "true" : "false") << ",\n"
+            << "  cpu_mask: \"" << cpu_mask << "\",\n"
+            << "  numa_node: " << numa_node << ",\n"
+            << "  threadpool_poll: " << threadpool_poll << ",\n"
             << "  chroma_use_dit_mask: " << (chroma_use_dit_mask ? "true" : "false") << ",\n"
             << "  chroma_use_t5_mask: " << (chroma_use_t5_mask ? "true" : "false") << ",\n"
             << "  chroma_t5_mask_pad: " << chroma_t5_mask_pad << ",\n"
@@ -879,7 +943,8 @@ struct SDContextParams {
             << vae_tiling_params.tile_size_y << ", "
             << vae_tiling_params.target_overlap << ", "
             << vae_tiling_params.rel_size_x << ", "
-            << vae_tiling_params.rel_size_y << " },\n"
+            << vae_tiling_params.rel_size_y << ", "
+            << vae_tiling_params.parallel_tiles << " },\n"
             << "  force_sdxl_vae_conv_scale: " << (force_sdxl_vae_conv_scale ? "true" : "false") << "\n"
             << "}";
         return oss.str();
@@ -933,6 +998,16 @@ struct SDContextParams {
             chroma_use_t5_mask,
             chroma_t5_mask_pad,
             flow_shift,
+            diffusion_batched_cfg,
+            enable_mmap,
+            prompt_cache_mb,
+            diffusion_batched_images,
+            vae_pipeline,
+            lora_cache_mb,
+            lora_snapshots,
+            cpu_mask.c_str(),
+            numa_node,
+            threadpool_poll,
         };
         return sd_ctx_params;
     }
@@ -1015,8 +1090,9 @@ struct SDGenerationParams {
     std::string pm_id_embed_path;
     float pm_style_strength = 20.f;
 
-    int upscale_repeats   = 1;
-    int upscale_tile_size = 128;
+    int upscale_repeats       = 1;
+    int upscale_tile_size     = 128;
+    int upscale_tile_parallel = 1;
 
     std::map<std::string, float> lora_map;
     std::map<std::string, float> high_noise_lora_map;
@@ -1117,6 +1193,10 @@ struct SDGenerationParams {
              "--upscale-tile-size",
              "tile size for ESRGAN upscaling (default: 128)",
              &upscale_tile_size},
+            {"",
+             "--upscale-tile-parallel",
+             "number of ESRGAN tiles processed concurrently, CPU backend only (default: 1)",
+             &upscale_tile_parallel},
         };
 
         options.float_options = {
@@ -1780,6 +1860,7 @@ struct SDGenerationParams {
             << "  seed: " << seed << ",\n"
             << "  upscale_repeats: " << upscale_repeats << ",\n"
             << "  upscale_tile_size: " << upscale_tile_size << ",\n"
+            << "  upscale_tile_parallel: " << upscale_tile_parallel << ",\n"
             << "}";
         free(sample_params_str);
         free(high_noise_sample_params_str);
@@ -12,6 +12,8 @@
 #include "stable-diffusion.h"
 
 #include "common/common.hpp"
+#include "model_registry.h"
+#include "request_scheduler.h"
 
 namespace fs = std::filesystem;
 
@@ -104,9 +106,15 @@ std::string iso_timestamp_now() {
 struct SDSvrParams {
     std::string listen_ip = "127.0.0.1";
     int listen_port       = 1234;
+    int max_queue_size    = 16;
+    int max_batch_size    = 8;
+    std::string models_dir;
+    int max_models        = 1;
+    int models_ram_mb     = 0;
     bool normal_exit      = false;
     bool verbose          = false;
     bool color            = false;
+    bool profile          = false;
 
     ArgOptions get_options() {
         ArgOptions options;
@@ -115,13 +123,34 @@ struct SDSvrParams {
             {"-l",
              "--listen-ip",
              "server listen ip (default: 127.0.0.1)",
-             &listen_ip}};
+             &listen_ip},
+            {"",
+             "--models-dir",
+             "directory of additional checkpoints selectable by the request's \"model\" field (file name without extension)",
+             &models_dir},
+        };
 
         options.int_options = {
             {"",
              "--listen-port",
              "server listen port (default: 1234)",
              &listen_port},
+            {"",
+             "--max-queue",
+             "max number of queued requests, further requests get 429 (default: 16)",
+             &max_queue_size},
+            {"",
+             "--max-batch",
+             "max images per generate run when merging identical queued requests, 1 disables merging (default: 8)",
+             &max_batch_size},
+            {"",
+             "--max-models",
+             "max number of models kept loaded, least recently used ones are unloaded (default: 1)",
+             &max_models},
+            {"",
+             "--models-ram-mb",
+             "memory budget in MB for loaded models, estimated from their file sizes, 0 for no limit (default: 0)",
+             &models_ram_mb},
         };
 
         options.bool_options = {
@@ -133,6 +162,10 @@ struct SDSvrParams {
              "--color",
              "colors the logging tags according to level",
              true, &color},
+            {"",
+             "--profile",
+             "profile every request and return a per-op/per-block summary in the response (slows down generation)",
+             true, &profile},
         };
 
         auto on_help_arg = [&](int argc, const char** argv, int index) {
@@ -159,6 +192,26 @@ struct SDSvrParams {
             LOG_ERROR("error: listen_port should be in the range [0, 65535]");
             return false;
         }
+
+        if (max_queue_size <= 0) {
+            LOG_ERROR("error: max_queue should be greater than 0");
+            return false;
+        }
+
+        if (max_batch_size <= 0) {
+            LOG_ERROR("error: max_batch should be greater than 0");
+            return false;
+        }
+
+        if (max_models <= 0) {
+            LOG_ERROR("error: max_models should be greater than 0");
+            return false;
+        }
+
+        if (models_ram_mb < 0) {
+            LOG_ERROR("error: models_ram_mb should not be negative");
+            return false;
+        }
         return true;
     }
 
@@ -167,6 +220,12 @@ struct SDSvrParams {
         oss << "SDSvrParams {\n"
             << "  listen_ip: " << listen_ip << ",\n"
             << "  listen_port: \"" << listen_port << "\",\n"
+            << "  max_queue_size: " << max_queue_size << ",\n"
+            << "  max_batch_size: " << max_batch_size << ",\n"
+            << "  models_dir: \"" << models_dir << "\",\n"
+            << "  max_models: " << max_models << ",\n"
+            << "  models_ram_mb: " << models_ram_mb << ",\n"
+            << "  profile: " << (profile ? "true" : "false") << ",\n"
             << "}";
         return oss.str();
     }
@@ -281,15 +340,52 @@ int main(int argc, const char** argv) {
     LOG_DEBUG("%s", ctx_params.to_string().c_str());
     LOG_DEBUG("%s", default_gen_params.to_string().c_str());
 
-    sd_ctx_params_t sd_ctx_params = ctx_params.to_sd_ctx_params_t(false, false, false);
-    sd_ctx_t* sd_ctx              = new_sd_ctx(&sd_ctx_params);
-
-    if (sd_ctx == nullptr) {
+    ModelRegistry registry(svr_params.max_models, (uint64_t)svr_params.models_ram_mb * 1024 * 1024);
+    std::string default_model = fs::path(ctx_params.diffusion_model_path.empty() ? ctx_params.model_path : ctx_params.diffusion_model_path).stem().string();
+    registry.add(default_model.empty() ? "default" : default_model, ctx_params);
+    if (!svr_params.models_dir.empty()) {
+        registry.add_dir(svr_params.models_dir, ctx_params);
+    }
+    if (registry.acquire("") == nullptr) {
         LOG_ERROR("new_sd_ctx_t failed");
         return 1;
     }
 
-    std::mutex sd_ctx_mutex;
+    sd_set_profiling(svr_params.profile);
+
+    RequestScheduler scheduler(svr_params.max_queue_size, svr_params.max_batch_size);
+
+    // summary of the last run, called on the scheduler thread right after it
+    auto collect_profile = [&]() -> std::string {
+        if (!svr_params.profile) {
+            return "";
+        }
+        char* report = sd_profile_report_json(32);
+        if (report == nullptr) {
+            return "";
+        }
+        std::string result = report;
+        free(report);
+        return result;
+    };
+
+    // queues the job and waits for it, returns false if res was already filled (rejected or cancelled)
+    auto schedule_job = [&](const std::shared_ptr<GenerationJob>& job, const httplib::Request& req, httplib::Response& res) -> bool {
+        if (scheduler.submit(job) == nullptr) {
+            res.status = 429;
+            res.set_header("Retry-After", "1");
+            res.set_content(R"({"error":"server busy, request queue is full"})", "application/json");
+            return false;
+        }
+        if (!scheduler.wait(job, [&]() { return req.is_connection_closed(); })) {
+            LOG_INFO("client disconnected, request cancelled");
+            res.status = 499;
+            return false;
+        }
+        auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(job->start_time - job->enqueue_time).count();
+        res.set_header("X-Queue-Wait-Ms", std::to_string(wait_ms));
+        return true;
+    };
 
     httplib::Server svr;
 
@@ -315,11 +411,61 @@ int main(int argc, const char** argv) {
         res.set_content(R"({"ok":true,"service":"sd-cpp-http"})", "application/json");
     });
 
-    // models endpoint (minimal)
+    // models endpoint, resident models are loaded, the others get loaded on first use
     svr.Get("/v1/models", [&](const httplib::Request&, httplib::Response& res) {
         json r;
-        r["data"] = json::array();
-        r["data"].push_back({{"id", "sd-cpp-local"}, {"object", "model"}, {"owned_by", "local"}});
+        r["object"] = "list";
+        r["data"]   = json::array();
+        for (const auto& model : registry.list()) {
+            r["data"].push_back({
+                {"id", model.name},
+                {"object", "model"},
+                {"owned_by", "local"},
+                {"resident", model.resident},
+                {"default", model.is_default},
+                {"size_mb", model.size_bytes / 1024.0 / 1024.0},
+                {"loads", model.loads},
+            });
+        }
+        res.set_content(r.dump(), "application/json");
+    });
+
+    svr.Get("/v1/metrics", [&](const httplib::Request&, httplib::Response& res) {
+        SchedulerMetrics metrics = scheduler.get_metrics();
+        json r;
+        r["queue"] = {
+            {"depth", metrics.queue_depth},
+            {"max_size", metrics.max_queue_size},
+            {"running", metrics.running},
+            {"submitted", metrics.submitted},
+            {"completed", metrics.completed},
+            {"rejected", metrics.rejected},
+            {"cancelled", metrics.cancelled},
+            {"runs", metrics.runs},
+            {"grouped_jobs", metrics.grouped_jobs},
+            {"wait_ms_avg", metrics.wait_ms_avg},
+            {"wait_ms_p50", metrics.wait_ms_p50},
+            {"wait_ms_p99", metrics.wait_ms_p99},
+            {"wait_ms_max", metrics.wait_ms_max},
+            {"run_ms_avg", metrics.run_ms_avg},
+        };
+        ModelRegistryMetrics models = registry.get_metrics();
+        r["models"]                 = {
+            {"registered", models.models},
+            {"resident", models.resident},
+            {"resident_mb", models.resident_bytes / 1024.0 / 1024.0},
+            {"budget_mb", models.budget_bytes / 1024.0 / 1024.0},
+            {"loads", models.loads},
+            {"evictions", models.evictions},
+        };
+        sd_prompt_cache_stats_t prompt_cache = registry.get_prompt_cache_stats();
+        r["prompt_cache"]                    = {
+            {"hits", prompt_cache.hits},
+            {"misses", prompt_cache.misses},
+            {"entries", prompt_cache.entries},
+            {"bytes", prompt_cache.bytes},
+            {"max_bytes", prompt_cache.max_bytes},
+        };
         res.set_content(r.dump(), "application/json");
     });
 
@@ -338,6 +484,7 @@ int main(int argc, const char** argv) {
             std::string size          = j.value("size", "");
             std::string output_format = j.value("output_format", "png");
             int output_compression    = j.value("output_compression", 100);
+            std::string model         = registry.resolve(j.value("model", ""));
             int width                 = 512;
             int height                = 512;
             if (!size.empty()) {
@@ -357,6 +504,12 @@ int main(int argc, const char** argv) {
                 return;
             }
 
+            if (model.empty()) {
+                res.status = 400;
+                res.set_content(R"({"error":"unknown model, see /v1/models"})", "application/json");
+                return;
+            }
+
             std::string sd_cpp_extra_args_str = extract_and_remove_sd_cpp_extra_args(prompt);
 
             if (output_format != "png" && output_format != "jpeg") {
@@ -392,6 +545,7 @@ int main(int argc, const char** argv) {
                 return;
             }
 
+            bool random_seed = gen_params.seed < 0;
             if (!gen_params.process_and_check(IMG_GEN, "")) {
                 res.status = 400;
                 res.set_content(R"({"error":"invalid params"})", "application/json");
@@ -400,6 +554,13 @@ int main(int argc, const char** argv) {
 
             LOG_DEBUG("%s\n", gen_params.to_string().c_str());
 
+            // requests that only differ in n (and in the seed, if it was random) can share a run
+            SDGenerationParams group_params = gen_params;
+            group_params.batch_count        = 1;
+            if (random_seed) {
+                group_params.seed = -1;
+            }
+
             sd_image_t init_image    = {(uint32_t)gen_params.width, (uint32_t)gen_params.height, 3, nullptr};
             sd_image_t control_image = {(uint32_t)gen_params.width, (uint32_t)gen_params.height, 3, nullptr};
             sd_image_t mask_image    = {(uint32_t)gen_params.width, (uint32_t)gen_params.height, 1, nullptr};
@@ -435,15 +596,28 @@ int main(int argc, const char** argv) {
                 gen_params.easycache_params,
             };
 
-            sd_image_t* results = nullptr;
-            int num_results     = 0;
-
-            {
-                std::lock_guard<std::mutex> lock(sd_ctx_mutex);
-                results     = generate_image(sd_ctx, &img_gen_params);
-                num_results = gen_params.batch_count;
+            auto job         = std::make_shared<GenerationJob>();
+            job->group_key   = model + "\n" + group_params.to_string();
+            job->batch_count = gen_params.batch_count;
+            job->random_seed = random_seed;
+            job->run         = [&](int batch_count, const sd_cancel_token_t* cancel_token) {
+                sd_ctx_t* sd_ctx = registry.acquire(model);
+                if (sd_ctx == nullptr) {
+                    return (sd_image_t*)nullptr;
+                }
+                img_gen_params.batch_count  = batch_count;
+                img_gen_params.cancel_token = cancel_token;
+                sd_image_t* results         = generate_image(sd_ctx, &img_gen_params);
+                job->profile                = collect_profile();
+                return results;
+            };
+            if (!schedule_job(job, req, res)) {
+                return;
             }
 
+            sd_image_t* results = job->images.data();
+            int num_results     = (int)job->images.size();
+
             for (int i = 0; i < num_results; i++) {
                 if (results[i].data == nullptr) {
                     continue;
@@ -465,6 +639,9 @@ int main(int argc, const char** argv) {
                 item["b64_json"] = b64;
                 out["data"].push_back(item);
             }
+            if (!job->profile.empty()) {
+                out["profile"] = json::parse(job->profile);
+            }
 
             res.set_content(out.dump(), "application/json");
             res.status = 200;
@@ -493,6 +670,13 @@ int main(int argc, const char** argv) {
                 return;
             }
 
+            std::string model = registry.resolve(req.form.get_field("model"));
+            if (model.empty()) {
+                res.status = 400;
+                res.set_content(R"({"error":"unknown model, see /v1/models"})", "application/json");
+                return;
+            }
+
             std::string sd_cpp_extra_args_str = extract_and_remove_sd_cpp_extra_args(prompt);
 
             size_t image_count = req.form.get_file_count("image[]");
@@ -648,14 +832,24 @@ int main(int argc, const char** argv) {
                 gen_params.easycache_params,
             };
 
-            sd_image_t* results = nullptr;
-            int num_results     = 0;
+            // reference images are not part of any group key, edits always run on their own
+            auto job         = std::make_shared<GenerationJob>();
+            job->batch_count = gen_params.batch_count;
+            job->run         = [&](int batch_count, const sd_cancel_token_t* cancel_token) {
+                sd_ctx_t* sd_ctx = registry.acquire(model);
+                if (sd_ctx == nullptr) {
+                    return (sd_image_t*)nullptr;
+                }
+                img_gen_params.batch_count  = batch_count;
+                img_gen_params.cancel_token = cancel_token;
+                sd_image_t* results         = generate_image(sd_ctx, &img_gen_params);
+                job->profile                = collect_profile();
+                return results;
+            };
+            bool scheduled = schedule_job(job, req, res);
 
-            {
-                std::lock_guard<std::mutex> lock(sd_ctx_mutex);
-                results     = generate_image(sd_ctx, &img_gen_params);
-                num_results = gen_params.batch_count;
-            }
+            sd_image_t* results = job->images.data();
+            int num_results     = (int)job->images.size();
 
             json out;
             out["created"]       = iso_timestamp_now();
@@ -676,9 +870,14 @@ int main(int argc, const char** argv) {
                 item["b64_json"] = b64;
                 out["data"].push_back(item);
             }
+            if (!job->profile.empty()) {
+                out["profile"] = json::parse(job->profile);
+            }
 
-            res.set_content(out.dump(), "application/json");
-            res.status = 200;
+            if (scheduled) {
+                res.set_content(out.dump(), "application/json");
+                res.status = 200;
+            }
 
             if (init_image.data) {
                 stbi_image_free(init_image.data);
@@ -701,7 +900,5 @@ int main(int argc, const char** argv) {
     LOG_INFO("listening on: %s:%d\n", svr_params.listen_ip.c_str(), svr_params.listen_port);
     svr.listen(svr_params.listen_ip, svr_params.listen_port);
 
-    // cleanup
-    free_sd_ctx(sd_ctx);
     return 0;
 }
@@ -0,0 +1,277 @@
+#ifndef __MODEL_REGISTRY_H__
+#define __MODEL_REGISTRY_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stable-diffusion.h"
+
+// expects common/common.hpp (SDContextParams, logging) to be included first
+
+// A checkpoint the server can serve. Everything but the checkpoint itself (vae, text
+// encoders, loras, ...) comes from the command line.
+struct ModelEntry {
+    std::string name;
+    SDContextParams ctx_params;
+    uint64_t size_bytes = 0;  // sum of the model files, used as the RAM estimate
+    sd_ctx_t* sd_ctx    = nullptr;
+    uint64_t last_used  = 0;
+    uint64_t loads      = 0;
+};
+
+struct ModelInfo {
+    std::string name;
+    bool resident       = false;
+    bool is_default     = false;
+    uint64_t size_bytes = 0;
+    uint64_t loads      = 0;
+};
+
+struct ModelRegistryMetrics {
+    size_t models           = 0;
+    size_t resident         = 0;
+    uint64_t resident_bytes = 0;
+    uint64_t budget_bytes   = 0;
+    uint64_t loads          = 0;
+    uint64_t evictions      = 0;
+};
+
+// Keeps up to max_resident contexts within budget_bytes, evicting the least recently used.
+// Contexts are only loaded, used and freed on the scheduler thread, other threads only read
+// the bookkeeping.
+struct ModelRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ModelEntry>> models;
+    std::string default_model;
+    int max_resident;
+    uint64_t budget_bytes;  // 0 for no limit
+    uint64_t clock     = 0;
+    uint64_t loads     = 0;
+    uint64_t evictions = 0;
+
+    ModelRegistry(int max_resident, uint64_t budget_bytes)
+        : max_resident(std::max(1, max_resident)), budget_bytes(budget_bytes) {}
+
+    ~ModelRegistry() {
+        for (auto& model : models) {
+            if (model->sd_ctx != nullptr) {
+                free_sd_ctx(model->sd_ctx);
+                model->sd_ctx = nullptr;
+            }
+        }
+    }
+
+    static uint64_t file_size(const std::string& path) {
+        std::error_code ec;
+        if (path.empty() || !std::filesystem::is_regular_file(path, ec)) {
+            return 0;
+        }
+        auto size = std::filesystem::file_size(path, ec);
+        return ec ? 0 : (uint64_t)size;
+    }
+
+    static uint64_t estimate_size(const SDContextParams& params) {
+        uint64_t size = 0;
+        for (const std::string* path : {&params.model_path,
+                                        &params.clip_l_path,
+                                        &params.clip_g_path,
+                                        &params.clip_vision_path,
+                                        &params.t5xxl_path,
+                                        &params.llm_path,
+                                        &params.llm_vision_path,
+                                        &params.diffusion_model_path,
+                                        &params.high_noise_diffusion_model_path,
+                                        &params.vae_path,
+                                        &params.taesd_path,
+                                        &params.control_net_path,
+                                        &params.photo_maker_path}) {
+            size += file_size(*path);
+        }
+        return size;
+    }
+
+    void add(const std::string& name, const SDContextParams& ctx_params) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto model        = std::make_unique<ModelEntry>();
+        model->name       = name;
+        model->ctx_params = ctx_params;
+        model->size_bytes = estimate_size(ctx_params);
+        if (default_model.empty()) {
+            default_model = name;
+        }
+        models.push_back(std::move(model));
+    }
+
+    // Registers every checkpoint in dir next to the command line one. Like the command line
+    // model they replace --diffusion-model if that was given, the full model otherwise.
+    void add_dir(const std::string& dir, const SDContextParams& base_params) {
+        std::vector<std::filesystem::path> files;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+            std::string ext = entry.path().extension().string();
+            if (entry.is_regular_file() && (ext == ".safetensors" || ext == ".sft" || ext == ".gguf" || ext == ".ckpt")) {
+                files.push_back(entry.path());
+            }
+        }
+        if (ec) {
+            LOG_WARN("can not read models dir '%s': %s", dir.c_str(), ec.message().c_str());
+            return;
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto& file : files) {
+            std::string name = file.stem().string();
+            if (has(name)) {
+                LOG_WARN("model '%s' is already registered, skipping '%s'", name.c_str(), file.string().c_str());
+                continue;
+            }
+            SDContextParams params = base_params;
+            if (!base_params.diffusion_model_path.empty()) {
+                params.diffusion_model_path = file.string();
+            } else {
+                params.model_path = file.string();
+            }
+            add(name, params);
+        }
+    }
+
+    // empty selects the default model, so does the id older clients were given; mutex must be held
+    ModelEntry* find(const std::string& name) {
+        std::string key = (name.empty() || name == "sd-cpp-local") ? default_model : name;
+        for (auto& model : models) {
+            if (model->name == key) {
+                return model.get();
+            }
+        }
+        return nullptr;
+    }
+
+    bool has(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return find(name) != nullptr;
+    }
+
+    // registered name of the model a request asks for, empty if there is none
+    std::string resolve(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ModelEntry* model = find(name);
+        return model == nullptr ? "" : model->name;
+    }
+
+    // Returns the loaded context, evicting least recently used models to make room.
+    // Scheduler thread only.
+    sd_ctx_t* acquire(const std::string& name) {
+        ModelEntry* model = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            model = find(name);
+            if (model == nullptr) {
+                return nullptr;
+            }
+            model->last_used = ++clock;
+            if (model->sd_ctx != nullptr) {
+                return model->sd_ctx;
+            }
+            evict_for(model);
+        }
+
+        LOG_INFO("loading model '%s' (%.2f MB)", model->name.c_str(), model->size_bytes / 1024.0 / 1024.0);
+        sd_ctx_params_t sd_ctx_params = model->ctx_params.to_sd_ctx_params_t(false, false, false);
+        sd_ctx_t* sd_ctx              = new_sd_ctx(&sd_ctx_params);
+        if (sd_ctx == nullptr) {
+            LOG_ERROR("load model '%s' failed", model->name.c_str());
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        model->sd_ctx = sd_ctx;
+        model->loads++;
+        loads++;
+        return sd_ctx;
+    }
+
+    std::vector<ModelInfo> list() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<ModelInfo> result;
+        for (auto& model : models) {
+            ModelInfo info;
+            info.name       = model->name;
+            info.resident   = model->sd_ctx != nullptr;
+            info.is_default = model->name == default_model;
+            info.size_bytes = model->size_bytes;
+            info.loads      = model->loads;
+            result.push_back(info);
+        }
+        return result;
+    }
+
+    ModelRegistryMetrics get_metrics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ModelRegistryMetrics metrics;
+        metrics.models       = models.size();
+        metrics.budget_bytes = budget_bytes;
+        metrics.loads        = loads;
+        metrics.evictions    = evictions;
+        for (auto& model : models) {
+            if (model->sd_ctx != nullptr) {
+                metrics.resident++;
+                metrics.resident_bytes += model->size_bytes;
+            }
+        }
+        return metrics;
+    }
+
+    // prompt cache counters summed over the resident models
+    sd_prompt_cache_stats_t get_prompt_cache_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        sd_prompt_cache_stats_t total = {0, 0, 0, 0, 0};
+        for (auto& model : models) {
+            if (model->sd_ctx == nullptr) {
+                continue;
+            }
+            sd_prompt_cache_stats_t stats;
+            sd_get_prompt_cache_stats(model->sd_ctx, &stats);
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+            total.entries += stats.entries;
+            total.bytes += stats.bytes;
+            total.max_bytes += stats.max_bytes;
+        }
+        return total;
+    }
+
+private:
+    // frees least recently used contexts until target fits, mutex must be held
+    void evict_for(ModelEntry* target) {
+        while (true) {
+            int resident            = 0;
+            uint64_t resident_bytes = 0;
+            ModelEntry* lru         = nullptr;
+            for (auto& model : models) {
+                if (model->sd_ctx == nullptr) {
+                    continue;
+                }
+                resident++;
+                resident_bytes += model->size_bytes;
+                if (lru == nullptr || model->last_used < lru->last_used) {
+                    lru = model.get();
+                }
+            }
+            bool over_count  = resident + 1 > max_resident;
+            bool over_budget = budget_bytes > 0 && resident_bytes + target->size_bytes > budget_bytes;
+            if (lru == nullptr || (!over_count && !over_budget)) {
+                return;
+            }
+            LOG_INFO("evicting model '%s'", lru->name.c_str());
+            free_sd_ctx(lru->sd_ctx);
+            lru->sd_ctx = nullptr;
+            evictions++;
+        }
+    }
+};
+
+#endif  // __MODEL_REGISTRY_H__
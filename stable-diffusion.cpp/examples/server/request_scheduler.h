@@ -0,0 +1,317 @@
+#ifndef __REQUEST_SCHEDULER_H__
+#define __REQUEST_SCHEDULER_H__
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stable-diffusion.h"
+
+// One queued generate_image call.
+// Jobs with the same non-empty group_key only differ in batch_count, so the scheduler may
+// serve several of them from a single generate_image run:
+//   - random_seed: the seeds were picked by the server, each job takes its own slice of the batch
+//   - fixed seed: image i is identical for every job, each job takes the first batch_count images
+struct GenerationJob {
+    std::string group_key;
+    int batch_count  = 1;
+    bool random_seed = false;
+
+    // runs generate_image with the given batch count on the scheduler thread, the token is
+    // cancelled once every job served by the run is cancelled
+    std::function<sd_image_t*(int batch_count, const sd_cancel_token_t* cancel_token)> run;
+
+    // owned by the job once done, release with free_images()
+    std::vector<sd_image_t> images;
+    // profile report of the run that served the job, empty unless profiling
+    std::string profile;
+
+    bool queued    = true;
+    bool done      = false;
+    bool cancelled = false;
+    std::chrono::steady_clock::time_point enqueue_time;
+    std::chrono::steady_clock::time_point start_time;
+
+    void free_images() {
+        for (auto& image : images) {
+            free(image.data);
+            image.data = nullptr;
+        }
+        images.clear();
+    }
+
+    ~GenerationJob() {
+        free_images();
+    }
+};
+
+struct SchedulerMetrics {
+    size_t queue_depth     = 0;
+    size_t max_queue_size  = 0;
+    bool running           = false;
+    uint64_t submitted     = 0;
+    uint64_t completed     = 0;
+    uint64_t rejected      = 0;
+    uint64_t cancelled     = 0;
+    uint64_t runs          = 0;
+    uint64_t grouped_jobs  = 0;  // jobs served by another job's run
+    double wait_ms_avg     = 0;
+    double wait_ms_p50     = 0;
+    double wait_ms_p99     = 0;
+    double wait_ms_max     = 0;
+    double run_ms_avg      = 0;
+};
+
+// Single worker that owns the sd_ctx: requests wait in a bounded FIFO and compatible
+// neighbours are merged into one batched run.
+struct RequestScheduler {
+    size_t max_queue_size;
+    int max_batch_size;
+
+    std::mutex mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable done_cv;
+    std::deque<std::shared_ptr<GenerationJob>> queue;
+    std::vector<std::shared_ptr<GenerationJob>> running_group;
+    sd_cancel_token_t* run_cancel_token = nullptr;
+    std::thread worker;
+    bool stopping = false;
+    bool running  = false;
+
+    // metrics, guarded by mutex
+    uint64_t submitted    = 0;
+    uint64_t completed    = 0;
+    uint64_t rejected     = 0;
+    uint64_t cancelled    = 0;
+    uint64_t runs         = 0;
+    uint64_t grouped_jobs = 0;
+    double total_wait_ms  = 0;
+    double max_wait_ms    = 0;
+    double total_run_ms   = 0;
+    std::vector<double> recent_wait_ms;  // ring buffer for percentiles
+    size_t recent_wait_pos                = 0;
+    static constexpr size_t RECENT_WAIT_N = 1024;
+
+    RequestScheduler(size_t max_queue_size, int max_batch_size)
+        : max_queue_size(max_queue_size), max_batch_size(std::max(1, max_batch_size)) {
+        worker = std::thread([this]() { worker_loop(); });
+    }
+
+    ~RequestScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // returns nullptr when the queue is full
+    std::shared_ptr<GenerationJob> submit(std::shared_ptr<GenerationJob> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= max_queue_size) {
+                rejected++;
+                return nullptr;
+            }
+            job->enqueue_time = std::chrono::steady_clock::now();
+            queue.push_back(job);
+            submitted++;
+        }
+        queue_cv.notify_one();
+        return job;
+    }
+
+    // Blocks until the job is done. A job whose client went away is dropped if it is still
+    // queued; a running job stops its run once no other job is waiting for it, otherwise its
+    // images are discarded. Returns false if the job was cancelled.
+    bool wait(const std::shared_ptr<GenerationJob>& job, const std::function<bool()>& is_cancelled) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!job->done) {
+            done_cv.wait_for(lock, std::chrono::milliseconds(100));
+            if (job->done || job->cancelled || !is_cancelled()) {
+                continue;
+            }
+            job->cancelled = true;
+            cancelled++;
+            if (job->queued) {
+                queue.erase(std::remove(queue.begin(), queue.end(), job), queue.end());
+                job->queued = false;
+                return false;
+            }
+            bool all_cancelled = std::all_of(running_group.begin(), running_group.end(), [](const std::shared_ptr<GenerationJob>& other) {
+                return other->cancelled;
+            });
+            if (all_cancelled) {
+                sd_cancel_token_cancel(run_cancel_token);
+            }
+        }
+        return !job->cancelled;
+    }
+
+    size_t position(const std::shared_ptr<GenerationJob>& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = std::find(queue.begin(), queue.end(), job);
+        return it == queue.end() ? 0 : static_cast<size_t>(it - queue.begin()) + 1;
+    }
+
+    SchedulerMetrics get_metrics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        SchedulerMetrics metrics;
+        metrics.queue_depth    = queue.size();
+        metrics.max_queue_size = max_queue_size;
+        metrics.running        = running;
+        metrics.submitted      = submitted;
+        metrics.completed      = completed;
+        metrics.rejected       = rejected;
+        metrics.cancelled      = cancelled;
+        metrics.runs           = runs;
+        metrics.grouped_jobs   = grouped_jobs;
+        uint64_t started       = completed + (running ? 1 : 0);
+        if (started > 0) {
+            metrics.wait_ms_avg = total_wait_ms / started;
+        }
+        if (runs > 0) {
+            metrics.run_ms_avg = total_run_ms / runs;
+        }
+        metrics.wait_ms_max = max_wait_ms;
+        if (!recent_wait_ms.empty()) {
+            std::vector<double> sorted = recent_wait_ms;
+            std::sort(sorted.begin(), sorted.end());
+            metrics.wait_ms_p50 = sorted[(sorted.size() - 1) * 50 / 100];
+            metrics.wait_ms_p99 = sorted[(sorted.size() - 1) * 99 / 100];
+        }
+        return metrics;
+    }
+
+private:
+    void record_wait(const std::shared_ptr<GenerationJob>& job) {
+        job->start_time = std::chrono::steady_clock::now();
+        double wait_ms  = std::chrono::duration<double, std::milli>(job->start_time - job->enqueue_time).count();
+        total_wait_ms += wait_ms;
+        max_wait_ms = std::max(max_wait_ms, wait_ms);
+        if (recent_wait_ms.size() < RECENT_WAIT_N) {
+            recent_wait_ms.push_back(wait_ms);
+        } else {
+            recent_wait_ms[recent_wait_pos] = wait_ms;
+            recent_wait_pos                 = (recent_wait_pos + 1) % RECENT_WAIT_N;
+        }
+    }
+
+    // pops the head of the queue plus every queued job that can share its run
+    std::vector<std::shared_ptr<GenerationJob>> take_group(int& batch_count) {
+        std::vector<std::shared_ptr<GenerationJob>> group;
+        auto leader = queue.front();
+        queue.pop_front();
+        group.push_back(leader);
+        batch_count = leader->batch_count;
+        if (leader->group_key.empty()) {
+            return group;
+        }
+        for (auto it = queue.begin(); it != queue.end();) {
+            auto& job = *it;
+            if (job->group_key != leader->group_key || job->random_seed != leader->random_seed) {
+                ++it;
+                continue;
+            }
+            int merged = leader->random_seed ? batch_count + job->batch_count : std::max(batch_count, job->batch_count);
+            if (merged > max_batch_size) {
+                ++it;
+                continue;
+            }
+            batch_count = merged;
+            group.push_back(job);
+            it = queue.erase(it);
+        }
+        return group;
+    }
+
+    void worker_loop() {
+        while (true) {
+            std::vector<std::shared_ptr<GenerationJob>> group;
+            int batch_count = 1;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queue_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (stopping) {
+                    for (auto& job : queue) {
+                        job->queued    = false;
+                        job->cancelled = true;
+                        job->done      = true;
+                    }
+                    queue.clear();
+                    done_cv.notify_all();
+                    return;
+                }
+                group = take_group(batch_count);
+                for (auto& job : group) {
+                    job->queued = false;
+                    record_wait(job);
+                }
+                running          = true;
+                running_group    = group;
+                run_cancel_token = sd_cancel_token_new();
+                runs++;
+                grouped_jobs += group.size() - 1;
+            }
+
+            auto t0             = std::chrono::steady_clock::now();
+            sd_image_t* results = group[0]->run(batch_count, run_cancel_token);
+            double run_ms       = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running_group.clear();
+                sd_cancel_token_free(run_cancel_token);
+                run_cancel_token = nullptr;
+                int offset = 0;
+                for (auto& job : group) {
+                    if (results != nullptr && !job->cancelled) {
+                        for (int i = 0; i < job->batch_count; i++) {
+                            job->images.push_back(copy_image(results[offset + i]));
+                        }
+                    }
+                    if (group[0]->random_seed) {
+                        offset += job->batch_count;
+                    }
+                    job->profile = group[0]->profile;
+                    job->done    = true;
+                    completed++;
+                }
+                total_run_ms += run_ms;
+                running = false;
+            }
+            done_cv.notify_all();
+
+            if (results != nullptr) {
+                for (int i = 0; i < batch_count; i++) {
+                    free(results[i].data);
+                }
+                free(results);
+            }
+        }
+    }
+
+    static sd_image_t copy_image(const sd_image_t& src) {
+        sd_image_t dst = src;
+        if (src.data != nullptr) {
+            size_t size = (size_t)src.width * src.height * src.channel;
+            dst.data    = (uint8_t*)malloc(size);
+            memcpy(dst.data, src.data, size);
+        }
+        return dst;
+    }
+};
+
+#endif  // __REQUEST_SCHEDULER_H__
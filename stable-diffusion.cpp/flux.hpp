@@ -1234,7 +1234,7 @@ namespace Flux {
     public:
         FluxParams flux_params;
         Flux flux;
-        std::vector<float> pe_vec;
+        Rope::PECache pe_cache;
         std::vector<float> mod_index_arange_vec;
         std::vector<float> dct_vec;
         SDVersion version;
@@ -1431,24 +1431,28 @@ namespace Flux {
                 txt_arange_dims = {1, 2};
             }
 
-            pe_vec      = Rope::gen_flux_pe(x->ne[1],
-                                            x->ne[0],
-                                            flux_params.patch_size,
-                                            x->ne[3],
-                                            context->ne[1],
-                                            txt_arange_dims,
-                                            ref_latents,
-                                            increase_ref_index,
-                                            flux_params.ref_index_scale,
-                                            flux_params.theta,
-                                            flux_params.axes_dim);
+            std::string pe_key               = Rope::pe_cache_key({x->ne[0], x->ne[1], x->ne[3], context->ne[1], increase_ref_index}, ref_latents);
+            const std::vector<float>& pe_vec = pe_cache.get(pe_key, [&]() {
+                return Rope::gen_flux_pe(x->ne[1],
+                                         x->ne[0],
+                                         flux_params.patch_size,
+                                         x->ne[3],
+                                         context->ne[1],
+                                         txt_arange_dims,
+                                         ref_latents,
+                                         increase_ref_index,
+                                         flux_params.ref_index_scale,
+                                         flux_params.theta,
+                                         flux_params.axes_dim,
+                                         build_n_threads);
+            });
             int pos_len = pe_vec.size() / flux_params.axes_dim_sum / 2;
             // LOG_DEBUG("pos_len %d", pos_len);
             auto pe = ggml_new_tensor_4d(compute_ctx, GGML_TYPE_F32, 2, 2, flux_params.axes_dim_sum / 2, pos_len);
             // pe->data = pe_vec.data();
             // print_ggml_tensor(pe);
             // pe->data = nullptr;
-            set_backend_tensor_data(pe, pe_vec.data());
+            set_backend_tensor_resident_data(pe, pe_vec.data());
 
             if (version == VERSION_CHROMA_RADIANCE) {
                 int64_t patch_size     = flux_params.patch_size;
@@ -1502,7 +1506,17 @@ namespace Flux {
                 return build_graph(x, timesteps, context, c_concat, y, guidance, ref_latents, increase_ref_index, skip_layers);
             };
 
-            return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+            if (flux_params.is_chroma && guidance != nullptr) {
+                // build_graph zeroes it too, but a reused graph reads it as is
+                ggml_set_f32(guidance, 0);
+            }
+            std::vector<struct ggml_tensor*> inputs = {x, timesteps, context, c_concat, y, guidance};
+            inputs.insert(inputs.end(), ref_latents.begin(), ref_latents.end());
+            std::string graph_key = std::to_string(increase_ref_index) + ";";
+            for (int layer : skip_layers) {
+                graph_key += std::to_string(layer) + ",";
+            }
+            return GGMLRunner::compute_with_graph_cache(get_graph, n_threads, inputs, graph_key, output, output_ctx);
         }
 
         void test() {
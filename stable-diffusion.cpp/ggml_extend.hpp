@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <fstream>
 #include <functional>
@@ -17,9 +18,16 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
 #include "ggml-cpu.h"
@@ -158,9 +166,14 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_ext_kronecker(ggml_context* ctx, stru
                     b);
 }
 
-__STATIC_INLINE__ void ggml_ext_im_set_randn_f32(struct ggml_tensor* tensor, std::shared_ptr<RNG> rng) {
-    uint32_t n                        = (uint32_t)ggml_nelements(tensor);
-    std::vector<float> random_numbers = rng->randn(n);
+__STATIC_INLINE__ void ggml_ext_im_set_randn_f32(struct ggml_tensor* tensor, std::shared_ptr<RNG> rng, int n_threads = 1) {
+    uint32_t n = (uint32_t)ggml_nelements(tensor);
+    if (tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor) && tensor->data != nullptr &&
+        (tensor->buffer == nullptr || ggml_backend_buffer_is_host(tensor->buffer))) {
+        rng->randn((float*)tensor->data, n, n_threads);
+        return;
+    }
+    std::vector<float> random_numbers = rng->randn(n, n_threads);
     for (uint32_t i = 0; i < n; i++) {
         ggml_set_f32_1d(tensor, i, random_numbers[i]);
     }
@@ -382,7 +395,152 @@ __STATIC_INLINE__ float sigmoid(float x) {
 
 // SPECIAL OPERATIONS WITH TENSORS
 
-__STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, uint8_t* image_data = nullptr) {
+// Marks the CPUs of a list like "0-7,16-23" in mask. Returns false if the list is malformed
+// or names a CPU past mask_size.
+__STATIC_INLINE__ bool ggml_ext_parse_cpu_list(const std::string& list, bool* mask, int mask_size) {
+    for (const std::string& raw_item : split_string(list, ',')) {
+        std::string item = trim(raw_item);
+        if (item.empty()) {
+            continue;
+        }
+        size_t dash = item.find('-');
+        if (item.find_first_not_of("0123456789-") != std::string::npos || item.find('-', dash + 1) != std::string::npos) {
+            return false;
+        }
+        int first = -1;
+        int last  = -1;
+        try {
+            first = std::stoi(item.substr(0, dash));
+            last  = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        } catch (...) {
+            return false;
+        }
+        if (first < 0 || last < first || last >= mask_size) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            mask[cpu] = true;
+        }
+    }
+    return true;
+}
+
+// dst[i] = (uint8_t)(src[i] * 255) with the product clamped to [0, 255], NaN gives 0
+__STATIC_INLINE__ void ggml_ext_quantize_u8(const float* src, uint8_t* dst, int64_t n) {
+    int64_t i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(255.f);
+    const __m128 zero  = _mm_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i + 4 * j), scale);
+            v        = _mm_min_ps(_mm_max_ps(v, zero), scale);
+            q[j]     = _mm_cvttps_epi32(v);
+        }
+        __m128i lo = _mm_packs_epi32(q[0], q[1]);
+        __m128i hi = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t scale = vdupq_n_f32(255.f);
+    const float32x4_t zero  = vdupq_n_f32(0.f);
+    for (; i + 16 <= n; i += 16) {
+        uint16x4_t q[4];
+        for (int j = 0; j < 4; j++) {
+            float32x4_t v = vmulq_f32(vld1q_f32(src + i + 4 * j), scale);
+            v             = vminq_f32(vmaxq_f32(v, zero), scale);
+            q[j]          = vqmovn_u32(vcvtq_u32_f32(v));
+        }
+        uint8x8_t lo = vqmovn_u16(vcombine_u16(q[0], q[1]));
+        uint8x8_t hi = vqmovn_u16(vcombine_u16(q[2], q[3]));
+        vst1q_u8(dst + i, vcombine_u8(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        float v = src[i] * 255.f;
+        v       = v > 0.f ? (v < 255.f ? v : 255.f) : 0.f;
+        dst[i]  = (uint8_t)v;
+    }
+}
+
+// Image idx of a planar f32 tensor, [w, h, c, n] or [w, h, n, c] for video, as interleaved
+// 8-bit pixels. Values are clamped to [0, 1]. Rows are split between n_threads.
+__STATIC_INLINE__ void ggml_ext_tensor_to_image(const ggml_tensor* tensor, uint8_t* dst, int64_t idx = 0, bool video = false, int n_threads = 1) {
+    GGML_ASSERT(tensor->type == GGML_TYPE_F32 && tensor->nb[0] == sizeof(float));
+    int64_t width         = tensor->ne[0];
+    int64_t height        = tensor->ne[1];
+    int64_t channels      = video ? tensor->ne[3] : tensor->ne[2];
+    size_t channel_stride = video ? tensor->nb[3] : tensor->nb[2];
+    size_t offset         = idx * (video ? tensor->nb[2] : tensor->nb[3]);
+    const char* data      = (const char*)tensor->data;
+    std::vector<char> host_data;
+    if (tensor->buffer != nullptr && !ggml_backend_buffer_is_host(tensor->buffer)) {
+        host_data.resize(ggml_nbytes(tensor));
+        ggml_backend_tensor_get(tensor, host_data.data(), 0, host_data.size());
+        data = host_data.data();
+    }
+    data += offset;
+
+    sd_parallel_for(n_threads, height, width * channels, [&](int64_t begin, int64_t end) {
+        std::vector<uint8_t> planes(width * channels);
+        for (int64_t iy = begin; iy < end; iy++) {
+            uint8_t* out = dst + iy * width * channels;
+            for (int64_t k = 0; k < channels; k++) {
+                const float* in = (const float*)(data + iy * tensor->nb[1] + k * channel_stride);
+                ggml_ext_quantize_u8(in, planes.data() + k * width, width);
+            }
+            if (channels == 3) {
+                const uint8_t* r = planes.data();
+                const uint8_t* g = r + width;
+                const uint8_t* b = g + width;
+                for (int64_t ix = 0; ix < width; ix++) {
+                    out[3 * ix + 0] = r[ix];
+                    out[3 * ix + 1] = g[ix];
+                    out[3 * ix + 2] = b[ix];
+                }
+            } else {
+                for (int64_t k = 0; k < channels; k++) {
+                    for (int64_t ix = 0; ix < width; ix++) {
+                        out[ix * channels + k] = planes[k * width + ix];
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Interleaved pixels into image idx of a planar f32 tensor, see ggml_ext_tensor_to_image.
+// With scale, values are divided by 255.
+template <typename T>
+__STATIC_INLINE__ void ggml_ext_image_to_tensor(const T* src, ggml_tensor* tensor, int64_t idx = 0, bool video = false, bool scale = true, int n_threads = 1) {
+    GGML_ASSERT(tensor->type == GGML_TYPE_F32 && tensor->nb[0] == sizeof(float));
+    int64_t width         = tensor->ne[0];
+    int64_t height        = tensor->ne[1];
+    int64_t channels      = video ? tensor->ne[3] : tensor->ne[2];
+    size_t channel_stride = video ? tensor->nb[3] : tensor->nb[2];
+    char* data            = (char*)tensor->data + idx * (video ? tensor->nb[2] : tensor->nb[3]);
+
+    sd_parallel_for(n_threads, height, width * channels, [&](int64_t begin, int64_t end) {
+        for (int64_t iy = begin; iy < end; iy++) {
+            const T* in = src + iy * width * channels;
+            for (int64_t k = 0; k < channels; k++) {
+                float* out = (float*)(data + iy * tensor->nb[1] + k * channel_stride);
+                if (scale) {
+                    for (int64_t ix = 0; ix < width; ix++) {
+                        out[ix] = (float)in[ix * channels + k] / 255.f;
+                    }
+                } else {
+                    for (int64_t ix = 0; ix < width; ix++) {
+                        out[ix] = (float)in[ix * channels + k];
+                    }
+                }
+            }
+        }
+    });
+}
+
+__STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, uint8_t* image_data = nullptr, int n_threads = 1) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
@@ -390,18 +548,11 @@ __STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, ui
     if (image_data == nullptr) {
         image_data = (uint8_t*)malloc(width * height * channels);
     }
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_ext_tensor_get_f32(input, ix, iy, k);
-                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
-            }
-        }
-    }
+    ggml_ext_tensor_to_image(input, image_data, 0, false, n_threads);
     return image_data;
 }
 
-__STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, int idx, bool video = false) {
+__STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, int idx, bool video = false, int n_threads = 1) {
     int64_t width  = input->ne[0];
     int64_t height = input->ne[1];
     int64_t channels;
@@ -412,74 +563,71 @@ __STATIC_INLINE__ uint8_t* ggml_tensor_to_sd_image(struct ggml_tensor* input, in
     }
     GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32);
     uint8_t* image_data = (uint8_t*)malloc(width * height * channels);
-    for (int ih = 0; ih < height; ih++) {
-        for (int iw = 0; iw < width; iw++) {
-            for (int ic = 0; ic < channels; ic++) {
-                float value;
-                if (video) {
-                    value = ggml_ext_tensor_get_f32(input, iw, ih, idx, ic);
-                } else {
-                    value = ggml_ext_tensor_get_f32(input, iw, ih, ic, idx);
-                }
-                *(image_data + ih * width * channels + iw * channels + ic) = (uint8_t)(value * 255.0f);
-            }
-        }
-    }
+    ggml_ext_tensor_to_image(input, image_data, idx, video, n_threads);
     return image_data;
 }
 
 __STATIC_INLINE__ void sd_image_to_ggml_tensor(sd_image_t image,
                                                ggml_tensor* tensor,
-                                               bool scale = true) {
+                                               bool scale    = true,
+                                               int n_threads = 1) {
     GGML_ASSERT(image.width == tensor->ne[0]);
     GGML_ASSERT(image.height == tensor->ne[1]);
     GGML_ASSERT(image.channel == tensor->ne[2]);
     GGML_ASSERT(1 == tensor->ne[3]);
     GGML_ASSERT(tensor->type == GGML_TYPE_F32);
-    ggml_ext_tensor_iter(tensor, [&](ggml_tensor* tensor, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-        float value = sd_image_get_f32(image, i0, i1, i2, scale);
-        ggml_ext_tensor_set_f32(tensor, value, i0, i1, i2, i3);
-    });
+    ggml_ext_image_to_tensor(image.data, tensor, 0, false, scale, n_threads);
 }
 
 __STATIC_INLINE__ void ggml_ext_tensor_apply_mask(struct ggml_tensor* image_data,
                                                   struct ggml_tensor* mask,
                                                   struct ggml_tensor* output,
-                                                  float masked_value = 0.5f) {
-    int64_t width    = output->ne[0];
-    int64_t height   = output->ne[1];
-    int64_t channels = output->ne[2];
-    float rescale_mx = mask->ne[0] / output->ne[0];
-    float rescale_my = mask->ne[1] / output->ne[1];
-    GGML_ASSERT(output->type == GGML_TYPE_F32);
-    for (int ix = 0; ix < width; ix++) {
-        for (int iy = 0; iy < height; iy++) {
-            int mx  = (int)(ix * rescale_mx);
-            int my  = (int)(iy * rescale_my);
-            float m = ggml_ext_tensor_get_f32(mask, mx, my);
-            m       = round(m);  // inpaint models need binary masks
-            ggml_ext_tensor_set_f32(mask, m, mx, my);
-            for (int k = 0; k < channels; k++) {
-                float value = ggml_ext_tensor_get_f32(image_data, ix, iy, k);
-                value       = (1 - m) * (value - masked_value) + masked_value;
-                ggml_ext_tensor_set_f32(output, value, ix, iy, k);
+                                                  float masked_value = 0.5f,
+                                                  int n_threads      = 1) {
+    int64_t width      = output->ne[0];
+    int64_t height     = output->ne[1];
+    int64_t channels   = output->ne[2];
+    int64_t rescale_mx = mask->ne[0] / output->ne[0];
+    int64_t rescale_my = mask->ne[1] / output->ne[1];
+    GGML_ASSERT(output->type == GGML_TYPE_F32 && output->nb[0] == sizeof(float));
+    GGML_ASSERT(image_data->type == GGML_TYPE_F32 && image_data->nb[0] == sizeof(float));
+    GGML_ASSERT(mask->type == GGML_TYPE_F32 && mask->nb[0] == sizeof(float));
+
+    // inpaint models need binary masks, round the mask pixels the output samples
+    int64_t mask_rows = rescale_my == 0 ? 1 : height;
+    int64_t mask_cols = rescale_mx == 0 ? 1 : width;
+    for (int64_t iy = 0; iy < mask_rows; iy++) {
+        float* m = (float*)((char*)mask->data + iy * rescale_my * mask->nb[1]);
+        for (int64_t ix = 0; ix < mask_cols; ix++) {
+            m[ix * rescale_mx] = roundf(m[ix * rescale_mx]);
+        }
+    }
+
+    sd_parallel_for(n_threads, height, width * channels, [&](int64_t begin, int64_t end) {
+        for (int64_t iy = begin; iy < end; iy++) {
+            const float* m = (const float*)((const char*)mask->data + iy * rescale_my * mask->nb[1]);
+            for (int64_t k = 0; k < channels; k++) {
+                const float* in = (const float*)((const char*)image_data->data + iy * image_data->nb[1] + k * image_data->nb[2]);
+                float* out      = (float*)((char*)output->data + iy * output->nb[1] + k * output->nb[2]);
+                for (int64_t ix = 0; ix < width; ix++) {
+                    float mv = m[ix * rescale_mx];
+                    out[ix]  = (1 - mv) * (in[ix] - masked_value) + masked_value;
+                }
             }
         }
-    }
+    });
 }
 
 __STATIC_INLINE__ void sd_image_f32_to_ggml_tensor(sd_image_f32_t image,
                                                    ggml_tensor* tensor,
-                                                   bool scale = true) {
+                                                   bool scale    = true,
+                                                   int n_threads = 1) {
     GGML_ASSERT(image.width == tensor->ne[0]);
     GGML_ASSERT(image.height == tensor->ne[1]);
     GGML_ASSERT(image.channel == tensor->ne[2]);
     GGML_ASSERT(1 == tensor->ne[3]);
     GGML_ASSERT(tensor->type == GGML_TYPE_F32);
-    ggml_ext_tensor_iter(tensor, [&](ggml_tensor* tensor, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-        float value = sd_image_get_f32(image, i0, i1, i2, scale);
-        ggml_ext_tensor_set_f32(tensor, value, i0, i1, i2, i3);
-    });
+    ggml_ext_image_to_tensor(image.data, tensor, 0, false, scale, n_threads);
 }
 
 __STATIC_INLINE__ void ggml_ext_tensor_split_2d(struct ggml_tensor* input,
@@ -509,21 +657,28 @@ __STATIC_INLINE__ float smootherstep_f32(const float x) {
     return x * x * x * (x * (6.0f * x - 15.0f) + 10.0f);
 }
 
+// output may be a band of a taller image: it then holds rows [y_origin, y_origin + output->ne[1])
+// of an image that is img_height rows high
 __STATIC_INLINE__ void ggml_ext_tensor_merge_2d(struct ggml_tensor* input,
                                                 struct ggml_tensor* output,
                                                 int x,
                                                 int y,
                                                 int overlap_x,
                                                 int overlap_y,
-                                                int x_skip = 0,
-                                                int y_skip = 0) {
+                                                int x_skip         = 0,
+                                                int y_skip         = 0,
+                                                int y_origin       = 0,
+                                                int64_t img_height = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
     int64_t ne3      = input->ne[3];
 
-    int64_t img_width  = output->ne[0];
-    int64_t img_height = output->ne[1];
+    int64_t img_width = output->ne[0];
+    if (img_height <= 0) {
+        img_height = output->ne[1];
+    }
+    int out_y = y - y_origin;
 
     GGML_ASSERT(input->type == GGML_TYPE_F32 && output->type == GGML_TYPE_F32);
     for (int iy = y_skip; iy < height; iy++) {
@@ -532,7 +687,7 @@ __STATIC_INLINE__ void ggml_ext_tensor_merge_2d(struct ggml_tensor* input,
                 for (int l = 0; l < ne3; l++) {
                     float new_value = ggml_ext_tensor_get_f32(input, ix, iy, k, l);
                     if (overlap_x > 0 || overlap_y > 0) {  // blend colors in overlapped area
-                        float old_value = ggml_ext_tensor_get_f32(output, x + ix, y + iy, k, l);
+                        float old_value = ggml_ext_tensor_get_f32(output, x + ix, out_y + iy, k, l);
 
                         const float x_f_0 = (overlap_x > 0 && x > 0) ? (ix - x_skip) / float(overlap_x) : 1;
                         const float x_f_1 = (overlap_x > 0 && x < (img_width - width)) ? (width - ix) / float(overlap_x) : 1;
@@ -545,9 +700,9 @@ __STATIC_INLINE__ void ggml_ext_tensor_merge_2d(struct ggml_tensor* input,
                         ggml_ext_tensor_set_f32(
                             output,
                             old_value + new_value * smootherstep_f32(y_f) * smootherstep_f32(x_f),
-                            x + ix, y + iy, k, l);
+                            x + ix, out_y + iy, k, l);
                     } else {
-                        ggml_ext_tensor_set_f32(output, new_value, x + ix, y + iy, k, l);
+                        ggml_ext_tensor_set_f32(output, new_value, x + ix, out_y + iy, k, l);
                     }
                 }
             }
@@ -629,6 +784,46 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_ext_tensor_concat(struct ggml_context
     return result;
 }
 
+// Stack same-shaped tensors along dim. All dims above dim must be 1, so every input
+// occupies one contiguous block of the result. Returns nullptr if the shapes do not match.
+__STATIC_INLINE__ struct ggml_tensor* ggml_ext_tensor_stack(struct ggml_context* ctx,
+                                                            const std::vector<struct ggml_tensor*>& tensors,
+                                                            int dim) {
+    if (tensors.empty() || tensors[0] == nullptr) {
+        return nullptr;
+    }
+    struct ggml_tensor* first = tensors[0];
+    for (auto tensor : tensors) {
+        if (tensor == nullptr || tensor->type != first->type || !ggml_is_contiguous(tensor)) {
+            return nullptr;
+        }
+        for (int d = 0; d < GGML_MAX_DIMS; ++d) {
+            if (tensor->ne[d] != first->ne[d] || (d > dim && tensor->ne[d] != 1)) {
+                return nullptr;
+            }
+        }
+    }
+    int64_t ne[GGML_MAX_DIMS];
+    for (int d = 0; d < GGML_MAX_DIMS; ++d) {
+        ne[d] = first->ne[d];
+    }
+    ne[dim] *= tensors.size();
+    struct ggml_tensor* result = ggml_new_tensor(ctx, first->type, GGML_MAX_DIMS, ne);
+    size_t block_size          = ggml_nbytes(first);
+    for (size_t i = 0; i < tensors.size(); i++) {
+        memcpy((char*)result->data + i * block_size, tensors[i]->data, block_size);
+    }
+    return result;
+}
+
+// Copy the index-th block of a tensor produced by stacking along its outermost non-unit dim.
+__STATIC_INLINE__ void ggml_ext_tensor_unstack(struct ggml_tensor* dst, struct ggml_tensor* src, int index) {
+    size_t block_size = ggml_nbytes(dst);
+    GGML_ASSERT(dst->type == src->type);
+    GGML_ASSERT((index + 1) * block_size <= ggml_nbytes(src));
+    memcpy(dst->data, (char*)src->data + index * block_size, block_size);
+}
+
 // convert values from [0, 1] to [-1, 1]
 __STATIC_INLINE__ void process_vae_input_tensor(struct ggml_tensor* src) {
     int64_t nelements = ggml_nelements(src);
@@ -808,20 +1003,32 @@ __STATIC_INLINE__ void sd_tiling_calc_tiles(int& num_tiles_dim,
     }
 }
 
-// Tiling
-__STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
-                                            ggml_tensor* output,
-                                            const int scale,
-                                            const int p_tile_size_x,
-                                            const int p_tile_size_y,
-                                            const float tile_overlap_factor,
-                                            on_tile_process on_processing) {
-    output = ggml_set_f32(output, 0);
+// processes several independent tiles at once, e.g. with GGMLRunner::compute_parallel
+typedef std::function<void(const std::vector<ggml_tensor*>& input_tiles, const std::vector<ggml_tensor*>& output_tiles)> on_tiles_process;
+typedef std::function<void(ggml_tensor* output_tile, int x_out, int y_out, int overlap_x_out, int overlap_y_out, int dx, int dy)> on_tile_merge;
+// called after every row of tiles with the first output row the next tile row will touch
+typedef std::function<void(int next_y_out)> on_tile_row_done;
 
-    int input_width   = (int)input->ne[0];
-    int input_height  = (int)input->ne[1];
-    int output_width  = (int)output->ne[0];
-    int output_height = (int)output->ne[1];
+// Tiling
+// Walks the tiles in raster order; on_merge blends each processed tile into the output.
+// With parallel_tiles > 1 and on_batch set, up to parallel_tiles tiles are processed at once
+// and still merged in raster order, so the result does not depend on parallel_tiles.
+__STATIC_INLINE__ void sd_tiling_run(ggml_tensor* input,
+                                     int output_width,
+                                     int output_height,
+                                     int64_t output_ne2,
+                                     int64_t output_ne3,
+                                     const int scale,
+                                     const int p_tile_size_x,
+                                     const int p_tile_size_y,
+                                     const float tile_overlap_factor,
+                                     on_tile_process on_processing,
+                                     on_tile_merge on_merge,
+                                     on_tile_row_done on_row_done = nullptr,
+                                     int parallel_tiles           = 1,
+                                     on_tiles_process on_batch    = nullptr) {
+    int input_width  = (int)input->ne[0];
+    int input_height = (int)input->ne[1];
 
     GGML_ASSERT(((input_width / output_width) == (input_height / output_height)) &&
                 ((output_width / input_width) == (output_height / input_height)));
@@ -870,31 +1077,12 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
         input_tile_size_y *= scale;
     }
 
-    struct ggml_init_params params = {};
-    params.mem_size += input_tile_size_x * input_tile_size_y * input->ne[2] * input->ne[3] * sizeof(float);      // input chunk
-    params.mem_size += output_tile_size_x * output_tile_size_y * output->ne[2] * output->ne[3] * sizeof(float);  // output chunk
-    params.mem_size += 3 * ggml_tensor_overhead();
-    params.mem_buffer = nullptr;
-    params.no_alloc   = false;
-
-    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
-
-    // draft context
-    struct ggml_context* tiles_ctx = ggml_init(params);
-    if (!tiles_ctx) {
-        LOG_ERROR("ggml_init() failed");
-        return;
-    }
-
-    // tiling
-    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], input->ne[3]);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output->ne[2], output->ne[3]);
-    int num_tiles            = num_tiles_x * num_tiles_y;
-    LOG_DEBUG("processing %i tiles", num_tiles);
-    pretty_progress(0, num_tiles, 0.0f);
-    int tile_count = 1;
+    struct tile_pos_t {
+        int x_in, y_in, x_out, y_out, dx, dy;
+        int next_y_out;  // set on the last tile of a row
+    };
+    std::vector<tile_pos_t> tiles;
     bool last_y = false, last_x = false;
-    float last_time = 0.0f;
     for (int y = 0; y < small_height && !last_y; y += non_tile_overlap_y) {
         int dy = 0;
         if (y + tile_size_y >= small_height) {
@@ -918,39 +1106,191 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
                 last_x = true;
             }
 
-            int x_in  = decode ? x : scale * x;
-            int y_in  = decode ? y : scale * y;
-            int x_out = decode ? x * scale : x;
-            int y_out = decode ? y * scale : y;
+            tile_pos_t tile;
+            tile.x_in       = decode ? x : scale * x;
+            tile.y_in       = decode ? y : scale * y;
+            tile.x_out      = decode ? x * scale : x;
+            tile.y_out      = decode ? y * scale : y;
+            tile.dx         = dx;
+            tile.dy         = dy;
+            tile.next_y_out = -1;
+            tiles.push_back(tile);
+        }
+        last_x                  = false;
+        int next_y              = last_y ? small_height : std::min(y + non_tile_overlap_y, small_height - tile_size_y);
+        tiles.back().next_y_out = decode ? next_y * scale : next_y;
+    }
 
-            int overlap_x_out = decode ? tile_overlap_x * scale : tile_overlap_x;
-            int overlap_y_out = decode ? tile_overlap_y * scale : tile_overlap_y;
+    int overlap_x_out = decode ? tile_overlap_x * scale : tile_overlap_x;
+    int overlap_y_out = decode ? tile_overlap_y * scale : tile_overlap_y;
 
-            int64_t t1 = ggml_time_ms();
-            ggml_ext_tensor_split_2d(input, input_tile, x_in, y_in);
-            on_processing(input_tile, output_tile, false);
-            ggml_ext_tensor_merge_2d(output_tile, output, x_out, y_out, overlap_x_out, overlap_y_out, dx, dy);
+    int num_tiles = (int)tiles.size();
+    int wave_size = (on_batch && parallel_tiles > 1) ? std::min(parallel_tiles, num_tiles) : 1;
 
-            int64_t t2 = ggml_time_ms();
-            last_time  = (t2 - t1) / 1000.0f;
-            pretty_progress(tile_count, num_tiles, last_time);
-            tile_count++;
-        }
-        last_x = false;
+    struct ggml_init_params params = {};
+    params.mem_size += wave_size * input_tile_size_x * input_tile_size_y * input->ne[2] * input->ne[3] * sizeof(float);  // input chunks
+    params.mem_size += wave_size * output_tile_size_x * output_tile_size_y * output_ne2 * output_ne3 * sizeof(float);    // output chunks
+    params.mem_size += (2 * wave_size + 1) * ggml_tensor_overhead();
+    params.mem_buffer = nullptr;
+    params.no_alloc   = false;
+
+    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
+
+    // draft context
+    struct ggml_context* tiles_ctx = ggml_init(params);
+    if (!tiles_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return;
     }
-    if (tile_count < num_tiles) {
-        pretty_progress(num_tiles, num_tiles, last_time);
+
+    // tiling
+    std::vector<ggml_tensor*> input_tiles;
+    std::vector<ggml_tensor*> output_tiles;
+    for (int i = 0; i < wave_size; i++) {
+        input_tiles.push_back(ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], input->ne[3]));
+        output_tiles.push_back(ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output_ne2, output_ne3));
+    }
+    LOG_DEBUG("processing %i tiles, %i at a time", num_tiles, wave_size);
+    pretty_progress(0, num_tiles, 0.0f);
+    float last_time = 0.0f;
+    for (int begin = 0; begin < num_tiles; begin += wave_size) {
+        int count  = std::min(wave_size, num_tiles - begin);
+        int64_t t1 = ggml_time_ms();
+        for (int i = 0; i < count; i++) {
+            ggml_ext_tensor_split_2d(input, input_tiles[i], tiles[begin + i].x_in, tiles[begin + i].y_in);
+        }
+        if (wave_size > 1) {
+            on_batch(std::vector<ggml_tensor*>(input_tiles.begin(), input_tiles.begin() + count),
+                     std::vector<ggml_tensor*>(output_tiles.begin(), output_tiles.begin() + count));
+        } else {
+            on_processing(input_tiles[0], output_tiles[0], false);
+        }
+        for (int i = 0; i < count; i++) {
+            const tile_pos_t& tile = tiles[begin + i];
+            on_merge(output_tiles[i], tile.x_out, tile.y_out, overlap_x_out, overlap_y_out, tile.dx, tile.dy);
+            if (on_row_done && tile.next_y_out >= 0) {
+                on_row_done(tile.next_y_out);
+            }
+        }
+
+        int64_t t2 = ggml_time_ms();
+        last_time  = (t2 - t1) / 1000.0f / count;
+        pretty_progress(begin + count, num_tiles, last_time);
     }
     ggml_free(tiles_ctx);
 }
 
+__STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input,
+                                            ggml_tensor* output,
+                                            const int scale,
+                                            const int p_tile_size_x,
+                                            const int p_tile_size_y,
+                                            const float tile_overlap_factor,
+                                            on_tile_process on_processing,
+                                            int parallel_tiles        = 1,
+                                            on_tiles_process on_batch = nullptr) {
+    output = ggml_set_f32(output, 0);
+
+    auto on_merge = [&](ggml_tensor* output_tile, int x_out, int y_out, int overlap_x_out, int overlap_y_out, int dx, int dy) {
+        ggml_ext_tensor_merge_2d(output_tile, output, x_out, y_out, overlap_x_out, overlap_y_out, dx, dy);
+    };
+    sd_tiling_run(input,
+                  (int)output->ne[0],
+                  (int)output->ne[1],
+                  output->ne[2],
+                  output->ne[3],
+                  scale,
+                  p_tile_size_x,
+                  p_tile_size_y,
+                  tile_overlap_factor,
+                  on_processing,
+                  on_merge,
+                  nullptr,
+                  parallel_tiles,
+                  on_batch);
+}
+
+// band: [W, rows_in_band, C, N], the blended output rows [y, y + rows) at band rows [0, rows)
+typedef std::function<void(ggml_tensor* band, int y, int rows)> on_tile_rows_ready;
+
+// Tiled decode that never holds the full output: tiles are blended into a band one
+// tile row high, and rows no later tile can touch are handed to on_rows in order.
+__STATIC_INLINE__ void sd_tiling_streaming(ggml_tensor* input,
+                                           int64_t output_ne2,
+                                           int64_t output_ne3,
+                                           const int scale,
+                                           const int p_tile_size_x,
+                                           const int p_tile_size_y,
+                                           const float tile_overlap_factor,
+                                           on_tile_process on_processing,
+                                           on_tile_rows_ready on_rows,
+                                           int parallel_tiles        = 1,
+                                           on_tiles_process on_batch = nullptr) {
+    int output_width  = (int)input->ne[0] * scale;
+    int output_height = (int)input->ne[1] * scale;
+    int band_height   = std::min(p_tile_size_y, (int)input->ne[1]) * scale;
+
+    struct ggml_init_params params = {};
+    params.mem_size                = output_width * band_height * output_ne2 * output_ne3 * sizeof(float) + ggml_tensor_overhead();
+    params.mem_buffer              = nullptr;
+    params.no_alloc                = false;
+
+    struct ggml_context* band_ctx = ggml_init(params);
+    if (!band_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return;
+    }
+    ggml_tensor* band = ggml_new_tensor_4d(band_ctx, GGML_TYPE_F32, output_width, band_height, output_ne2, output_ne3);
+    ggml_set_f32(band, 0);
+    int band_origin = 0;
+
+    auto on_merge = [&](ggml_tensor* output_tile, int x_out, int y_out, int overlap_x_out, int overlap_y_out, int dx, int dy) {
+        GGML_ASSERT(y_out >= band_origin && y_out + output_tile->ne[1] <= band_origin + band_height);
+        ggml_ext_tensor_merge_2d(output_tile, band, x_out, y_out, overlap_x_out, overlap_y_out, dx, dy, band_origin, output_height);
+    };
+    auto on_row_done = [&](int next_y_out) {
+        int rows = next_y_out - band_origin;
+        if (rows <= 0) {
+            return;
+        }
+        on_rows(band, band_origin, rows);
+        // keep the overlap still to be blended at the top of the band
+        size_t row_size = band->nb[1];
+        for (int64_t i3 = 0; i3 < band->ne[3]; i3++) {
+            for (int64_t i2 = 0; i2 < band->ne[2]; i2++) {
+                char* plane = (char*)band->data + i2 * band->nb[2] + i3 * band->nb[3];
+                memmove(plane, plane + rows * row_size, (band_height - rows) * row_size);
+                memset(plane + (band_height - rows) * row_size, 0, rows * row_size);
+            }
+        }
+        band_origin = next_y_out;
+    };
+    sd_tiling_run(input,
+                  output_width,
+                  output_height,
+                  output_ne2,
+                  output_ne3,
+                  scale,
+                  p_tile_size_x,
+                  p_tile_size_y,
+                  tile_overlap_factor,
+                  on_processing,
+                  on_merge,
+                  on_row_done,
+                  parallel_tiles,
+                  on_batch);
+    ggml_free(band_ctx);
+}
+
 __STATIC_INLINE__ void sd_tiling(ggml_tensor* input,
                                  ggml_tensor* output,
                                  const int scale,
                                  const int tile_size,
                                  const float tile_overlap_factor,
-                                 on_tile_process on_processing) {
-    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing);
+                                 on_tile_process on_processing,
+                                 int parallel_tiles        = 1,
+                                 on_tiles_process on_batch = nullptr) {
+    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing, parallel_tiles, on_batch);
 }
 
 __STATIC_INLINE__ struct ggml_tensor* ggml_ext_group_norm_32(struct ggml_context* ctx,
@@ -1570,6 +1910,12 @@ protected:
 
     std::shared_ptr<WeightAdapter> weight_adapter = nullptr;
 
+    // runner whose params buffer this one reads, see share_params_from()
+    std::shared_ptr<GGMLRunner> params_owner = nullptr;
+
+    // model files params are served from in place, see map_params()
+    std::vector<std::shared_ptr<MappedModelFile>> params_mappings;
+
     std::vector<float> one_vec = {1.f};
     ggml_tensor* one_tensor    = nullptr;
 
@@ -1583,6 +1929,33 @@ protected:
     bool flash_attn_enabled    = false;
     bool conv2d_direct_enabled = false;
 
+    int build_n_threads = 1;  // threads of the running compute call, for host work in build_graph
+    int max_n_threads   = 0;  // caps n_threads of every compute call, 0 for no cap
+
+    // graph reuse across compute_with_graph_cache() calls
+    bool graph_cache_enabled                                   = true;
+    bool graph_cache_building                                  = false;
+    bool graph_cache_reusable                                  = false;
+    std::string graph_cache_key;
+    struct ggml_cgraph* cached_graph                           = nullptr;
+    const std::vector<struct ggml_tensor*>* graph_cache_inputs = nullptr;
+    std::vector<std::pair<struct ggml_tensor*, int>> graph_cache_input_slots;  // graph tensor -> index of input
+    std::map<struct ggml_tensor*, const void*> graph_cache_tensor_data;        // runner owned data
+    std::set<struct ggml_tensor*> graph_cache_resident;                        // uploaded once per graph, e.g. pe
+
+    // independent compute states used by compute_parallel()
+    struct ParallelSlot {
+        struct ggml_context* ctx     = nullptr;
+        struct ggml_gallocr* allocr  = nullptr;
+        ggml_backend_t backend       = nullptr;
+        ggml_threadpool_t threadpool = nullptr;
+        int n_threads                = 0;  // threads of threadpool
+        struct ggml_cgraph* gf       = nullptr;
+    };
+    std::vector<ParallelSlot> parallel_slots;
+    // compute buffers of all slots together stay below this, at least one graph always runs
+    size_t parallel_mem_budget = static_cast<size_t>(2) * 1024 * 1024 * 1024;
+
     void alloc_params_ctx() {
         struct ggml_init_params params;
         params.mem_size   = static_cast<size_t>(MAX_PARAMS_TENSOR_NUM * ggml_tensor_overhead());
@@ -1625,23 +1998,75 @@ protected:
         }
     }
 
-    void alloc_compute_ctx() {
+    static struct ggml_context* new_compute_ctx() {
         struct ggml_init_params params;
         params.mem_size   = static_cast<size_t>(ggml_tensor_overhead() * MAX_GRAPH_SIZE + ggml_graph_overhead());
         params.mem_buffer = nullptr;
         params.no_alloc   = true;
 
-        compute_ctx = ggml_init(params);
-        GGML_ASSERT(compute_ctx != nullptr);
+        struct ggml_context* ctx = ggml_init(params);
+        GGML_ASSERT(ctx != nullptr);
+        return ctx;
+    }
+
+    void alloc_compute_ctx() {
+        compute_ctx = new_compute_ctx();
+    }
+
+    void free_parallel_slots(size_t keep = 0) {
+        for (size_t i = keep; i < parallel_slots.size(); i++) {
+            auto& slot = parallel_slots[i];
+            if (slot.allocr != nullptr) {
+                ggml_gallocr_free(slot.allocr);
+            }
+            if (slot.ctx != nullptr) {
+                ggml_free(slot.ctx);
+            }
+            if (slot.backend != nullptr) {
+                ggml_backend_free(slot.backend);
+            }
+            if (slot.threadpool != nullptr) {
+                ggml_threadpool_free(slot.threadpool);
+            }
+        }
+        if (parallel_slots.size() > keep) {
+            parallel_slots.resize(keep);
+        }
     }
 
     void free_compute_ctx() {
+        free_graph_cache();
         if (compute_ctx != nullptr) {
             ggml_free(compute_ctx);
             compute_ctx = nullptr;
         }
     }
 
+    void free_graph_cache() {
+        cached_graph = nullptr;
+        graph_cache_key.clear();
+        graph_cache_input_slots.clear();
+        graph_cache_tensor_data.clear();
+        graph_cache_resident.clear();
+    }
+
+    std::string get_graph_cache_key(const std::vector<struct ggml_tensor*>& inputs, const std::string& extra_key) {
+        std::string key = extra_key;
+        key += "|" + std::to_string(reinterpret_cast<uintptr_t>(weight_adapter.get()));
+        key += "|" + std::to_string(flash_attn_enabled) + std::to_string(conv2d_direct_enabled);
+        for (auto tensor : inputs) {
+            if (tensor == nullptr) {
+                key += "|-";
+                continue;
+            }
+            key += "|" + std::to_string(tensor->type);
+            for (int i = 0; i < GGML_MAX_DIMS; i++) {
+                key += "," + std::to_string(tensor->ne[i]);
+            }
+        }
+        return key;
+    }
+
     void prepare_build_in_tensor_before() {
         one_tensor = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_F32, 1);
         ggml_set_name(one_tensor, "ggml_runner_build_in_tensor:one");
@@ -1869,8 +2294,19 @@ public:
     }
 
     bool alloc_params_buffer() {
-        size_t num_tensors = ggml_tensor_num(params_ctx);
-        params_buffer      = ggml_backend_alloc_ctx_tensors(params_ctx, params_backend);
+        if (params_owner != nullptr) {
+            return true;
+        }
+        size_t num_tensors = 0;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != nullptr; t = ggml_get_next_tensor(params_ctx, t)) {
+            if (t->data == nullptr) {
+                num_tensors++;
+            }
+        }
+        if (num_tensors == 0) {
+            return true;
+        }
+        params_buffer = ggml_backend_alloc_ctx_tensors(params_ctx, params_backend);
         if (params_buffer == nullptr) {
             LOG_ERROR("%s alloc params backend buffer failed, num_tensors = %i",
                       get_desc().c_str(),
@@ -1891,6 +2327,7 @@ public:
             ggml_backend_buffer_free(params_buffer);
             params_buffer = nullptr;
         }
+        params_mappings.clear();
     }
 
     size_t get_params_buffer_size() {
@@ -1900,12 +2337,110 @@ public:
         return 0;
     }
 
+    ggml_context* get_params_ctx() {
+        return params_ctx;
+    }
+
+    ggml_backend_t get_params_backend() {
+        return params_backend;
+    }
+
+    // type and shape of every param, equal for runners built from the same weights
+    std::string get_params_signature() {
+        std::string signature;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != nullptr; t = ggml_get_next_tensor(params_ctx, t)) {
+            signature += sd_format("%s[%lld,%lld,%lld,%lld];",
+                                   ggml_type_name(t->type),
+                                   (long long)t->ne[0],
+                                   (long long)t->ne[1],
+                                   (long long)t->ne[2],
+                                   (long long)t->ne[3]);
+        }
+        return signature;
+    }
+
+    bool has_shared_params() {
+        return params_owner != nullptr;
+    }
+
+    // Serves the params model_loader stores with their own type in place from the mapped model
+    // files, so they take no params buffer space and are never copied. tensors maps names to
+    // params of this and other runners. Must be called before alloc_params_buffer(), CPU
+    // params only; nobody may write to the params afterwards.
+    void map_params(ModelLoader& model_loader, const std::map<std::string, struct ggml_tensor*>& tensors) {
+        if (params_owner != nullptr || params_buffer != nullptr || !ggml_backend_is_cpu(params_backend)) {
+            return;
+        }
+        std::set<ggml_tensor*> own_tensors;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != nullptr; t = ggml_get_next_tensor(params_ctx, t)) {
+            own_tensors.insert(t);
+        }
+        std::map<std::string, struct ggml_tensor*> params;
+        for (const auto& [name, tensor] : tensors) {
+            if (own_tensors.find(tensor) != own_tensors.end()) {
+                params[name] = tensor;
+            }
+        }
+        params_mappings = model_loader.map_tensors(params);
+
+        size_t mapped_size = 0;
+        int mapped_num     = 0;
+        for (const auto& [name, tensor] : params) {
+            if (tensor->data != nullptr) {
+                mapped_size += ggml_nbytes(tensor);
+                mapped_num++;
+            }
+        }
+        LOG_DEBUG("%s params served from mapped files = % 6.2f MB (%i tensors)",
+                  get_desc().c_str(),
+                  mapped_size / (1024.f * 1024.f),
+                  mapped_num);
+    }
+
+    // Points the params at the ones src already loaded instead of allocating a buffer, must
+    // be called before alloc_params_buffer(). src has to be built for the same weights and
+    // is kept alive; nobody may write to or free its params afterwards. Compute buffers stay
+    // per runner.
+    bool share_params_from(const std::shared_ptr<GGMLRunner>& src) {
+        if (src == nullptr || src.get() == this || params_buffer != nullptr || params_owner != nullptr) {
+            return false;
+        }
+        // while src computes with offloaded params its own tensors point at the runtime copy
+        ggml_context* src_ctx = src->params_on_runtime_backend ? src->offload_ctx : src->params_ctx;
+        if (ggml_tensor_num(params_ctx) != ggml_tensor_num(src_ctx)) {
+            return false;
+        }
+        ggml_tensor* t     = ggml_get_first_tensor(params_ctx);
+        ggml_tensor* src_t = ggml_get_first_tensor(src_ctx);
+        while (t != nullptr && src_t != nullptr) {
+            if (t->type != src_t->type || !ggml_are_same_shape(t, src_t) || src_t->data == nullptr) {
+                return false;
+            }
+            t     = ggml_get_next_tensor(params_ctx, t);
+            src_t = ggml_get_next_tensor(src_ctx, src_t);
+        }
+
+        t     = ggml_get_first_tensor(params_ctx);
+        src_t = ggml_get_first_tensor(src_ctx);
+        while (t != nullptr && src_t != nullptr) {
+            t->buffer = src_t->buffer;
+            t->data   = src_t->data;
+            t->extra  = src_t->extra;
+            t         = ggml_get_next_tensor(params_ctx, t);
+            src_t     = ggml_get_next_tensor(src_ctx, src_t);
+        }
+        params_owner = src->params_owner != nullptr ? src->params_owner : src;
+        return true;
+    }
+
     void free_cache_ctx_and_buffer() {
         free_cache_buffer();
         free_cache_ctx();
     }
 
     void free_compute_buffer() {
+        free_graph_cache();
+        free_parallel_slots();
         if (compute_allocr != nullptr) {
             ggml_gallocr_free(compute_allocr);
             compute_allocr = nullptr;
@@ -1918,11 +2453,34 @@ public:
         backend_tensor_data_map[tensor] = data;
     }
 
+    // Like set_backend_tensor_data(), for data that stays the same while the graph is
+    // reused: it is uploaded when the graph is built and its memory is never handed to
+    // other nodes. data must stay valid until the graph is built.
+    void set_backend_tensor_resident_data(struct ggml_tensor* tensor, const void* data) {
+        if (graph_cache_building) {
+            ggml_set_output(tensor);
+            graph_cache_resident.insert(tensor);
+        }
+        backend_tensor_data_map[tensor] = data;
+    }
+
     struct ggml_tensor* to_backend(struct ggml_tensor* tensor) {
         GGML_ASSERT(compute_ctx != nullptr);
         if (tensor == nullptr) {
             return nullptr;
         }
+        if (graph_cache_building) {
+            auto it = std::find(graph_cache_inputs->begin(), graph_cache_inputs->end(), tensor);
+            if (it != graph_cache_inputs->end() && (tensor->buffer == nullptr || ggml_backend_buffer_is_host(tensor->buffer))) {
+                // graph owned copy, refilled from inputs on every run
+                auto backend_tensor = ggml_dup_tensor(compute_ctx, tensor);
+                ggml_set_input(backend_tensor);
+                graph_cache_input_slots.push_back({backend_tensor, static_cast<int>(it - graph_cache_inputs->begin())});
+                return backend_tensor;
+            }
+            // the graph would keep pointing at a tensor we don't track
+            graph_cache_reusable = false;
+        }
         // it's performing a compute, check if backend isn't cpu
         if (!ggml_backend_is_cpu(runtime_backend) && (tensor->buffer == nullptr || ggml_backend_buffer_is_host(tensor->buffer))) {
             // pass input tensors to gpu memory
@@ -1946,11 +2504,124 @@ public:
         return ggml_get_tensor(cache_ctx, name.c_str());
     }
 
+    // Nodes reading a weight belong to the block owning it, other nodes to the common
+    // prefix of their inputs' blocks.
+    static std::string profile_node_block(const struct ggml_tensor* node,
+                                          const std::unordered_map<const struct ggml_tensor*, std::string>& blocks) {
+        std::string block;
+        bool have_block = false;
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            const struct ggml_tensor* src = node->src[i];
+            if (src == nullptr) {
+                continue;
+            }
+            if (src->op == GGML_OP_NONE) {
+                const char* dot = strrchr(src->name, '.');
+                if (dot != nullptr) {
+                    return std::string(src->name, dot - src->name);
+                }
+                continue;
+            }
+            auto it = blocks.find(src);
+            if (it == blocks.end()) {
+                continue;
+            }
+            if (!have_block) {
+                block      = it->second;
+                have_block = true;
+                continue;
+            }
+            size_t len = 0;
+            for (size_t k = 0; k <= block.size() && k <= it->second.size(); k++) {
+                bool end_a = k == block.size() || block[k] == '.';
+                bool end_b = k == it->second.size() || it->second[k] == '.';
+                if (end_a && end_b) {
+                    len = k;
+                }
+                if (k == block.size() || k == it->second.size() || block[k] != it->second[k]) {
+                    break;
+                }
+            }
+            block.resize(len);
+        }
+        return block;
+    }
+
+    // Evaluates gf one node at a time and records the wall time of each node.
+    ggml_status compute_graph_profiled(struct ggml_cgraph* gf) {
+        struct ggml_init_params params;
+        params.mem_size   = ggml_graph_overhead_custom(1, false);
+        params.mem_buffer = nullptr;
+        params.no_alloc   = true;
+
+        struct ggml_context* ctx = ggml_init(params);
+        GGML_ASSERT(ctx != nullptr);
+        struct ggml_cgraph* single = ggml_new_graph_custom(ctx, 1, false);
+
+        std::unordered_map<const struct ggml_tensor*, std::string> blocks;
+        std::vector<sd_profile_node_t> records;
+        ggml_status status = GGML_STATUS_SUCCESS;
+        for (int i = 0; i < ggml_graph_n_nodes(gf); i++) {
+            struct ggml_tensor* node = ggml_graph_node(gf, i);
+            std::string block        = profile_node_block(node, blocks);
+
+            ggml_graph_clear(single);
+            ggml_graph_add_node(single, node);
+            int64_t t0 = ggml_time_us();
+            status     = ggml_backend_graph_compute(runtime_backend, single);
+            ggml_backend_synchronize(runtime_backend);
+            int64_t t1 = ggml_time_us();
+            if (status != GGML_STATUS_SUCCESS) {
+                break;
+            }
+            bool is_view = node->op == GGML_OP_NONE || node->op == GGML_OP_RESHAPE || node->op == GGML_OP_VIEW ||
+                           node->op == GGML_OP_PERMUTE || node->op == GGML_OP_TRANSPOSE;
+            if (!is_view) {
+                records.push_back({ggml_op_desc(node), block, t0, t1 - t0});
+            }
+            blocks[node] = std::move(block);
+        }
+        ggml_free(ctx);
+        sd_profile_record_graph(get_desc(), records);
+        return status;
+    }
+
+    bool run_graph(struct ggml_cgraph* gf,
+                   int n_threads,
+                   struct ggml_tensor** output,
+                   struct ggml_context* output_ctx) {
+        if (ggml_backend_is_cpu(runtime_backend)) {
+            ggml_backend_cpu_set_n_threads(runtime_backend, n_threads);
+        }
+
+        ggml_status status = sd_profiling_enabled() ? compute_graph_profiled(gf) : ggml_backend_graph_compute(runtime_backend, gf);
+        if (status != GGML_STATUS_SUCCESS) {
+            LOG_ERROR("%s compute failed: %s", get_desc().c_str(), ggml_status_to_string(status));
+            return false;
+        }
+#ifdef GGML_PERF
+        ggml_graph_print(gf);
+#endif
+        copy_cache_tensors_to_cache_buffer();
+        if (output != nullptr) {
+            auto result = ggml_get_tensor(compute_ctx, final_result_name.c_str());
+            if (*output == nullptr && output_ctx != nullptr) {
+                *output = ggml_dup_tensor(output_ctx, result);
+            }
+            if (*output != nullptr) {
+                ggml_ext_backend_tensor_get_and_sync(runtime_backend, result, (*output)->data, 0, ggml_nbytes(*output));
+            }
+        }
+        return true;
+    }
+
     bool compute(get_graph_cb_t get_graph,
                  int n_threads,
                  bool free_compute_buffer_immediately = true,
                  struct ggml_tensor** output          = nullptr,
                  struct ggml_context* output_ctx      = nullptr) {
+        n_threads       = get_n_threads(n_threads);
+        build_n_threads = n_threads;
         if (!offload_params_to_runtime_backend()) {
             LOG_ERROR("%s offload params to runtime backend failed", get_desc().c_str());
             return false;
@@ -1966,35 +2637,219 @@ public:
             return false;
         }
         copy_data_to_backend_tensor();
-        if (ggml_backend_is_cpu(runtime_backend)) {
-            ggml_backend_cpu_set_n_threads(runtime_backend, n_threads);
+        if (!run_graph(gf, n_threads, output, output_ctx)) {
+            return false;
         }
 
-        ggml_status status = ggml_backend_graph_compute(runtime_backend, gf);
-        if (status != GGML_STATUS_SUCCESS) {
-            LOG_ERROR("%s compute failed: %s", get_desc().c_str(), ggml_status_to_string(status));
+        if (free_compute_buffer_immediately) {
+            free_compute_buffer();
+        }
+        return true;
+    }
+
+    // Like compute(), but keeps the built graph and its allocation while the shapes of
+    // inputs and extra_key stay the same, so repeated calls (e.g. sampling steps) only
+    // upload new input data. Every host tensor the graph reads must be listed in inputs;
+    // anything else captured by build_graph must be encoded in extra_key.
+    bool compute_with_graph_cache(get_graph_cb_t get_graph,
+                                  int n_threads,
+                                  const std::vector<struct ggml_tensor*>& inputs,
+                                  const std::string& extra_key,
+                                  struct ggml_tensor** output     = nullptr,
+                                  struct ggml_context* output_ctx = nullptr) {
+        n_threads       = get_n_threads(n_threads);
+        build_n_threads = n_threads;
+        if (!graph_cache_enabled) {
+            return compute(get_graph, n_threads, false, output, output_ctx);
+        }
+        if (!offload_params_to_runtime_backend()) {
+            LOG_ERROR("%s offload params to runtime backend failed", get_desc().c_str());
             return false;
         }
-#ifdef GGML_PERF
-        ggml_graph_print(gf);
-#endif
-        copy_cache_tensors_to_cache_buffer();
-        if (output != nullptr) {
-            auto result = ggml_get_tensor(compute_ctx, final_result_name.c_str());
-            if (*output == nullptr && output_ctx != nullptr) {
-                *output = ggml_dup_tensor(output_ctx, result);
+
+        std::string key        = get_graph_cache_key(inputs, extra_key);
+        struct ggml_cgraph* gf = cached_graph;
+        if (gf == nullptr || compute_allocr == nullptr || key != graph_cache_key) {
+            reset_compute_ctx();
+            graph_cache_resident.clear();
+            graph_cache_inputs   = &inputs;
+            graph_cache_building = true;
+            graph_cache_reusable = cache_tensor_map.empty();
+            gf                   = get_compute_graph(get_graph);
+            graph_cache_building = false;
+            graph_cache_inputs   = nullptr;
+
+            // a single allocation pass, ggml_gallocr_alloc_graph reserves on demand
+            if (compute_allocr == nullptr) {
+                compute_allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(runtime_backend));
             }
-            if (*output != nullptr) {
-                ggml_ext_backend_tensor_get_and_sync(runtime_backend, result, (*output)->data, 0, ggml_nbytes(*output));
+            if (!ggml_gallocr_alloc_graph(compute_allocr, gf)) {
+                LOG_ERROR("%s alloc compute graph failed", get_desc().c_str());
+                free_graph_cache();
+                return false;
+            }
+            LOG_DEBUG("%s compute buffer size: %.2f MB(%s)",
+                      get_desc().c_str(),
+                      ggml_gallocr_get_buffer_size(compute_allocr, 0) / 1024.0 / 1024.0,
+                      ggml_backend_is_cpu(runtime_backend) ? "RAM" : "VRAM");
+
+            graph_cache_tensor_data.clear();
+            for (auto& kv : backend_tensor_data_map) {
+                if (graph_cache_resident.count(kv.first)) {
+                    ggml_backend_tensor_set(kv.first, kv.second, 0, ggml_nbytes(kv.first));
+                } else {
+                    graph_cache_tensor_data.insert(kv);
+                }
+            }
+            backend_tensor_data_map.clear();
+            if (graph_cache_reusable) {
+                cached_graph    = gf;
+                graph_cache_key = key;
+            } else {
+                LOG_DEBUG("%s graph captures tensors outside its inputs, not caching it", get_desc().c_str());
             }
         }
 
-        if (free_compute_buffer_immediately) {
-            free_compute_buffer();
+        for (auto& slot : graph_cache_input_slots) {
+            ggml_backend_tensor_set(slot.first, inputs[slot.second]->data, 0, ggml_nbytes(slot.first));
+        }
+        for (auto& kv : graph_cache_tensor_data) {
+            ggml_backend_tensor_set(kv.first, kv.second, 0, ggml_nbytes(kv.first));
+        }
+        bool res = run_graph(gf, n_threads, output, output_ctx);
+        if (cached_graph == nullptr) {
+            free_graph_cache();
+        }
+        return res;
+    }
+
+    // Runs independent graphs (e.g. tiles) concurrently. Each graph is built into its own
+    // compute context and allocator and runs on its own CPU backend. At most n_threads graphs
+    // run at once, fewer if their compute buffers would exceed parallel_mem_budget, and every
+    // slot gets an even share of n_threads, so a round never uses more than n_threads threads.
+    // outputs must be allocated. Non-CPU backends run the graphs one by one.
+    bool compute_parallel(const std::vector<get_graph_cb_t>& get_graphs,
+                          int n_threads,
+                          const std::vector<struct ggml_tensor*>& outputs) {
+        n_threads       = get_n_threads(n_threads);
+        build_n_threads = n_threads;
+        GGML_ASSERT(get_graphs.size() == outputs.size());
+        size_t n = get_graphs.size();
+        if (n <= 1 || n_threads <= 1 || !ggml_backend_is_cpu(runtime_backend) || sd_profiling_enabled()) {
+            for (size_t i = 0; i < n; i++) {
+                struct ggml_tensor* output = outputs[i];
+                if (!compute(get_graphs[i], n_threads, false, &output)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        if (!offload_params_to_runtime_backend()) {
+            LOG_ERROR("%s offload params to runtime backend failed", get_desc().c_str());
+            return false;
+        }
+
+        // graphs are built one by one, they share the runner's build state
+        auto build_slot = [&](size_t slot_idx, size_t graph_idx) {
+            if (parallel_slots.size() <= slot_idx) {
+                parallel_slots.resize(slot_idx + 1);
+            }
+            auto& slot = parallel_slots[slot_idx];
+            if (slot.ctx != nullptr) {
+                ggml_free(slot.ctx);
+            }
+            slot.ctx = new_compute_ctx();
+            std::swap(compute_ctx, slot.ctx);
+            slot.gf = get_compute_graph(get_graphs[graph_idx]);
+            std::swap(compute_ctx, slot.ctx);
+
+            if (slot.allocr == nullptr) {
+                slot.allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(runtime_backend));
+            }
+            if (!ggml_gallocr_alloc_graph(slot.allocr, slot.gf)) {
+                LOG_ERROR("%s alloc compute graph %zu failed", get_desc().c_str(), graph_idx);
+                backend_tensor_data_map.clear();
+                return false;
+            }
+            copy_data_to_backend_tensor();
+            return true;
+        };
+
+        // the tiles share one shape, the first graph tells the compute buffer size of all
+        if (!build_slot(0, 0)) {
+            return false;
+        }
+        size_t buffer_size = std::max<size_t>(1, ggml_gallocr_get_buffer_size(parallel_slots[0].allocr, 0));
+        size_t n_slots     = std::min(n, static_cast<size_t>(n_threads));
+        n_slots            = std::max<size_t>(1, std::min(n_slots, parallel_mem_budget / buffer_size));
+        free_parallel_slots(n_slots);
+
+        int threads_per_graph = n_threads / (int)n_slots;
+        LOG_DEBUG("%s running %zu graphs, %zu at a time with %d threads each",
+                  get_desc().c_str(), n, n_slots, threads_per_graph);
+
+        std::vector<ggml_status> status(n_slots, GGML_STATUS_SUCCESS);
+        for (size_t begin = 0; begin < n; begin += n_slots) {
+            size_t count = std::min(n_slots, n - begin);
+            for (size_t i = 0; i < count; i++) {
+                if ((begin > 0 || i > 0) && !build_slot(i, begin + i)) {
+                    return false;
+                }
+                auto& slot = parallel_slots[i];
+                if (slot.backend == nullptr) {
+                    slot.backend = ggml_backend_cpu_init();
+                }
+                if (slot.threadpool == nullptr || slot.n_threads != threads_per_graph) {
+                    // detach the old threadpool before it is freed
+                    ggml_backend_cpu_set_threadpool(slot.backend, nullptr);
+                    if (slot.threadpool != nullptr) {
+                        ggml_threadpool_free(slot.threadpool);
+                    }
+                    struct ggml_threadpool_params params = ggml_threadpool_params_default(threads_per_graph);
+                    slot.threadpool                      = ggml_threadpool_new(&params);
+                    slot.n_threads                       = threads_per_graph;
+                    ggml_backend_cpu_set_threadpool(slot.backend, slot.threadpool);
+                }
+                ggml_backend_cpu_set_n_threads(slot.backend, threads_per_graph);
+            }
+
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < count; i++) {
+                workers.emplace_back([&, i]() {
+                    status[i] = ggml_backend_graph_compute(parallel_slots[i].backend, parallel_slots[i].gf);
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                if (status[i] != GGML_STATUS_SUCCESS) {
+                    LOG_ERROR("%s compute failed: %s", get_desc().c_str(), ggml_status_to_string(status[i]));
+                    return false;
+                }
+                auto result = ggml_get_tensor(parallel_slots[i].ctx, final_result_name.c_str());
+                ggml_backend_tensor_get(result, outputs[begin + i]->data, 0, ggml_nbytes(outputs[begin + i]));
+            }
+            copy_cache_tensors_to_cache_buffer();
         }
         return true;
     }
 
+    // caps the threads of later compute calls, e.g. while another runner shares the CPU, 0 removes the cap
+    void set_max_n_threads(int n) {
+        max_n_threads = n;
+    }
+
+    int get_n_threads(int n_threads) {
+        return max_n_threads > 0 ? std::min(n_threads, max_n_threads) : n_threads;
+    }
+
+    void set_graph_cache_enabled(bool enabled) {
+        graph_cache_enabled = enabled;
+        free_graph_cache();
+    }
+
     void set_flash_attention_enabled(bool enabled) {
         flash_attn_enabled = enabled;
     }
@@ -2044,6 +2899,10 @@ public:
             prefix = prefix + ".";
         }
         init_params(ctx, tensor_storage_map, prefix);
+        for (auto& pair : params) {
+            // lets the profiler attribute graph nodes to blocks
+            ggml_set_name(pair.second, (prefix + pair.first).c_str());
+        }
         init_blocks(ctx, tensor_storage_map, prefix);
     }
 
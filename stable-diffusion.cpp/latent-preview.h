@@ -180,8 +180,8 @@ void preview_latent_video(uint8_t* buffer, struct ggml_tensor* latents, const fl
     uint32_t unpatched_dim = dim / (patch_size * patch_size);
 
     for (int k = 0; k < frames; k++) {
-        for (int rgb_x = 0; rgb_x < rgb_width; rgb_x++) {
-            for (int rgb_y = 0; rgb_y < rgb_height; rgb_y++) {
+        for (int rgb_y = 0; rgb_y < rgb_height; rgb_y++) {
+            for (int rgb_x = 0; rgb_x < rgb_width; rgb_x++) {
                 int latent_x = rgb_x / patch_size;
                 int latent_y = rgb_y / patch_size;
 
@@ -1364,7 +1364,8 @@ namespace LLM {
                                                 params.vision.spatial_merge_size,
                                                 window_inverse_index_vec,
                                                 10000.f,
-                                                {head_dim / 2, head_dim / 2});
+                                                {head_dim / 2, head_dim / 2},
+                                                build_n_threads);
             int pos_len  = pe_vec.size() / head_dim / 2;
             // LOG_DEBUG("pos_len %d", pos_len);
             auto pe = ggml_new_tensor_4d(compute_ctx, GGML_TYPE_F32, 2, 2, head_dim / 2, pos_len);
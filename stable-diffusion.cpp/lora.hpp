@@ -1,6 +1,7 @@
 #ifndef __LORA_HPP__
 #define __LORA_HPP__
 
+#include <list>
 #include <mutex>
 #include "ggml_extend.hpp"
 
@@ -641,24 +642,53 @@ struct LoraModel : public GGMLRunner {
         return out_diff;
     }
 
-    struct ggml_cgraph* build_lora_graph(const std::map<std::string, ggml_tensor*>& model_tensors, SDVersion version) {
-        size_t lora_graph_size = LORA_GRAPH_BASE_SIZE + lora_tensors.size() * 10;
+    typedef std::function<void(const std::string& name, ggml_tensor* tensor)> patch_cb_t;
+
+    // Adds the diffs of every lora in loras to model_tensors, this runner owns the graph.
+    // before_patch is called with each model tensor the graph is going to modify.
+    struct ggml_cgraph* build_lora_graph(const std::map<std::string, ggml_tensor*>& model_tensors,
+                                         SDVersion version,
+                                         const std::vector<LoraModel*>& loras,
+                                         const patch_cb_t& before_patch = nullptr) {
+        size_t lora_graph_size = LORA_GRAPH_BASE_SIZE;
+        for (auto lora : loras) {
+            lora_graph_size += lora->lora_tensors.size() * 10;
+            lora->preprocess_lora_tensors(model_tensors);
+            lora->applied_lora_tensors.clear();
+        }
         struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, lora_graph_size, false);
 
-        preprocess_lora_tensors(model_tensors);
-
         original_tensor_to_final_tensor.clear();
-        applied_lora_tensors.clear();
 
         for (auto it : model_tensors) {
             std::string model_tensor_name = it.first;
             ggml_tensor* model_tensor     = it.second;
 
             // lora
-            ggml_tensor* diff = get_weight_diff(model_tensor_name, compute_ctx, model_tensor);
+            ggml_tensor* diff = nullptr;
+            for (auto lora : loras) {
+                ggml_tensor* curr_diff = lora->get_weight_diff(model_tensor_name, compute_ctx, model_tensor);
+                if (curr_diff == nullptr) {
+                    continue;
+                }
+                if (diff == nullptr) {
+                    diff = curr_diff;
+                    continue;
+                }
+                if (diff->type != GGML_TYPE_F32) {
+                    diff = ggml_ext_cast_f32(compute_ctx, diff);
+                }
+                if (curr_diff->type != GGML_TYPE_F32) {
+                    curr_diff = ggml_ext_cast_f32(compute_ctx, curr_diff);
+                }
+                diff = ggml_add(compute_ctx, diff, curr_diff);
+            }
             if (diff == nullptr) {
                 continue;
             }
+            if (before_patch) {
+                before_patch(model_tensor_name, model_tensor);
+            }
 
             ggml_tensor* original_tensor = model_tensor;
             if (!ggml_backend_is_cpu(runtime_backend) && ggml_backend_buffer_is_host(original_tensor->buffer)) {
@@ -682,12 +712,19 @@ struct LoraModel : public GGMLRunner {
         return gf;
     }
 
-    void apply(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version, int n_threads) {
+    // Merges loras into model_tensors with a single graph. All loras must live on this runner's backend.
+    void apply(std::map<std::string, struct ggml_tensor*> model_tensors,
+               SDVersion version,
+               int n_threads,
+               const std::vector<LoraModel*>& loras,
+               const patch_cb_t& before_patch = nullptr) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_lora_graph(model_tensors, version);
+            return build_lora_graph(model_tensors, version, loras, before_patch);
         };
         GGMLRunner::compute(get_graph, n_threads, false);
-        stat();
+        for (auto lora : loras) {
+            lora->stat();
+        }
         for (auto item : original_tensor_to_final_tensor) {
             ggml_tensor* original_tensor = item.first;
             ggml_tensor* final_tensor    = item.second;
@@ -698,6 +735,10 @@ struct LoraModel : public GGMLRunner {
         GGMLRunner::free_compute_buffer();
     }
 
+    void apply(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version, int n_threads) {
+        apply(model_tensors, version, n_threads, {this});
+    }
+
     void stat(bool at_runntime = false) {
         size_t total_lora_tensors_count   = 0;
         size_t applied_lora_tensors_count = 0;
@@ -800,4 +841,68 @@ public:
     }
 };
 
+// Parsed LoRAs kept resident between generations, so switching back to a recently used LoRA
+// skips reading and parsing its file. The caller builds the key from the file and everything
+// that selects which tensors get loaded and where. LoRAs still referenced outside the cache
+// are never evicted; the others are dropped least recently used first to fit max_bytes.
+struct LoraCache {
+    struct Entry {
+        std::string key;
+        std::shared_ptr<LoraModel> lora;
+        size_t nbytes = 0;
+    };
+
+    size_t max_bytes = 0;
+    uint64_t hits    = 0;
+    uint64_t misses  = 0;
+
+    std::list<Entry> entries;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+    std::shared_ptr<LoraModel> get(const std::string& key) {
+        auto iter = index.find(key);
+        if (iter == index.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, iter->second);
+        return iter->second->lora;
+    }
+
+    void put(const std::string& key, const std::shared_ptr<LoraModel>& lora) {
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            entries.erase(iter->second);
+            index.erase(iter);
+        }
+        Entry entry;
+        entry.key    = key;
+        entry.lora   = lora;
+        entry.nbytes = lora->get_params_buffer_size();
+        entries.push_front(std::move(entry));
+        index[key] = entries.begin();
+    }
+
+    // evicts unused LoRAs, oldest first, until the unused ones fit max_bytes
+    void trim() {
+        size_t unused_bytes = 0;
+        for (auto& entry : entries) {
+            if (entry.lora.use_count() == 1) {
+                unused_bytes += entry.nbytes;
+            }
+        }
+        for (auto iter = entries.end(); iter != entries.begin() && unused_bytes > max_bytes;) {
+            --iter;
+            if (iter->lora.use_count() != 1) {
+                continue;
+            }
+            LOG_DEBUG("dropping cached lora '%s'", iter->key.c_str());
+            unused_bytes -= iter->nbytes;
+            index.erase(iter->key);
+            iter = entries.erase(iter);
+        }
+    }
+};
+
 #endif  // __LORA_HPP__
@@ -910,7 +910,11 @@ struct MMDiTRunner : public GGMLRunner {
             return build_graph(x, timesteps, context, y, skip_layers);
         };
 
-        return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        std::string graph_key;
+        for (int layer : skip_layers) {
+            graph_key += std::to_string(layer) + ",";
+        }
+        return GGMLRunner::compute_with_graph_cache(get_graph, n_threads, {x, timesteps, context, y}, graph_key, output, output_ctx);
     }
 
     void test() {
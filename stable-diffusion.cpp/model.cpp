@@ -1340,6 +1340,82 @@ std::string ModelLoader::load_umt5_tokenizer_json() {
     return json_str;
 }
 
+struct MappedModelFile {
+    MmapFile file;
+    ggml_backend_buffer_t buffer = nullptr;  // CPU buffer over the whole mapping, owns no memory
+
+    ~MappedModelFile() {
+        if (buffer != nullptr) {
+            ggml_backend_buffer_free(buffer);
+        }
+    }
+};
+
+std::shared_ptr<MappedModelFile> ModelLoader::get_mapped_file(size_t file_index) {
+    if (!use_mmap_ || file_index >= file_paths_.size()) {
+        return nullptr;
+    }
+    if (mapped_files_.size() < file_paths_.size()) {
+        mapped_files_.resize(file_paths_.size());
+    }
+    if (mapped_files_[file_index] == nullptr) {
+        auto mapped = std::make_shared<MappedModelFile>();
+        if (!mapped->file.open(file_paths_[file_index])) {
+            LOG_DEBUG("failed to mmap '%s', falling back to buffered reads", file_paths_[file_index].c_str());
+            return nullptr;
+        }
+        mapped->buffer = ggml_backend_cpu_buffer_from_ptr((void*)mapped->file.data(), mapped->file.size());
+        if (mapped->buffer == nullptr) {
+            return nullptr;
+        }
+        ggml_backend_buffer_set_usage(mapped->buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        mapped_files_[file_index] = mapped;
+    }
+    return mapped_files_[file_index];
+}
+
+std::vector<std::shared_ptr<MappedModelFile>> ModelLoader::map_tensors(const std::map<std::string, struct ggml_tensor*>& tensors) {
+    std::vector<std::shared_ptr<MappedModelFile>> used_files;
+    if (!use_mmap_) {
+        return used_files;
+    }
+    for (const auto& [name, tensor] : tensors) {
+        if (tensor->data != nullptr || tensor->view_src != nullptr || is_unused_tensor(name)) {
+            continue;
+        }
+        auto iter = tensor_storage_map.find(name);
+        if (iter == tensor_storage_map.end()) {
+            continue;
+        }
+        const TensorStorage& tensor_storage = iter->second;
+        if (tensor_storage.index_in_zip >= 0 ||
+            tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2 || tensor_storage.is_f64 || tensor_storage.is_i64 ||
+            tensor_storage.type != tensor->type ||
+            tensor_storage.ne[0] != tensor->ne[0] || tensor_storage.ne[1] != tensor->ne[1] ||
+            tensor_storage.ne[2] != tensor->ne[2] || tensor_storage.ne[3] != tensor->ne[3]) {
+            continue;
+        }
+        std::shared_ptr<MappedModelFile> mapped = get_mapped_file(tensor_storage.file_index);
+        if (mapped == nullptr || tensor_storage.offset + ggml_nbytes(tensor) > mapped->file.size()) {
+            continue;
+        }
+        // the CPU kernels read elements and quant blocks in place, keep them naturally aligned
+        uint8_t* data    = (uint8_t*)mapped->file.data() + tensor_storage.offset;
+        size_t type_size = ggml_type_size(tensor->type);
+        size_t align     = type_size % 4 == 0 ? 4 : (type_size % 2 == 0 ? 2 : 1);
+        if ((uintptr_t)data % align != 0) {
+            continue;
+        }
+        if (ggml_backend_tensor_alloc(mapped->buffer, tensor, data) != GGML_STATUS_SUCCESS) {
+            continue;
+        }
+        if (std::find(used_files.begin(), used_files.end(), mapped) == used_files.end()) {
+            used_files.push_back(mapped);
+        }
+    }
+    return used_files;
+}
+
 bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_threads_p) {
     int64_t process_time_ms = 0;
     std::atomic<int64_t> read_time_ms(0);
@@ -1396,6 +1472,12 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_thread
         }
         last_n_threads = n_threads;
 
+        // map the file once and let every worker read from the page cache directly,
+        // falls back to per-thread ifstream reads if mapping is unavailable
+        std::shared_ptr<MappedModelFile> mapping = is_zip ? nullptr : get_mapped_file(file_index);
+        const uint8_t* mapped_file               = mapping != nullptr ? mapping->file.data() : nullptr;
+        const size_t mapped_size                 = mapping != nullptr ? mapping->file.size() : 0;
+
         std::atomic<size_t> tensor_idx(0);
         std::atomic<bool> failed(false);
         std::vector<std::thread> workers;
@@ -1411,7 +1493,7 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_thread
                         failed = true;
                         return;
                     }
-                } else {
+                } else if (mapped_file == nullptr) {
                     file.open(file_path, std::ios::binary);
                     if (!file.is_open()) {
                         LOG_ERROR("failed to open '%s'", file_path.c_str());
@@ -1449,8 +1531,28 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_thread
 
                     size_t nbytes_to_read = tensor_storage.nbytes_to_read();
 
+                    char* mapped_data = nullptr;
+                    if (mapped_file != nullptr) {
+                        if (tensor_storage.offset + nbytes_to_read > mapped_size) {
+                            LOG_ERROR("tensor data out of file bounds: '%s'", tensor_storage.name.c_str());
+                            failed = true;
+                            break;
+                        }
+                        mapped_data = (char*)mapped_file + tensor_storage.offset;
+                        if ((char*)dst_tensor->data == mapped_data) {
+                            // served in place, see map_tensors()
+                            continue;
+                        }
+                    }
+
                     auto read_data = [&](char* buf, size_t n) {
-                        if (zip != nullptr) {
+                        if (mapped_data != nullptr) {
+                            if (buf != mapped_data) {
+                                int64_t t_memcpy_start = ggml_time_ms();
+                                memcpy((void*)buf, (void*)mapped_data, n);
+                                memcpy_time_ms.fetch_add(ggml_time_ms() - t_memcpy_start);
+                            }
+                        } else if (zip != nullptr) {
                             zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
                             size_t entry_size = zip_entry_size(zip);
                             if (entry_size != n) {
@@ -1504,6 +1606,18 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_thread
                         }
                     }
 
+                    if (mapped_data != nullptr) {
+                        // read straight from the mapping instead of staging through read_buffer
+                        bool needs_preconvert = tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2 ||
+                                                tensor_storage.is_f64 || tensor_storage.is_i64;
+                        if (needs_preconvert) {
+                            read_buf = mapped_data;
+                        } else if (read_buf != (char*)dst_tensor->data) {
+                            read_buf   = mapped_data;
+                            target_buf = mapped_data;
+                        }
+                    }
+
                     t0 = ggml_time_ms();
                     read_data(read_buf, nbytes_to_read);
                     t1 = ggml_time_ms();
@@ -1532,7 +1646,7 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_thread
                                        (int)tensor_storage.nelements() / (int)tensor_storage.ne[0],
                                        (int)tensor_storage.ne[0]);
                     } else {
-                        convert_buf = read_buf;
+                        convert_buf = target_buf;
                     }
                     t1 = ggml_time_ms();
                     convert_time_ms.fetch_add(t1 - t0);
@@ -277,11 +277,18 @@ typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_c
 
 typedef OrderedMap<std::string, TensorStorage> String2TensorStorage;
 
+// A model file mapped read-only, tensors served from it in place keep it alive
+struct MappedModelFile;
+
 class ModelLoader {
 protected:
     SDVersion version_ = VERSION_COUNT;
     std::vector<std::string> file_paths_;
     String2TensorStorage tensor_storage_map;
+    bool use_mmap_ = true;
+    std::vector<std::shared_ptr<MappedModelFile>> mapped_files_;  // by file index, opened on first use
+
+    std::shared_ptr<MappedModelFile> get_mapped_file(size_t file_index);
 
     void add_tensor_storage(const TensorStorage& tensor_storage);
 
@@ -309,7 +316,13 @@ public:
     std::map<ggml_type, uint32_t> get_diffusion_model_wtype_stat();
     std::map<ggml_type, uint32_t> get_vae_wtype_stat();
     String2TensorStorage& get_tensor_storage_map() { return tensor_storage_map; }
+    const std::vector<std::string>& get_file_paths() const { return file_paths_; }
     void set_wtype_override(ggml_type wtype, std::string tensor_type_rules = "");
+    void set_use_mmap(bool use_mmap) { use_mmap_ = use_mmap; }
+    // Points the tensors stored in a mapped file with their own type at the file data instead
+    // of loading them. The tensors must not be allocated yet and must never be written. Returns
+    // the mappings they now live in, which have to outlive them.
+    std::vector<std::shared_ptr<MappedModelFile>> map_tensors(const std::map<std::string, struct ggml_tensor*>& tensors);
     bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, int n_threads = 0);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       std::set<std::string> ignore_tensors = {},
@@ -4,223 +4,270 @@
 #include "ggml_extend.hpp"
 #define M_PI_ 3.14159265358979323846
 
-void convolve(struct ggml_tensor* input, struct ggml_tensor* output, struct ggml_tensor* kernel, int padding) {
-    struct ggml_init_params params;
-    params.mem_size                 = 80 * input->ne[0] * input->ne[1];  // 20M for 512x512
-    params.mem_buffer               = nullptr;
-    params.no_alloc                 = false;
-    struct ggml_context* ctx0       = ggml_init(params);
-    struct ggml_tensor* kernel_fp16 = ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, kernel->ne[0], kernel->ne[1], 1, 1);
-    ggml_fp32_to_fp16_row((float*)kernel->data, (ggml_fp16_t*)kernel_fp16->data, ggml_nelements(kernel));
-    ggml_tensor* h  = ggml_conv_2d(ctx0, kernel_fp16, input, 1, 1, padding, padding, 1, 1);
-    ggml_cgraph* gf = ggml_new_graph(ctx0);
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, h, output));
-    ggml_graph_compute_with_ctx(ctx0, gf, 1);
-    ggml_free(ctx0);
+// Canny runs over strips of rows so every stage works on data that is still in cache. Blur and
+// Sobel inputs and weights are rounded to f16, like the ggml conv_2d they used to run through.
+
+#define CANNY_STRIP_ROWS 32
+
+__STATIC_INLINE__ float canny_round_f16(float x) {
+    return ggml_fp16_to_fp32(ggml_fp32_to_fp16(x));
 }
 
-void gaussian_kernel(struct ggml_tensor* kernel) {
-    int ks_mid   = kernel->ne[0] / 2;
+void gaussian_kernel(float* kernel, int kernel_size) {
+    int ks_mid   = kernel_size / 2;
     float sigma  = 1.4f;
     float normal = 1.f / (2.0f * M_PI_ * powf(sigma, 2.0f));
-    for (int y = 0; y < kernel->ne[0]; y++) {
+    for (int y = 0; y < kernel_size; y++) {
         float gx = -ks_mid + y;
-        for (int x = 0; x < kernel->ne[1]; x++) {
-            float gy = -ks_mid + x;
-            float k_ = expf(-((gx * gx + gy * gy) / (2.0f * powf(sigma, 2.0f)))) * normal;
-            ggml_ext_tensor_set_f32(kernel, k_, x, y);
+        for (int x = 0; x < kernel_size; x++) {
+            float gy                    = -ks_mid + x;
+            float k_                    = expf(-((gx * gx + gy * gy) / (2.0f * powf(sigma, 2.0f)))) * normal;
+            kernel[y * kernel_size + x] = canny_round_f16(k_);
         }
     }
 }
 
-void grayscale(struct ggml_tensor* rgb_img, struct ggml_tensor* grayscale) {
-    for (int iy = 0; iy < rgb_img->ne[1]; iy++) {
-        for (int ix = 0; ix < rgb_img->ne[0]; ix++) {
-            float r    = ggml_ext_tensor_get_f32(rgb_img, ix, iy);
-            float g    = ggml_ext_tensor_get_f32(rgb_img, ix, iy, 1);
-            float b    = ggml_ext_tensor_get_f32(rgb_img, ix, iy, 2);
-            float gray = 0.2989f * r + 0.5870f * g + 0.1140f * b;
-            ggml_ext_tensor_set_f32(grayscale, gray, ix, iy);
-        }
+// 0: compare with the pixels above and below, 1-3: the other directions, 4: none
+__STATIC_INLINE__ uint8_t canny_direction(float dx, float dy) {
+    float angle = atan2f(dy, dx) * 180.0f / M_PI_;
+    angle       = angle < 0.0f ? angle += 180.0f : angle;
+    if ((0 >= angle && angle < 22.5f) || (157.5f >= angle && angle <= 180)) {
+        return 0;
+    } else if (22.5f >= angle && angle < 67.5f) {
+        return 1;
+    } else if (67.5f >= angle && angle < 112.5) {
+        return 2;
+    } else if (112.5 >= angle && angle < 157.5f) {
+        return 3;
     }
+    return 4;
 }
 
-void prop_hypot(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = sqrtf(dx[i] * dx[i] + dy[i] * dy[i]);
-    }
-}
+// Gray, blur and Sobel of rows [y0, y1): writes the gradient magnitude and direction, and
+// the blurred value of frame pixels to edges. Returns the largest magnitude.
+float canny_gradient_strip(sd_image_t img,
+                           const float* gkernel,
+                           int y0,
+                           int y1,
+                           float* G,
+                           uint8_t* D,
+                           float* edges) {
+    const int W      = img.width;
+    const int H      = img.height;
+    const int gy0    = y0 - 3;  // gray rows [y0 - 3, y1 + 3), blurred rows [y0 - 1, y1 + 1)
+    const int g_rows = y1 - y0 + 6;
+    const int b_rows = y1 - y0 + 2;
+    const int pad    = 2;
+    const int stride = W + 2 * pad;
+    std::vector<float> gray(g_rows * stride, 0.f);
+    std::vector<float> blurred(b_rows * stride, 0.f);
 
-void prop_arctan2(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = atan2f(dy[i], dx[i]);
-    }
-}
-
-void normalize_tensor(struct ggml_tensor* g) {
-    int n_elements = ggml_nelements(g);
-    float* dg      = (float*)g->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = dg[i] > max ? dg[i] : max;
-    }
-    max = 1.0f / max;
-    for (int i = 0; i < n_elements; i++) {
-        dg[i] *= max;
+    for (int r = 0; r < g_rows; r++) {
+        int iy = gy0 + r;
+        if (iy < 0 || iy >= H) {
+            continue;
+        }
+        const uint8_t* in = img.data + (size_t)iy * W * img.channel;
+        float* out        = gray.data() + r * stride + pad;
+        for (int ix = 0; ix < W; ix++) {
+            float red   = in[ix * img.channel + 0] / 255.f;
+            float green = in[ix * img.channel + 1] / 255.f;
+            float blue  = in[ix * img.channel + 2] / 255.f;
+            out[ix]     = canny_round_f16(0.2989f * red + 0.5870f * green + 0.1140f * blue);
+        }
     }
-}
 
-void non_max_supression(struct ggml_tensor* result, struct ggml_tensor* G, struct ggml_tensor* D) {
-    for (int iy = 1; iy < result->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < result->ne[0] - 1; ix++) {
-            float angle = ggml_ext_tensor_get_f32(D, ix, iy) * 180.0f / M_PI_;
-            angle       = angle < 0.0f ? angle += 180.0f : angle;
-            float q     = 1.0f;
-            float r     = 1.0f;
-
-            // angle 0
-            if ((0 >= angle && angle < 22.5f) || (157.5f >= angle && angle <= 180)) {
-                q = ggml_ext_tensor_get_f32(G, ix, iy + 1);
-                r = ggml_ext_tensor_get_f32(G, ix, iy - 1);
-            }
-            // angle 45
-            else if (22.5f >= angle && angle < 67.5f) {
-                q = ggml_ext_tensor_get_f32(G, ix + 1, iy - 1);
-                r = ggml_ext_tensor_get_f32(G, ix - 1, iy + 1);
-            }
-            // angle 90
-            else if (67.5f >= angle && angle < 112.5) {
-                q = ggml_ext_tensor_get_f32(G, ix + 1, iy);
-                r = ggml_ext_tensor_get_f32(G, ix - 1, iy);
+    for (int r = 0; r < b_rows; r++) {
+        int iy = y0 - 1 + r;
+        if (iy < 0 || iy >= H) {
+            continue;
+        }
+        float* out = blurred.data() + r * stride + pad;
+        for (int ky = 0; ky < 5; ky++) {
+            const float* in = gray.data() + (r + ky) * stride;
+            for (int kx = 0; kx < 5; kx++) {
+                float k = gkernel[ky * 5 + kx];
+                for (int ix = 0; ix < W; ix++) {
+                    out[ix] += k * in[ix + kx];
+                }
             }
-            // angle 135
-            else if (112.5 >= angle && angle < 157.5f) {
-                q = ggml_ext_tensor_get_f32(G, ix - 1, iy - 1);
-                r = ggml_ext_tensor_get_f32(G, ix + 1, iy + 1);
+        }
+        if (iy == 0 || iy == H - 1) {
+            if (iy >= y0 && iy < y1) {
+                memcpy(edges + (size_t)iy * W, out, W * sizeof(float));
             }
+        } else if (iy >= y0 && iy < y1) {
+            edges[(size_t)iy * W]         = out[0];
+            edges[(size_t)iy * W + W - 1] = out[W - 1];
+        }
+        for (int ix = 0; ix < W; ix++) {
+            out[ix] = canny_round_f16(out[ix]);
+        }
+    }
 
-            float cur = ggml_ext_tensor_get_f32(G, ix, iy);
-            if ((cur >= q) && (cur >= r)) {
-                ggml_ext_tensor_set_f32(result, cur, ix, iy);
-            } else {
-                ggml_ext_tensor_set_f32(result, 0.0f, ix, iy);
-            }
+    float max = -INFINITY;
+    for (int iy = y0; iy < y1; iy++) {
+        const float* above = blurred.data() + (iy - y0) * stride + pad;
+        const float* cur   = above + stride;
+        const float* below = cur + stride;
+        float* g           = G + (size_t)iy * W;
+        uint8_t* d         = D + (size_t)iy * W;
+        for (int ix = 0; ix < W; ix++) {
+            float dx = (above[ix + 1] - above[ix - 1]) + 2 * (cur[ix + 1] - cur[ix - 1]) + (below[ix + 1] - below[ix - 1]);
+            float dy = (above[ix - 1] + 2 * above[ix] + above[ix + 1]) - (below[ix - 1] + 2 * below[ix] + below[ix + 1]);
+            g[ix]    = sqrtf(dx * dx + dy * dy);
+            d[ix]    = canny_direction(dx, dy);
+            max      = g[ix] > max ? g[ix] : max;
         }
     }
+    return max;
 }
 
-void threshold_hystersis(struct ggml_tensor* img, float high_threshold, float low_threshold, float weak, float strong) {
-    int n_elements = ggml_nelements(img);
-    float* imd     = (float*)img->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = imd[i] > max ? imd[i] : max;
-    }
-    float ht = max * high_threshold;
-    float lt = ht * low_threshold;
-    for (int i = 0; i < n_elements; i++) {
-        float img_v = imd[i];
-        if (img_v >= ht) {  // strong pixel
-            imd[i] = strong;
-        } else if (img_v <= ht && img_v >= lt) {  // strong pixel
-            imd[i] = weak;
+// Non maximum suppression of the interior pixels of rows [y0, y1) into edges, returns the
+// largest value of the rows.
+float canny_suppress_strip(int W, int H, int y0, int y1, const float* G, const uint8_t* D, float scale, float* edges) {
+    float max = -INFINITY;
+    for (int iy = y0; iy < y1; iy++) {
+        float* out = edges + (size_t)iy * W;
+        if (iy >= 1 && iy < H - 1) {
+            const float* g   = G + (size_t)iy * W;
+            const uint8_t* d = D + (size_t)iy * W;
+            for (int ix = 1; ix < W - 1; ix++) {
+                float q = 1.0f;
+                float r = 1.0f;
+                switch (d[ix]) {
+                    case 0:
+                        q = g[ix + W] * scale;
+                        r = g[ix - W] * scale;
+                        break;
+                    case 1:
+                        q = g[ix + 1 - W] * scale;
+                        r = g[ix - 1 + W] * scale;
+                        break;
+                    case 2:
+                        q = g[ix + 1] * scale;
+                        r = g[ix - 1] * scale;
+                        break;
+                    case 3:
+                        q = g[ix - 1 - W] * scale;
+                        r = g[ix + 1 + W] * scale;
+                        break;
+                }
+                float cur = g[ix] * scale;
+                out[ix]   = (cur >= q) && (cur >= r) ? cur : 0.0f;
+            }
+        }
+        for (int ix = 0; ix < W; ix++) {
+            max = out[ix] > max ? out[ix] : max;
         }
     }
+    return max;
+}
 
-    for (int iy = 0; iy < img->ne[1]; iy++) {
-        for (int ix = 0; ix < img->ne[0]; ix++) {
-            if (ix >= 3 && ix <= img->ne[0] - 3 && iy >= 3 && iy <= img->ne[1] - 3) {
-                ggml_ext_tensor_set_f32(img, ggml_ext_tensor_get_f32(img, ix, iy), ix, iy);
-            } else {
-                ggml_ext_tensor_set_f32(img, 0.0f, ix, iy);
+void canny_threshold_strip(int W, int H, int y0, int y1, float ht, float lt, float weak, float strong, float* edges) {
+    for (int iy = y0; iy < y1; iy++) {
+        float* out = edges + (size_t)iy * W;
+        for (int ix = 0; ix < W; ix++) {
+            if (ix < 3 || ix > W - 3 || iy < 3 || iy > H - 3) {
+                out[ix] = 0.0f;
+            } else if (out[ix] >= ht) {  // strong pixel
+                out[ix] = strong;
+            } else if (out[ix] <= ht && out[ix] >= lt) {  // weak pixel
+                out[ix] = weak;
             }
         }
     }
+}
 
-    // hysteresis
-    for (int iy = 1; iy < img->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < img->ne[0] - 1; ix++) {
-            float imd_v = ggml_ext_tensor_get_f32(img, ix, iy);
-            if (imd_v == weak) {
-                if (ggml_ext_tensor_get_f32(img, ix + 1, iy - 1) == strong || ggml_ext_tensor_get_f32(img, ix + 1, iy) == strong ||
-                    ggml_ext_tensor_get_f32(img, ix, iy - 1) == strong || ggml_ext_tensor_get_f32(img, ix, iy + 1) == strong ||
-                    ggml_ext_tensor_get_f32(img, ix - 1, iy - 1) == strong || ggml_ext_tensor_get_f32(img, ix - 1, iy) == strong) {
-                    ggml_ext_tensor_set_f32(img, strong, ix, iy);
+// weak pixels next to a strong one become strong, in scan order like the reference
+void canny_hysteresis(int W, int H, float weak, float strong, float* edges) {
+    for (int iy = 1; iy < H - 1; iy++) {
+        float* e = edges + (size_t)iy * W;
+        for (int ix = 1; ix < W - 1; ix++) {
+            if (e[ix] == weak) {
+                if (e[ix + 1 - W] == strong || e[ix + 1] == strong ||
+                    e[ix - W] == strong || e[ix + W] == strong ||
+                    e[ix - 1 - W] == strong || e[ix - 1] == strong) {
+                    e[ix] = strong;
                 } else {
-                    ggml_ext_tensor_set_f32(img, 0.0f, ix, iy);
+                    e[ix] = 0.0f;
                 }
             }
         }
     }
 }
 
-bool preprocess_canny(sd_image_t img, float high_threshold, float low_threshold, float weak, float strong, bool inverse) {
-    struct ggml_init_params params;
-    params.mem_size               = static_cast<size_t>(40 * img.width * img.height);  // 10MB for 512x512
-    params.mem_buffer             = nullptr;
-    params.no_alloc               = false;
-    struct ggml_context* work_ctx = ggml_init(params);
-
-    if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+bool preprocess_canny(sd_image_t img, float high_threshold, float low_threshold, float weak, float strong, bool inverse, int n_threads) {
+    if (img.data == nullptr || img.channel < 3) {
+        LOG_ERROR("preprocess_canny needs an RGB image");
         return false;
     }
+    const int W        = img.width;
+    const int H        = img.height;
+    const int n_strips = (H + CANNY_STRIP_ROWS - 1) / CANNY_STRIP_ROWS;
+    const int64_t cost = (int64_t)CANNY_STRIP_ROWS * W * 64;
+
+    float gkernel[25];
+    gaussian_kernel(gkernel, 5);
+
+    std::vector<float> G((size_t)W * H);
+    std::vector<uint8_t> D((size_t)W * H);
+    std::vector<float> edges((size_t)W * H);
+    std::vector<float> strip_max(n_strips);
+
+    auto strip_rows = [&](int64_t strip, int& y0, int& y1) {
+        y0 = (int)strip * CANNY_STRIP_ROWS;
+        y1 = std::min(H, y0 + CANNY_STRIP_ROWS);
+    };
+
+    sd_parallel_for(n_threads, n_strips, cost, [&](int64_t begin, int64_t end) {
+        for (int64_t strip = begin; strip < end; strip++) {
+            int y0, y1;
+            strip_rows(strip, y0, y1);
+            strip_max[strip] = canny_gradient_strip(img, gkernel, y0, y1, G.data(), D.data(), edges.data());
+        }
+    });
+    float scale = 1.0f / *std::max_element(strip_max.begin(), strip_max.end());
+
+    sd_parallel_for(n_threads, n_strips, cost, [&](int64_t begin, int64_t end) {
+        for (int64_t strip = begin; strip < end; strip++) {
+            int y0, y1;
+            strip_rows(strip, y0, y1);
+            strip_max[strip] = canny_suppress_strip(W, H, y0, y1, G.data(), D.data(), scale, edges.data());
+        }
+    });
+    float ht = *std::max_element(strip_max.begin(), strip_max.end()) * high_threshold;
+    float lt = ht * low_threshold;
+
+    sd_parallel_for(n_threads, n_strips, cost, [&](int64_t begin, int64_t end) {
+        for (int64_t strip = begin; strip < end; strip++) {
+            int y0, y1;
+            strip_rows(strip, y0, y1);
+            canny_threshold_strip(W, H, y0, y1, ht, lt, weak, strong, edges.data());
+        }
+    });
+    canny_hysteresis(W, H, weak, strong, edges.data());
 
-    float kX[9] = {
-        -1, 0, 1,
-        -2, 0, 2,
-        -1, 0, 1};
-
-    float kY[9] = {
-        1, 2, 1,
-        0, 0, 0,
-        -1, -2, -1};
-
-    // generate kernel
-    int kernel_size             = 5;
-    struct ggml_tensor* gkernel = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, kernel_size, kernel_size, 1, 1);
-    struct ggml_tensor* sf_kx   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_kx->data, kX, ggml_nbytes(sf_kx));
-    struct ggml_tensor* sf_ky = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_ky->data, kY, ggml_nbytes(sf_ky));
-    gaussian_kernel(gkernel);
-    struct ggml_tensor* image      = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, img.width, img.height, 3, 1);
-    struct ggml_tensor* image_gray = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, img.width, img.height, 1, 1);
-    struct ggml_tensor* iX         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* iY         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* G          = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* tetha      = ggml_dup_tensor(work_ctx, image_gray);
-    sd_image_to_ggml_tensor(img, image);
-    grayscale(image, image_gray);
-    convolve(image_gray, image_gray, gkernel, 2);
-    convolve(image_gray, iX, sf_kx, 1);
-    convolve(image_gray, iY, sf_ky, 1);
-    prop_hypot(iX, iY, G);
-    normalize_tensor(G);
-    prop_arctan2(iX, iY, tetha);
-    non_max_supression(image_gray, G, tetha);
-    threshold_hystersis(image_gray, high_threshold, low_threshold, weak, strong);
     // to RGB channels
-    for (int iy = 0; iy < img.height; iy++) {
-        for (int ix = 0; ix < img.width; ix++) {
-            float gray = ggml_ext_tensor_get_f32(image_gray, ix, iy);
-            gray       = inverse ? 1.0f - gray : gray;
-            ggml_ext_tensor_set_f32(image, gray, ix, iy);
-            ggml_ext_tensor_set_f32(image, gray, ix, iy, 1);
-            ggml_ext_tensor_set_f32(image, gray, ix, iy, 2);
+    sd_parallel_for(n_threads, H, W, [&](int64_t begin, int64_t end) {
+        std::vector<uint8_t> row(W);
+        for (int64_t iy = begin; iy < end; iy++) {
+            float* e = edges.data() + iy * W;
+            if (inverse) {
+                for (int ix = 0; ix < W; ix++) {
+                    e[ix] = 1.0f - e[ix];
+                }
+            }
+            ggml_ext_quantize_u8(e, row.data(), W);
+            uint8_t* out = img.data + iy * W * img.channel;
+            for (int ix = 0; ix < W; ix++) {
+                out[ix * img.channel + 0] = row[ix];
+                out[ix * img.channel + 1] = row[ix];
+                out[ix * img.channel + 2] = row[ix];
+            }
         }
-    }
-    ggml_tensor_to_sd_image(image, img.data);
-    ggml_free(work_ctx);
+    });
     return true;
 }
 
-#endif  // __PREPROCESSING_HPP__
\ No newline at end of file
+#endif  // __PREPROCESSING_HPP__
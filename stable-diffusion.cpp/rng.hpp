@@ -1,13 +1,24 @@
 #ifndef __RNG_H__
 #define __RNG_H__
 
+#include <memory>
 #include <random>
 #include <vector>
 
+#include "util.h"
+
 class RNG {
 public:
-    virtual void manual_seed(uint64_t seed)      = 0;
-    virtual std::vector<float> randn(uint32_t n) = 0;
+    virtual void manual_seed(uint64_t seed) = 0;
+    // writes the next n standard normal values to data, generators that can split the work
+    // use up to n_threads threads
+    virtual void randn(float* data, uint32_t n, int n_threads) = 0;
+
+    std::vector<float> randn(uint32_t n, int n_threads = 1) {
+        std::vector<float> result(n);
+        randn(result.data(), n, n_threads);
+        return result;
+    }
 };
 
 class STDDefaultRNG : public RNG {
@@ -19,16 +30,42 @@ public:
         generator.seed((unsigned int)seed);
     }
 
-    std::vector<float> randn(uint32_t n) override {
-        std::vector<float> result;
+    using RNG::randn;
+
+    void randn(float* data, uint32_t n, int n_threads) override {
         float mean   = 0.0;
         float stddev = 1.0;
         std::normal_distribution<float> distribution(mean, stddev);
         for (uint32_t i = 0; i < n; i++) {
-            float random_number = distribution(generator);
-            result.push_back(random_number);
+            data[i] = distribution(generator);
+        }
+    }
+};
+
+// Splits every draw evenly over one generator per image, so noise for images stacked along
+// the outermost dim matches generating them one at a time.
+class BatchedRNG : public RNG {
+private:
+    std::vector<std::shared_ptr<RNG>> rngs;
+
+public:
+    explicit BatchedRNG(std::vector<std::shared_ptr<RNG>> rngs)
+        : rngs(std::move(rngs)) {}
+
+    void manual_seed(uint64_t seed) override {
+        for (size_t i = 0; i < rngs.size(); i++) {
+            rngs[i]->manual_seed(seed + i);
+        }
+    }
+
+    using RNG::randn;
+
+    void randn(float* data, uint32_t n, int n_threads) override {
+        uint32_t chunk = n / (uint32_t)rngs.size();
+        for (size_t i = 0; i < rngs.size(); i++) {
+            uint32_t count = i + 1 < rngs.size() ? chunk : n - chunk * (uint32_t)i;
+            rngs[i]->randn(data + chunk * i, count, n_threads);
         }
-        return result;
     }
 };
 
@@ -85,7 +85,7 @@ class MT19937RNG : public RNG {
         return value;
     }
 
-    void normal_fill_16(float* data, float mean, float std) {
+    void normal_fill_16(float* data, float mean, float std) const {
         for (int j = 0; j < 8; ++j) {
             float u1    = 1.0f - data[j];
             float u2    = data[j + 8];
@@ -96,25 +96,28 @@ class MT19937RNG : public RNG {
         }
     }
 
-    void randn(float* data, int64_t size, float mean = 0.0f, float std = 1.0f) {
+    void normal_fill(float* data, uint32_t size, int n_threads, float mean = 0.0f, float std = 1.0f) {
         if (size >= 16) {
-            for (int64_t i = 0; i < size; i++) {
+            for (uint32_t i = 0; i < size; i++) {
                 data[i] = uniform_real(rand_uint32(), 0.f, 1.f);
             }
-            for (int64_t i = 0; i < size - 15; i += 16) {
-                normal_fill_16(data + i, mean, std);
-            }
+            // the uniforms come from one sequential stream, the transform of each block of 16 is independent
+            sd_parallel_for(n_threads, size / 16, 16, [&](int64_t begin, int64_t end) {
+                for (int64_t i = begin; i < end; i++) {
+                    normal_fill_16(data + i * 16, mean, std);
+                }
+            });
             if (size % 16 != 0) {
                 // Recompute the last 16 values.
                 data = data + size - 16;
-                for (int64_t i = 0; i < 16; i++) {
+                for (int i = 0; i < 16; i++) {
                     data[i] = uniform_real(rand_uint32(), 0.f, 1.f);
                 }
                 normal_fill_16(data, mean, std);
             }
         } else {
             // Strange handling, hard to understand, but keeping it consistent with PyTorch.
-            for (int64_t i = 0; i < size; i++) {
+            for (uint32_t i = 0; i < size; i++) {
                 data[i] = (float)normal_double_value(mean, std);
             }
         }
@@ -136,11 +139,10 @@ public:
         s.has_next_gauss = false;
     }
 
-    std::vector<float> randn(uint32_t n) override {
-        std::vector<float> out;
-        out.resize(n);
-        randn((float*)out.data(), out.size());
-        return out;
+    using RNG::randn;
+
+    void randn(float* data, uint32_t n, int n_threads) override {
+        normal_fill(data, n, n_threads);
     }
 };
 
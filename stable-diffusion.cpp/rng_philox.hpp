@@ -2,6 +2,7 @@
 #define __RNG_PHILOX_H__
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
 #include "rng.hpp"
@@ -14,70 +15,43 @@ private:
     uint32_t offset;
 
 private:
-    std::vector<uint32_t> philox_m = {0xD2511F53, 0xCD9E8D57};
-    std::vector<uint32_t> philox_w = {0x9E3779B9, 0xBB67AE85};
-    float two_pow32_inv            = 2.3283064e-10f;
-    float two_pow32_inv_2pi        = 2.3283064e-10f * 6.2831855f;
-
-    std::vector<uint32_t> uint32(uint64_t x) {
-        std::vector<uint32_t> result(2);
-        result[0] = static_cast<uint32_t>(x & 0xFFFFFFFF);
-        result[1] = static_cast<uint32_t>(x >> 32);
-        return result;
-    }
-
-    std::vector<std::vector<uint32_t>> uint32(const std::vector<uint64_t>& x) {
-        uint32_t N = (uint32_t)x.size();
-        std::vector<std::vector<uint32_t>> result(2, std::vector<uint32_t>(N));
-
-        for (uint32_t i = 0; i < N; ++i) {
-            result[0][i] = static_cast<uint32_t>(x[i] & 0xFFFFFFFF);
-            result[1][i] = static_cast<uint32_t>(x[i] >> 32);
+    static constexpr uint32_t philox_m[2] = {0xD2511F53, 0xCD9E8D57};
+    static constexpr uint32_t philox_w[2] = {0x9E3779B9, 0xBB67AE85};
+    static constexpr int block_size       = 256;
+    float two_pow32_inv                   = 2.3283064e-10f;
+    float two_pow32_inv_2pi               = 2.3283064e-10f * 6.2831855f;
+
+    // Philox 4x32 with 10 rounds for counters {offset, 0, begin + i, 0} and the seed as key,
+    // keeping the first two output words. Plain loops over the block so they vectorize.
+    void philox4_32(uint32_t offset, uint32_t begin, int n, uint32_t* x, uint32_t* y) const {
+        uint32_t c0[block_size], c1[block_size], c2[block_size], c3[block_size];
+        for (int i = 0; i < n; i++) {
+            c0[i] = offset;
+            c1[i] = 0;
+            c2[i] = begin + i;
+            c3[i] = 0;
         }
-
-        return result;
-    }
-
-    //  A single round of the Philox 4x32 random number generator.
-    void philox4_round(std::vector<std::vector<uint32_t>>& counter,
-                       const std::vector<std::vector<uint32_t>>& key) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (uint32_t i = 0; i < N; i++) {
-            std::vector<uint32_t> v1 = uint32(static_cast<uint64_t>(counter[0][i]) * static_cast<uint64_t>(philox_m[0]));
-            std::vector<uint32_t> v2 = uint32(static_cast<uint64_t>(counter[2][i]) * static_cast<uint64_t>(philox_m[1]));
-
-            counter[0][i] = v2[1] ^ counter[1][i] ^ key[0][i];
-            counter[1][i] = v2[0];
-            counter[2][i] = v1[1] ^ counter[3][i] ^ key[1][i];
-            counter[3][i] = v1[0];
-        }
-    }
-
-    // Generates 32-bit random numbers using the Philox 4x32 random number generator.
-    // Parameters:
-    //     counter : A 4xN array of 32-bit integers representing the counter values (offset into generation).
-    //     key : A 2xN array of 32-bit integers representing the key values (seed).
-    //     rounds : The number of rounds to perform.
-    // Returns:
-    //     std::vector<std::vector<uint32_t>>: A 4xN array of 32-bit integers containing the generated random numbers.
-    std::vector<std::vector<uint32_t>> philox4_32(std::vector<std::vector<uint32_t>>& counter,
-                                                  std::vector<std::vector<uint32_t>>& key,
-                                                  int rounds = 10) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (int i = 0; i < rounds - 1; ++i) {
-            philox4_round(counter, key);
-
-            for (uint32_t j = 0; j < N; ++j) {
-                key[0][j] += philox_w[0];
-                key[1][j] += philox_w[1];
+        uint32_t key0 = static_cast<uint32_t>(seed & 0xFFFFFFFF);
+        uint32_t key1 = static_cast<uint32_t>(seed >> 32);
+        for (int round = 0; round < 10; round++) {
+            for (int i = 0; i < n; i++) {
+                uint64_t v1 = static_cast<uint64_t>(c0[i]) * philox_m[0];
+                uint64_t v2 = static_cast<uint64_t>(c2[i]) * philox_m[1];
+                c0[i]       = static_cast<uint32_t>(v2 >> 32) ^ c1[i] ^ key0;
+                c1[i]       = static_cast<uint32_t>(v2);
+                c2[i]       = static_cast<uint32_t>(v1 >> 32) ^ c3[i] ^ key1;
+                c3[i]       = static_cast<uint32_t>(v1);
             }
+            key0 += philox_w[0];
+            key1 += philox_w[1];
+        }
+        for (int i = 0; i < n; i++) {
+            x[i] = c0[i];
+            y[i] = c1[i];
         }
-
-        philox4_round(counter, key);
-        return counter;
     }
 
-    float box_muller(float x, float y) {
+    float box_muller(float x, float y) const {
         float u = x * two_pow32_inv + two_pow32_inv / 2;
         float v = y * two_pow32_inv_2pi + two_pow32_inv_2pi / 2;
 
@@ -98,27 +72,27 @@ public:
         this->offset = 0;
     }
 
-    std::vector<float> randn(uint32_t n) override {
-        std::vector<std::vector<uint32_t>> counter(4, std::vector<uint32_t>(n, 0));
-        for (uint32_t i = 0; i < n; i++) {
-            counter[0][i] = this->offset;
-        }
-
-        for (uint32_t i = 0; i < n; i++) {
-            counter[2][i] = i;
+    // Values [begin, end) of the draw at offset. Elements only depend on their own counter,
+    // so disjoint ranges can be filled from different threads.
+    void randn_range(float* data, uint32_t offset, uint32_t begin, uint32_t end) const {
+        uint32_t x[block_size], y[block_size];
+        for (uint32_t i = begin; i < end; i += block_size) {
+            int n = static_cast<int>(std::min<uint32_t>(block_size, end - i));
+            philox4_32(offset, i, n, x, y);
+            for (int j = 0; j < n; j++) {
+                data[i - begin + j] = box_muller((float)x[j], (float)y[j]);
+            }
         }
-        this->offset += 1;
-
-        std::vector<uint64_t> key(n, this->seed);
-        std::vector<std::vector<uint32_t>> key_uint32 = uint32(key);
+    }
 
-        std::vector<std::vector<uint32_t>> g = philox4_32(counter, key_uint32);
+    using RNG::randn;
 
-        std::vector<float> result;
-        for (uint32_t i = 0; i < n; ++i) {
-            result.push_back(box_muller((float)g[0][i], (float)g[1][i]));
-        }
-        return result;
+    void randn(float* data, uint32_t n, int n_threads) override {
+        uint32_t offset = this->offset;
+        sd_parallel_for(n_threads, n, 1, [&](int64_t begin, int64_t end) {
+            randn_range(data + begin, offset, (uint32_t)begin, (uint32_t)end);
+        });
+        this->offset += 1;
     }
 };
 
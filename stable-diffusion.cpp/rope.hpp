@@ -39,7 +39,7 @@ namespace Rope {
         return flat_vec;
     }
 
-    __STATIC_INLINE__ std::vector<std::vector<float>> rope(const std::vector<float>& pos, int dim, int theta) {
+    __STATIC_INLINE__ std::vector<float> rope_omega(int dim, int theta) {
         assert(dim % 2 == 0);
         int half_dim = dim / 2;
 
@@ -49,23 +49,29 @@ namespace Rope {
         for (int i = 0; i < half_dim; ++i) {
             omega[i] = 1.0 / std::pow(theta, scale[i]);
         }
+        return omega;
+    }
 
-        int pos_size = pos.size();
-        std::vector<std::vector<float>> out(pos_size, std::vector<float>(half_dim));
-        for (int i = 0; i < pos_size; ++i) {
-            for (int j = 0; j < half_dim; ++j) {
-                out[i][j] = pos[i] * omega[j];
-            }
+    // writes [[cos, -sin], [sin, cos]] of pos * omega for every frequency
+    __STATIC_INLINE__ void rope_row(float pos, const std::vector<float>& omega, float* out) {
+        for (size_t j = 0; j < omega.size(); ++j) {
+            float angle    = pos * omega[j];
+            float c        = std::cos(angle);
+            float s        = std::sin(angle);
+            out[4 * j]     = c;
+            out[4 * j + 1] = -s;
+            out[4 * j + 2] = s;
+            out[4 * j + 3] = c;
         }
+    }
+
+    __STATIC_INLINE__ std::vector<std::vector<float>> rope(const std::vector<float>& pos, int dim, int theta) {
+        std::vector<float> omega = rope_omega(dim, theta);
 
-        std::vector<std::vector<float>> result(pos_size, std::vector<float>(half_dim * 4));
+        int pos_size = pos.size();
+        std::vector<std::vector<float>> result(pos_size, std::vector<float>(omega.size() * 4));
         for (int i = 0; i < pos_size; ++i) {
-            for (int j = 0; j < half_dim; ++j) {
-                result[i][4 * j]     = std::cos(out[i][j]);
-                result[i][4 * j + 1] = -std::sin(out[i][j]);
-                result[i][4 * j + 2] = std::sin(out[i][j]);
-                result[i][4 * j + 3] = std::cos(out[i][j]);
-            }
+            rope_row(pos[i], omega, result[i].data());
         }
 
         return result;
@@ -134,36 +140,37 @@ namespace Rope {
         return ids;
     }
 
+    // Writes the table straight into the flat [bs * pos_len, emb_dim, 2, 2] layout. Every
+    // batch uses the positions of the first one.
     __STATIC_INLINE__ std::vector<float> embed_nd(const std::vector<std::vector<float>>& ids,
                                                   int bs,
                                                   int theta,
-                                                  const std::vector<int>& axes_dim) {
-        std::vector<std::vector<float>> trans_ids = transpose(ids);
-        size_t pos_len                            = ids.size() / bs;
-        int num_axes                              = axes_dim.size();
-        // for (int i = 0; i < pos_len; i++) {
-        //     std::cout << trans_ids[0][i] << " " << trans_ids[1][i] << " " << trans_ids[2][i] << std::endl;
-        // }
+                                                  const std::vector<int>& axes_dim,
+                                                  int n_threads = 1) {
+        size_t pos_len = ids.size() / bs;
+        int num_axes   = axes_dim.size();
 
         int emb_dim = 0;
         for (int d : axes_dim)
             emb_dim += d / 2;
+        size_t row_len = emb_dim * 2 * 2;
 
-        std::vector<std::vector<float>> emb(bs * pos_len, std::vector<float>(emb_dim * 2 * 2, 0.0));
+        std::vector<float> emb(bs * pos_len * row_len);
         int offset = 0;
         for (int i = 0; i < num_axes; ++i) {
-            std::vector<std::vector<float>> rope_emb = rope(trans_ids[i], axes_dim[i], theta);  // [bs*pos_len, axes_dim[i]/2 * 2 * 2]
-            for (int b = 0; b < bs; ++b) {
-                for (int j = 0; j < pos_len; ++j) {
-                    for (int k = 0; k < rope_emb[0].size(); ++k) {
-                        emb[b * pos_len + j][offset + k] = rope_emb[j][k];
-                    }
+            std::vector<float> omega = rope_omega(axes_dim[i], theta);
+            sd_parallel_for(n_threads, pos_len, omega.size() * 64, [&](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; ++j) {
+                    rope_row(ids[j][i], omega, emb.data() + j * row_len + offset);
                 }
-            }
-            offset += rope_emb[0].size();
+            });
+            offset += omega.size() * 4;
+        }
+        for (int b = 1; b < bs; ++b) {
+            std::copy(emb.begin(), emb.begin() + pos_len * row_len, emb.begin() + b * pos_len * row_len);
         }
 
-        return flatten(emb);
+        return emb;
     }
 
     __STATIC_INLINE__ std::vector<std::vector<float>> gen_refs_ids(int patch_size,
@@ -239,7 +246,8 @@ namespace Rope {
                                                      bool increase_ref_index,
                                                      float ref_index_scale,
                                                      int theta,
-                                                     const std::vector<int>& axes_dim) {
+                                                     const std::vector<int>& axes_dim,
+                                                     int n_threads = 1) {
         std::vector<std::vector<float>> ids = gen_flux_ids(h,
                                                            w,
                                                            patch_size,
@@ -250,7 +258,7 @@ namespace Rope {
                                                            ref_latents,
                                                            increase_ref_index,
                                                            ref_index_scale);
-        return embed_nd(ids, bs, theta, axes_dim);
+        return embed_nd(ids, bs, theta, axes_dim, n_threads);
     }
 
     __STATIC_INLINE__ std::vector<std::vector<float>> gen_qwen_image_ids(int h,
@@ -289,9 +297,10 @@ namespace Rope {
                                                            const std::vector<ggml_tensor*>& ref_latents,
                                                            bool increase_ref_index,
                                                            int theta,
-                                                           const std::vector<int>& axes_dim) {
+                                                           const std::vector<int>& axes_dim,
+                                                           int n_threads = 1) {
         std::vector<std::vector<float>> ids = gen_qwen_image_ids(h, w, patch_size, bs, context_len, ref_latents, increase_ref_index);
-        return embed_nd(ids, bs, theta, axes_dim);
+        return embed_nd(ids, bs, theta, axes_dim, n_threads);
     }
 
     __STATIC_INLINE__ std::vector<std::vector<float>> gen_vid_ids(int t,
@@ -343,9 +352,10 @@ namespace Rope {
                                                     int pw,
                                                     int bs,
                                                     int theta,
-                                                    const std::vector<int>& axes_dim) {
+                                                    const std::vector<int>& axes_dim,
+                                                    int n_threads = 1) {
         std::vector<std::vector<float>> ids = gen_vid_ids(t, h, w, pt, ph, pw, bs);
-        return embed_nd(ids, bs, theta, axes_dim);
+        return embed_nd(ids, bs, theta, axes_dim, n_threads);
     }
 
     __STATIC_INLINE__ std::vector<std::vector<float>> gen_qwen2vl_ids(int grid_h,
@@ -379,9 +389,10 @@ namespace Rope {
                                                         int merge_size,
                                                         const std::vector<int>& window_index,
                                                         int theta,
-                                                        const std::vector<int>& axes_dim) {
+                                                        const std::vector<int>& axes_dim,
+                                                        int n_threads = 1) {
         std::vector<std::vector<float>> ids = gen_qwen2vl_ids(grid_h, grid_w, merge_size, window_index);
-        return embed_nd(ids, 1, theta, axes_dim);
+        return embed_nd(ids, 1, theta, axes_dim, n_threads);
     }
 
     __STATIC_INLINE__ int bound_mod(int a, int m) {
@@ -428,9 +439,39 @@ namespace Rope {
                                                         const std::vector<ggml_tensor*>& ref_latents,
                                                         bool increase_ref_index,
                                                         int theta,
-                                                        const std::vector<int>& axes_dim) {
+                                                        const std::vector<int>& axes_dim,
+                                                        int n_threads = 1) {
         std::vector<std::vector<float>> ids = gen_z_image_ids(h, w, patch_size, bs, context_len, seq_multi_of, ref_latents, increase_ref_index);
-        return embed_nd(ids, bs, theta, axes_dim);
+        return embed_nd(ids, bs, theta, axes_dim, n_threads);
+    }
+
+    // Keeps the table of the last shape a runner built. The graph is built twice per
+    // compute() and again whenever it can't be reused, the table only changes with the shape.
+    struct PECache {
+        std::string key;
+        std::vector<float> pe;
+
+        template <class F>
+        const std::vector<float>& get(const std::string& new_key, F gen) {
+            if (pe.empty() || new_key != key) {
+                pe  = gen();
+                key = new_key;
+            }
+            return pe;
+        }
+    };
+
+    // theta and axes_dim are fixed per runner, so the key only holds what changes per call
+    __STATIC_INLINE__ std::string pe_cache_key(std::initializer_list<int64_t> dims,
+                                               const std::vector<ggml_tensor*>& ref_latents = {}) {
+        std::string key;
+        for (int64_t dim : dims) {
+            key += std::to_string(dim) + ",";
+        }
+        for (ggml_tensor* ref : ref_latents) {
+            key += "|" + std::to_string(ref->ne[0]) + "x" + std::to_string(ref->ne[1]);
+        }
+        return key;
     }
 
     __STATIC_INLINE__ struct ggml_tensor* apply_rope(struct ggml_context* ctx,
@@ -89,6 +89,131 @@ void suppress_pp(int step, int steps, float time, void* data) {
     return;
 }
 
+// Text encoder and VAE runners other contexts may borrow params from, keyed on weights file,
+// runner, params signature and params buffer type. Entries expire with the last context
+// using them.
+struct SharedRunnerCache {
+    std::mutex mutex;
+    std::map<std::string, std::weak_ptr<GGMLRunner>> runners;
+};
+
+static SharedRunnerCache shared_runner_cache;
+
+// Host buffers backing the work_ctx of generate_image/generate_video. Released buffers are
+// kept for the next request and a new one is sized to the largest request seen so far.
+struct WorkCtxPool {
+    struct Buffer {
+        void* data      = nullptr;
+        size_t capacity = 0;
+    };
+
+    std::mutex mutex;
+    std::vector<Buffer> free_buffers;
+    std::map<ggml_context*, Buffer> used_buffers;
+    size_t high_water = 0;
+
+    ~WorkCtxPool() {
+        for (auto& buffer : free_buffers) {
+            free(buffer.data);
+        }
+        for (auto& kv : used_buffers) {
+            ggml_free(kv.first);
+            free(kv.second.data);
+        }
+    }
+
+    ggml_context* acquire(size_t size) {
+        Buffer buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            high_water = std::max(high_water, size);
+            for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it) {
+                if (it->capacity >= size) {
+                    buffer = *it;
+                    free_buffers.erase(it);
+                    break;
+                }
+            }
+            if (buffer.data == nullptr && !free_buffers.empty()) {
+                // too small for this request, replace it with a high water sized one
+                free(free_buffers.back().data);
+                free_buffers.pop_back();
+            }
+            size = high_water;
+        }
+        if (buffer.data == nullptr) {
+            buffer.data     = malloc(size);
+            buffer.capacity = size;
+            if (buffer.data == nullptr) {
+                LOG_ERROR("alloc work buffer of %.2f MB failed", size / 1024.0 / 1024.0);
+                return nullptr;
+            }
+        }
+
+        struct ggml_init_params params;
+        params.mem_size   = buffer.capacity;
+        params.mem_buffer = buffer.data;
+        params.no_alloc   = false;
+
+        ggml_context* ctx = ggml_init(params);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ctx == nullptr) {
+            free_buffers.push_back(buffer);
+            return nullptr;
+        }
+        used_buffers[ctx] = buffer;
+        return ctx;
+    }
+
+    void release(ggml_context* ctx) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = used_buffers.find(ctx);
+        if (it == used_buffers.end()) {
+            ggml_free(ctx);
+            return;
+        }
+        LOG_DEBUG("work_ctx used %.2f MB of %.2f MB",
+                  ggml_used_mem(ctx) / 1024.0 / 1024.0,
+                  it->second.capacity / 1024.0 / 1024.0);
+        ggml_free(ctx);
+        free_buffers.push_back(it->second);
+        used_buffers.erase(it);
+    }
+};
+
+struct sd_cancel_token_t {
+    std::atomic<bool> cancelled{false};
+};
+
+// Cooperative cancellation of the running generate_image/generate_video call. Checked
+// between sampling steps, VAE tiles and batch items, also from the decoder thread.
+struct GenerationCancel {
+    const sd_cancel_token_t* token = nullptr;
+    int64_t deadline               = 0;  // ggml_time_ms() limit, 0 for none
+    std::atomic<bool> stopped{false};
+
+    void start(const sd_cancel_token_t* token, int64_t deadline_ms) {
+        this->token    = token;
+        this->deadline = deadline_ms > 0 ? ggml_time_ms() + deadline_ms : 0;
+        stopped        = false;
+    }
+
+    bool check() {
+        if (stopped) {
+            return true;
+        }
+        bool cancelled = token != nullptr && token->cancelled;
+        bool expired   = deadline > 0 && ggml_time_ms() >= deadline;
+        if (!cancelled && !expired) {
+            return false;
+        }
+        if (!stopped.exchange(true)) {
+            LOG_WARN("%s, aborting generation", cancelled ? "generation cancelled" : "generation deadline exceeded");
+        }
+        return true;
+    }
+};
+
 /*=============================================== StableDiffusionGGML ================================================*/
 
 class StableDiffusionGGML {
@@ -97,6 +222,7 @@ public:
     ggml_backend_t clip_backend        = nullptr;
     ggml_backend_t control_net_backend = nullptr;
     ggml_backend_t vae_backend         = nullptr;
+    ggml_threadpool_t threadpool       = nullptr;  // compute threads of the CPU backends
 
     SDVersion version;
     bool vae_decode_only         = false;
@@ -104,6 +230,8 @@ public:
 
     std::shared_ptr<RNG> rng         = std::make_shared<PhiloxRNG>();
     std::shared_ptr<RNG> sampler_rng = nullptr;
+    rng_type_t rng_type              = CUDA_RNG;
+    rng_type_t sampler_rng_type      = CUDA_RNG;
     int n_threads                    = -1;
     float scale_factor               = 0.18215f;
     float shift_factor               = 0.f;
@@ -125,17 +253,36 @@ public:
 
     std::string taesd_path;
     bool use_tiny_autoencoder            = false;
-    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0, 0};
+    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0, 0, 1};
     bool offload_params_to_cpu           = false;
     bool stacked_id                      = false;
+    bool batched_cfg                     = false;
+    bool batched_images                  = false;
+    bool vae_pipeline                    = false;
+    bool lora_snapshots                  = false;
+    int vae_pipeline_n_threads           = 0;  // share of n_threads for the VAE decoding alongside sampling on the same CPU
+
+    std::atomic<int> vae_busy_n_threads{0};  // threads the VAE decodes with alongside sampling right now
 
     bool is_using_v_parameterization     = false;
     bool is_using_edm_v_parameterization = false;
 
     std::map<std::string, struct ggml_tensor*> tensors;
 
+    // runners loaded by this context that later contexts may share, registered once loaded
+    std::vector<std::pair<std::string, std::shared_ptr<GGMLRunner>>> shareable_runners;
+
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
+    LoraCache lora_cache;
+    WorkCtxPool work_ctx_pool;
+    // tensor name => original bytes of the weights immediate mode LoRAs have modified
+    std::map<std::string, std::vector<uint8_t>> lora_weight_snapshots;
+
+    ConditionCache condition_cache;
+    std::string condition_cache_lora_key;  // requested loras, part of every condition cache key
+
+    GenerationCancel cancel;
 
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
@@ -152,6 +299,71 @@ public:
             ggml_backend_free(vae_backend);
         }
         ggml_backend_free(backend);
+        if (threadpool != nullptr) {
+            ggml_threadpool_free(threadpool);
+        }
+    }
+
+    // One persistent pool of compute threads per context instead of threads set up for
+    // every graph, pinned to cpu_mask and the CPUs of numa_node when given.
+    bool init_threadpool(const sd_ctx_params_t* sd_ctx_params) {
+        struct ggml_threadpool_params params = ggml_threadpool_params_default(std::max(1, n_threads));
+        params.poll                          = std::min(100, std::max(0, sd_ctx_params->threadpool_poll));
+
+        std::string cpu_mask = SAFE_STR(sd_ctx_params->cpu_mask);
+        bool pinned          = !cpu_mask.empty();
+        if (pinned && !ggml_ext_parse_cpu_list(cpu_mask, params.cpumask, GGML_MAX_N_THREADS)) {
+            LOG_ERROR("invalid cpu mask '%s'", cpu_mask.c_str());
+            return false;
+        }
+        if (sd_ctx_params->numa_node >= 0) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(sd_ctx_params->numa_node) + "/cpulist");
+            std::string node_cpus;
+            bool node_cpumask[GGML_MAX_N_THREADS] = {};
+            if (!std::getline(file, node_cpus) || !ggml_ext_parse_cpu_list(node_cpus, node_cpumask, GGML_MAX_N_THREADS)) {
+                LOG_WARN("can not read the CPUs of NUMA node %d, compute threads are not kept on it", sd_ctx_params->numa_node);
+            } else {
+                for (int cpu = 0; cpu < GGML_MAX_N_THREADS; cpu++) {
+                    params.cpumask[cpu] = node_cpumask[cpu] && (params.cpumask[cpu] || !pinned);
+                }
+                pinned = true;
+            }
+        }
+        if (pinned && std::find(params.cpumask, params.cpumask + GGML_MAX_N_THREADS, true) == params.cpumask + GGML_MAX_N_THREADS) {
+            LOG_ERROR("no CPU left for the compute threads, check --cpu-mask and --numa-node");
+            return false;
+        }
+
+        threadpool = ggml_threadpool_new(&params);
+        if (threadpool == nullptr) {
+            LOG_WARN("failed to create the compute threadpool, threads are set up per graph");
+        }
+        return true;
+    }
+
+    // Caps the VAE at n threads and takes them from sampling while it decodes alongside,
+    // 0 gives the VAE all n_threads again.
+    void set_vae_busy_n_threads(int n) {
+        if (first_stage_model) {
+            first_stage_model->set_max_n_threads(n);
+        }
+        if (tae_first_stage) {
+            tae_first_stage->set_max_n_threads(n);
+        }
+        vae_busy_n_threads = n;
+    }
+
+    // the VAE keeps its own threads when it decodes alongside sampling
+    void attach_threadpool() {
+        if (threadpool == nullptr) {
+            return;
+        }
+        for (ggml_backend_t cpu_backend : {backend, clip_backend, control_net_backend, vae_backend}) {
+            if (cpu_backend == nullptr || !ggml_backend_is_cpu(cpu_backend) || (vae_pipeline && cpu_backend == vae_backend)) {
+                continue;
+            }
+            ggml_backend_cpu_set_threadpool(cpu_backend, threadpool);
+        }
     }
 
     void init_backend() {
@@ -191,6 +403,80 @@ public:
         }
     }
 
+    // Key under which the runner's params can be shared, empty if they don't all come from a
+    // single weights file.
+    std::string get_shared_params_key(const std::shared_ptr<GGMLRunner>& runner, ModelLoader& model_loader) {
+        auto& tensor_storage_map = model_loader.get_tensor_storage_map();
+        ggml_context* params_ctx = runner->get_params_ctx();
+        int file_index           = -1;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != nullptr; t = ggml_get_next_tensor(params_ctx, t)) {
+            auto iter = tensor_storage_map.find(ggml_get_name(t));
+            if (iter == tensor_storage_map.end()) {
+                return "";
+            }
+            if (file_index >= 0 && (int)iter->second.file_index != file_index) {
+                return "";
+            }
+            file_index = (int)iter->second.file_index;
+        }
+        if (file_index < 0) {
+            return "";
+        }
+        ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(runner->get_params_backend());
+        return sd_format("%s|%s|%s|%zx",
+                         ggml_backend_buft_name(buft),
+                         model_loader.get_file_paths()[file_index].c_str(),
+                         runner->get_desc().c_str(),
+                         std::hash<std::string>{}(runner->get_params_signature()));
+    }
+
+    // Borrows params another context already loaded for the same weights, must run before
+    // the runners allocate their params buffers. The others are remembered for registration.
+    void share_runner_params(const std::vector<std::shared_ptr<GGMLRunner>>& runners, ModelLoader& model_loader) {
+        std::lock_guard<std::mutex> lock(shared_runner_cache.mutex);
+        for (auto& runner : runners) {
+            if (runner == nullptr) {
+                continue;
+            }
+            std::string key = get_shared_params_key(runner, model_loader);
+            if (key.empty()) {
+                continue;
+            }
+            auto iter = shared_runner_cache.runners.find(key);
+            if (iter != shared_runner_cache.runners.end() && runner->share_params_from(iter->second.lock())) {
+                LOG_INFO("%s: sharing params with another context", runner->get_desc().c_str());
+                continue;
+            }
+            shareable_runners.push_back({key, runner});
+        }
+    }
+
+    void map_runner_params(const std::vector<std::shared_ptr<GGMLRunner>>& runners, ModelLoader& model_loader) {
+        for (auto& runner : runners) {
+            if (runner != nullptr) {
+                runner->map_params(model_loader, tensors);
+            }
+        }
+    }
+
+    void register_shareable_runners() {
+        std::lock_guard<std::mutex> lock(shared_runner_cache.mutex);
+        auto& runners = shared_runner_cache.runners;
+        for (auto iter = runners.begin(); iter != runners.end();) {
+            if (iter->second.expired()) {
+                iter = runners.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+        for (auto& pair : shareable_runners) {
+            if (runners.find(pair.first) == runners.end()) {
+                runners[pair.first] = pair.second;
+            }
+        }
+        shareable_runners.clear();
+    }
+
     std::shared_ptr<RNG> get_rng(rng_type_t rng_type) {
         if (rng_type == STD_DEFAULT_RNG) {
             return std::make_shared<STDDefaultRNG>();
@@ -209,18 +495,29 @@ public:
         use_tiny_autoencoder    = taesd_path.size() > 0;
         offload_params_to_cpu   = sd_ctx_params->offload_params_to_cpu;
 
-        rng = get_rng(sd_ctx_params->rng_type);
+        condition_cache.max_bytes = (size_t)std::max(0, sd_ctx_params->prompt_cache_mb) * 1024 * 1024;
+        lora_cache.max_bytes      = (size_t)std::max(0, sd_ctx_params->lora_cache_mb) * 1024 * 1024;
+        lora_snapshots            = sd_ctx_params->lora_snapshots;
+
+        rng      = get_rng(sd_ctx_params->rng_type);
+        rng_type = sd_ctx_params->rng_type;
         if (sd_ctx_params->sampler_rng_type != RNG_TYPE_COUNT && sd_ctx_params->sampler_rng_type != sd_ctx_params->rng_type) {
-            sampler_rng = get_rng(sd_ctx_params->sampler_rng_type);
+            sampler_rng      = get_rng(sd_ctx_params->sampler_rng_type);
+            sampler_rng_type = sd_ctx_params->sampler_rng_type;
         } else {
-            sampler_rng = rng;
+            sampler_rng      = rng;
+            sampler_rng_type = rng_type;
         }
 
         ggml_log_set(ggml_log_callback_default, nullptr);
 
         init_backend();
+        if (!init_threadpool(sd_ctx_params)) {
+            return false;
+        }
 
         ModelLoader model_loader;
+        model_loader.set_use_mmap(sd_ctx_params->enable_mmap);
 
         if (strlen(SAFE_STR(sd_ctx_params->model_path)) > 0) {
             LOG_INFO("loading model from '%s'", sd_ctx_params->model_path);
@@ -365,6 +662,13 @@ public:
             apply_lora_immediately = false;
         }
 
+        // text encoder and vae params are shared with other contexts loading the same weights,
+        // unless this one would modify or free them
+        bool share_params = !apply_lora_immediately && !free_params_immediately;
+        // CPU params stored with their file type are served from the read-only file mapping,
+        // unless LoRAs or PhotoMaker get merged into the weights
+        bool map_params = !apply_lora_immediately && strlen(SAFE_STR(sd_ctx_params->photo_maker_path)) == 0;
+
         if (sd_version_is_sdxl(version)) {
             scale_factor = 0.13025f;
         } else if (sd_version_is_sd3(version)) {
@@ -476,8 +780,11 @@ public:
                     clip_vision = std::make_shared<FrozenCLIPVisionEmbedder>(backend,
                                                                              offload_params_to_cpu,
                                                                              tensor_storage_map);
-                    clip_vision->alloc_params_buffer();
                     clip_vision->get_param_tensors(tensors);
+                    if (map_params) {
+                        map_runner_params({clip_vision}, model_loader);
+                    }
+                    clip_vision->alloc_params_buffer();
                 }
             } else if (sd_version_is_qwen_image(version)) {
                 bool enable_vision = false;
@@ -542,19 +849,48 @@ public:
                 }
             }
 
-            cond_stage_model->alloc_params_buffer();
-            cond_stage_model->get_param_tensors(tensors);
+            if (sd_ctx_params->diffusion_batched_cfg) {
+                if (diffusion_model->supports_batched_conditions()) {
+                    LOG_INFO("Using batched cfg in the diffusion model");
+                    batched_cfg = true;
+                } else {
+                    LOG_WARN("batched cfg is not supported by %s, conditions will be evaluated one by one",
+                             model_version_to_str[version]);
+                }
+            }
 
-            diffusion_model->alloc_params_buffer();
+            if (sd_ctx_params->diffusion_batched_images) {
+                if (diffusion_model->supports_batched_conditions()) {
+                    LOG_INFO("Sampling batches of images in one diffusion model batch");
+                    batched_images = true;
+                } else {
+                    LOG_WARN("batched images are not supported by %s, images will be sampled one by one",
+                             model_version_to_str[version]);
+                }
+            }
+
+            if (share_params) {
+                share_runner_params(cond_stage_model->get_runners(), model_loader);
+            }
+            cond_stage_model->get_param_tensors(tensors);
             diffusion_model->get_param_tensors(tensors);
+            if (map_params) {
+                map_runner_params(cond_stage_model->get_runners(), model_loader);
+                diffusion_model->map_params(model_loader, tensors);
+            }
+            cond_stage_model->alloc_params_buffer();
+            diffusion_model->alloc_params_buffer();
 
             if (sd_version_is_unet_edit(version)) {
                 vae_decode_only = false;
             }
 
             if (high_noise_diffusion_model) {
-                high_noise_diffusion_model->alloc_params_buffer();
                 high_noise_diffusion_model->get_param_tensors(tensors);
+                if (map_params) {
+                    high_noise_diffusion_model->map_params(model_loader, tensors);
+                }
+                high_noise_diffusion_model->alloc_params_buffer();
             }
 
             if (sd_ctx_params->keep_vae_on_cpu && !ggml_backend_is_cpu(backend)) {
@@ -564,6 +900,24 @@ public:
                 vae_backend = backend;
             }
 
+            if (sd_ctx_params->vae_pipeline) {
+                if (vae_backend == backend && ggml_backend_is_cpu(backend)) {
+                    if (n_threads >= 2) {
+                        // sampling and decoding split n_threads, the VAE takes a quarter
+                        vae_backend            = ggml_backend_cpu_init();
+                        vae_pipeline_n_threads = std::max(1, n_threads / 4);
+                    } else {
+                        LOG_WARN("the VAE needs threads of its own to decode alongside sampling on the CPU");
+                    }
+                }
+                if (vae_backend != backend) {
+                    LOG_INFO("VAE decode will run alongside sampling");
+                    vae_pipeline = true;
+                } else {
+                    LOG_WARN("the VAE needs its own backend to decode alongside sampling, try --vae-on-cpu");
+                }
+            }
+
             if (sd_version_is_wan(version) || sd_version_is_qwen_image(version)) {
                 if (!use_tiny_autoencoder) {
                     first_stage_model = std::make_shared<WAN::WanVAERunner>(vae_backend,
@@ -572,8 +926,14 @@ public:
                                                                             "first_stage_model",
                                                                             vae_decode_only,
                                                                             version);
-                    first_stage_model->alloc_params_buffer();
+                    if (share_params) {
+                        share_runner_params({first_stage_model}, model_loader);
+                    }
                     first_stage_model->get_param_tensors(tensors, "first_stage_model");
+                    if (map_params) {
+                        map_runner_params({first_stage_model}, model_loader);
+                    }
+                    first_stage_model->alloc_params_buffer();
                 } else {
                     tae_first_stage = std::make_shared<TinyVideoAutoEncoder>(vae_backend,
                                                                              offload_params_to_cpu,
@@ -610,8 +970,14 @@ public:
                         vae_conv_2d_scale);
                     first_stage_model->set_conv2d_scale(vae_conv_2d_scale);
                 }
-                first_stage_model->alloc_params_buffer();
+                if (share_params) {
+                    share_runner_params({first_stage_model}, model_loader);
+                }
                 first_stage_model->get_param_tensors(tensors, "first_stage_model");
+                if (map_params) {
+                    map_runner_params({first_stage_model}, model_loader);
+                }
+                first_stage_model->alloc_params_buffer();
             } else if (use_tiny_autoencoder) {
                 tae_first_stage = std::make_shared<TinyImageAutoEncoder>(vae_backend,
                                                                          offload_params_to_cpu,
@@ -627,14 +993,13 @@ public:
             // first_stage_model->get_param_tensors(tensors, "first_stage_model.");
 
             if (strlen(SAFE_STR(sd_ctx_params->control_net_path)) > 0) {
-                ggml_backend_t controlnet_backend = nullptr;
                 if (sd_ctx_params->keep_control_net_on_cpu && !ggml_backend_is_cpu(backend)) {
                     LOG_DEBUG("ControlNet: Using CPU backend");
-                    controlnet_backend = ggml_backend_cpu_init();
+                    control_net_backend = ggml_backend_cpu_init();
                 } else {
-                    controlnet_backend = backend;
+                    control_net_backend = backend;
                 }
-                control_net = std::make_shared<ControlNet>(controlnet_backend,
+                control_net = std::make_shared<ControlNet>(control_net_backend,
                                                            offload_params_to_cpu,
                                                            tensor_storage_map,
                                                            version);
@@ -723,12 +1088,37 @@ public:
         if (version == VERSION_SVD) {
             ignore_tensors.insert("conditioner.embedders.3");
         }
-        bool success = model_loader.load_tensors(tensors, ignore_tensors, n_threads);
+
+        // borrowed params are already loaded
+        std::set<ggml_tensor*> shared_tensors;
+        std::vector<std::shared_ptr<GGMLRunner>> runners = cond_stage_model->get_runners();
+        runners.push_back(first_stage_model);
+        for (auto& runner : runners) {
+            if (runner == nullptr || !runner->has_shared_params()) {
+                continue;
+            }
+            ggml_context* params_ctx = runner->get_params_ctx();
+            for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != nullptr; t = ggml_get_next_tensor(params_ctx, t)) {
+                shared_tensors.insert(t);
+            }
+        }
+        // tensors keeps their names, LoRA preprocessing looks model tensors up by name
+        std::map<std::string, struct ggml_tensor*> tensors_to_load;
+        for (auto& [name, tensor] : tensors) {
+            if (shared_tensors.find(tensor) != shared_tensors.end()) {
+                ignore_tensors.insert(name);
+            } else {
+                tensors_to_load[name] = tensor;
+            }
+        }
+
+        bool success = model_loader.load_tensors(tensors_to_load, ignore_tensors, n_threads);
         if (!success) {
             LOG_ERROR("load tensors from model loader failed");
             ggml_free(ctx);
             return false;
         }
+        register_shareable_runners();
 
         LOG_DEBUG("finished loaded file");
 
@@ -902,6 +1292,7 @@ public:
 
         ggml_free(ctx);
         use_tiny_autoencoder = use_tiny_autoencoder && !sd_ctx_params->tae_preview_only;
+        attach_threadpool();
         return true;
     }
 
@@ -968,7 +1359,32 @@ public:
         return lora;
     }
 
+    // load_lora_model_from_file through lora_cache; target names the tensor filter and backend
+    std::shared_ptr<LoraModel> get_lora_model(const std::string& lora_id,
+                                              const std::string& target,
+                                              float multiplier,
+                                              ggml_backend_t backend,
+                                              LoraModel::filter_t lora_tensor_filter = nullptr) {
+        std::string key = target + ":" + lora_id;
+        auto lora       = lora_cache.get(key);
+        if (lora) {
+            LOG_DEBUG("using cached lora '%s'", key.c_str());
+            lora->multiplier = multiplier;
+            return lora;
+        }
+        lora = load_lora_model_from_file(lora_id, multiplier, backend, lora_tensor_filter);
+        if (lora) {
+            lora_cache.put(key, lora);
+        }
+        return lora;
+    }
+
     void apply_loras_immediately(const std::unordered_map<std::string, float>& lora_state) {
+        if (lora_snapshots) {
+            apply_loras_from_snapshots(lora_state);
+            return;
+        }
+
         std::unordered_map<std::string, float> lora_state_diff;
         for (auto& kv : lora_state) {
             const std::string& lora_name = kv.first;
@@ -995,21 +1411,102 @@ public:
         }
 
         for (auto& kv : lora_state_diff) {
+            if (kv.second == 0.f) {
+                continue;
+            }
             int64_t t0 = ggml_time_ms();
 
-            auto lora = load_lora_model_from_file(kv.first, kv.second, backend);
+            auto lora = get_lora_model(kv.first, "model", kv.second, backend);
             if (!lora || lora->lora_tensors.empty()) {
                 continue;
             }
             lora->apply(tensors, version, n_threads);
-            lora->free_params_buffer();
 
             int64_t t1 = ggml_time_ms();
 
             LOG_INFO("lora '%s' applied, taking %.2fs", kv.first.c_str(), (t1 - t0) * 1.0f / 1000);
         }
+        lora_cache.trim();
+
+        curr_lora_state = lora_state;
+    }
+
+    // Puts back the original bytes of every weight a LoRA has modified, then merges all of
+    // lora_state in one graph. Switching LoRAs is exact and costs a copy plus one merge,
+    // instead of one graph per LoRA that subtracts its old diff.
+    void apply_loras_from_snapshots(const std::unordered_map<std::string, float>& lora_state) {
+        if (lora_state == curr_lora_state) {
+            return;
+        }
+
+        LOG_INFO("apply lora immediately");
+        int64_t t0 = ggml_time_ms();
+
+        size_t snapshot_bytes = 0;
+        for (auto& kv : lora_weight_snapshots) {
+            auto it = tensors.find(kv.first);
+            if (it != tensors.end()) {
+                ggml_backend_tensor_set(it->second, kv.second.data(), 0, kv.second.size());
+            }
+            snapshot_bytes += kv.second.size();
+        }
+        curr_lora_state.clear();
+
+        std::vector<std::shared_ptr<LoraModel>> loras;
+        std::vector<LoraModel*> lora_ptrs;
+        for (auto& kv : lora_state) {
+            if (kv.second == 0.f) {
+                continue;
+            }
+            auto lora = get_lora_model(kv.first, "model", kv.second, backend);
+            if (!lora || lora->lora_tensors.empty()) {
+                continue;
+            }
+            loras.push_back(lora);
+            lora_ptrs.push_back(lora.get());
+        }
+
+        if (!loras.empty()) {
+            auto snapshot = [&](const std::string& name, ggml_tensor* tensor) {
+                if (lora_weight_snapshots.find(name) != lora_weight_snapshots.end()) {
+                    return;
+                }
+                auto& data = lora_weight_snapshots[name];
+                data.resize(ggml_nbytes(tensor));
+                ggml_backend_tensor_get(tensor, data.data(), 0, data.size());
+                snapshot_bytes += data.size();
+            };
+            loras[0]->apply(tensors, version, n_threads, lora_ptrs, snapshot);
+        }
+        lora_cache.trim();
 
         curr_lora_state = lora_state;
+
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("%zu LoRAs applied, %zu weight snapshots (%.2f MB), taking %.2fs",
+                 loras.size(),
+                 lora_weight_snapshots.size(),
+                 snapshot_bytes / 1024.0 / 1024.0,
+                 (t1 - t0) * 1.0f / 1000);
+    }
+
+    // reuses cached LoRAs, only LoRAs new to the cache are read from disk
+    std::vector<std::shared_ptr<LoraModel>> get_lora_models(const std::unordered_map<std::string, float>& lora_state,
+                                                            const std::string& target,
+                                                            ggml_backend_t backend,
+                                                            LoraModel::filter_t lora_tensor_filter) {
+        std::vector<std::shared_ptr<LoraModel>> lora_models;
+        for (auto& kv : lora_state) {
+            const std::string& lora_id = kv.first;
+            float multiplier           = kv.second;
+
+            auto lora = get_lora_model(lora_id, target, multiplier, backend, lora_tensor_filter);
+            if (lora && !lora->lora_tensors.empty()) {
+                lora->preprocess_lora_tensors(tensors);
+                lora_models.push_back(lora);
+            }
+        }
+        return lora_models;
     }
 
     void apply_loras_at_runtime(const std::unordered_map<std::string, float>& lora_state) {
@@ -1017,70 +1514,42 @@ public:
         diffusion_lora_models.clear();
         first_stage_lora_models.clear();
         if (lora_state.empty()) {
+            // drop the adapters of the previous generation, they still hold its LoRAs
+            if (cond_stage_model) {
+                cond_stage_model->set_weight_adapter(nullptr);
+            }
+            if (diffusion_model) {
+                diffusion_model->set_weight_adapter(nullptr);
+            }
+            if (high_noise_diffusion_model) {
+                high_noise_diffusion_model->set_weight_adapter(nullptr);
+            }
+            if (first_stage_model) {
+                first_stage_model->set_weight_adapter(nullptr);
+            }
+            lora_cache.trim();
             return;
         }
         LOG_INFO("apply lora at runtime");
         if (cond_stage_model) {
-            std::vector<std::shared_ptr<LoraModel>> lora_models;
-            auto lora_state_diff = lora_state;
-            for (auto& lora_model : cond_stage_lora_models) {
-                auto iter = lora_state_diff.find(lora_model->lora_id);
-
-                if (iter != lora_state_diff.end()) {
-                    lora_model->multiplier = iter->second;
-                    lora_models.push_back(lora_model);
-                    lora_state_diff.erase(iter);
-                }
-            }
-            cond_stage_lora_models  = lora_models;
             auto lora_tensor_filter = [&](const std::string& tensor_name) {
                 if (is_cond_stage_model_name(tensor_name)) {
                     return true;
                 }
                 return false;
             };
-            for (auto& kv : lora_state_diff) {
-                const std::string& lora_id = kv.first;
-                float multiplier           = kv.second;
-
-                auto lora = load_lora_model_from_file(lora_id, multiplier, clip_backend, lora_tensor_filter);
-                if (lora && !lora->lora_tensors.empty()) {
-                    lora->preprocess_lora_tensors(tensors);
-                    cond_stage_lora_models.push_back(lora);
-                }
-            }
+            cond_stage_lora_models  = get_lora_models(lora_state, "cond_stage", clip_backend, lora_tensor_filter);
             auto multi_lora_adapter = std::make_shared<MultiLoraAdapter>(cond_stage_lora_models);
             cond_stage_model->set_weight_adapter(multi_lora_adapter);
         }
         if (diffusion_model) {
-            std::vector<std::shared_ptr<LoraModel>> lora_models;
-            auto lora_state_diff = lora_state;
-            for (auto& lora_model : diffusion_lora_models) {
-                auto iter = lora_state_diff.find(lora_model->lora_id);
-
-                if (iter != lora_state_diff.end()) {
-                    lora_model->multiplier = iter->second;
-                    lora_models.push_back(lora_model);
-                    lora_state_diff.erase(iter);
-                }
-            }
-            diffusion_lora_models   = lora_models;
             auto lora_tensor_filter = [&](const std::string& tensor_name) {
                 if (is_diffusion_model_name(tensor_name)) {
                     return true;
                 }
                 return false;
             };
-            for (auto& kv : lora_state_diff) {
-                const std::string& lora_name = kv.first;
-                float multiplier             = kv.second;
-
-                auto lora = load_lora_model_from_file(lora_name, multiplier, backend, lora_tensor_filter);
-                if (lora && !lora->lora_tensors.empty()) {
-                    lora->preprocess_lora_tensors(tensors);
-                    diffusion_lora_models.push_back(lora);
-                }
-            }
+            diffusion_lora_models   = get_lora_models(lora_state, "diffusion", backend, lora_tensor_filter);
             auto multi_lora_adapter = std::make_shared<MultiLoraAdapter>(diffusion_lora_models);
             diffusion_model->set_weight_adapter(multi_lora_adapter);
             if (high_noise_diffusion_model) {
@@ -1089,37 +1558,17 @@ public:
         }
 
         if (first_stage_model) {
-            std::vector<std::shared_ptr<LoraModel>> lora_models;
-            auto lora_state_diff = lora_state;
-            for (auto& lora_model : first_stage_lora_models) {
-                auto iter = lora_state_diff.find(lora_model->lora_id);
-
-                if (iter != lora_state_diff.end()) {
-                    lora_model->multiplier = iter->second;
-                    lora_models.push_back(lora_model);
-                    lora_state_diff.erase(iter);
-                }
-            }
-            first_stage_lora_models = lora_models;
             auto lora_tensor_filter = [&](const std::string& tensor_name) {
                 if (is_first_stage_model_name(tensor_name)) {
                     return true;
                 }
                 return false;
             };
-            for (auto& kv : lora_state_diff) {
-                const std::string& lora_name = kv.first;
-                float multiplier             = kv.second;
-
-                auto lora = load_lora_model_from_file(lora_name, multiplier, vae_backend, lora_tensor_filter);
-                if (lora && !lora->lora_tensors.empty()) {
-                    lora->preprocess_lora_tensors(tensors);
-                    first_stage_lora_models.push_back(lora);
-                }
-            }
+            first_stage_lora_models = get_lora_models(lora_state, "first_stage", vae_backend, lora_tensor_filter);
             auto multi_lora_adapter = std::make_shared<MultiLoraAdapter>(first_stage_lora_models);
             first_stage_model->set_weight_adapter(multi_lora_adapter);
         }
+        lora_cache.trim();
     }
 
     void lora_stat() {
@@ -1155,6 +1604,11 @@ public:
             lora_f2m[lora_id] = loras[i].multiplier;
             LOG_DEBUG("lora %s:%.2f", lora_id.c_str(), loras[i].multiplier);
         }
+        std::map<std::string, float> sorted_loras(lora_f2m.begin(), lora_f2m.end());
+        condition_cache_lora_key.clear();
+        for (auto& kv : sorted_loras) {
+            condition_cache_lora_key += kv.first + ":" + std::to_string(kv.second) + ";";
+        }
         int64_t t0 = ggml_time_ms();
         if (apply_lora_immediately) {
             apply_loras_immediately(lora_f2m);
@@ -1167,6 +1621,32 @@ public:
         }
     }
 
+    SDCondition get_learned_condition(ggml_context* work_ctx, const ConditionerParams& condition_params) {
+        // reference images are not part of the key, skip the cache for edit models
+        bool use_cache = condition_cache.enabled() && condition_params.ref_images.empty() && condition_params.num_input_imgs == 0;
+        std::string key;
+        if (use_cache) {
+            key = sd_format("%d|%d|%d|%d|%d|%s|",
+                            condition_params.clip_skip,
+                            condition_params.width,
+                            condition_params.height,
+                            condition_params.adm_in_channels,
+                            condition_params.zero_out_masked,
+                            condition_cache_lora_key.c_str()) +
+                  condition_params.text;
+            SDCondition cond;
+            if (condition_cache.get(key, work_ctx, cond)) {
+                LOG_DEBUG("condition cache hit");
+                return cond;
+            }
+        }
+        SDCondition cond = cond_stage_model->get_learned_condition(work_ctx, n_threads, condition_params);
+        if (use_cache) {
+            condition_cache.put(key, cond);
+        }
+        return cond;
+    }
+
     ggml_tensor* id_encoder(ggml_context* work_ctx,
                             ggml_tensor* init_img,
                             ggml_tensor* prompts_embeds,
@@ -1203,7 +1683,7 @@ public:
             image.data = nullptr;
 
             ggml_tensor* pixel_values = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, resized_image.width, resized_image.height, 3, 1);
-            sd_image_f32_to_ggml_tensor(resized_image, pixel_values, false);
+            sd_image_f32_to_ggml_tensor(resized_image, pixel_values, false, n_threads);
             free(resized_image.data);
             resized_image.data = nullptr;
 
@@ -1240,15 +1720,15 @@ public:
                     sd_image_f32_t resized_image = resize_sd_image_f32_t(image, width, height);
                     free(image.data);
                     image.data = nullptr;
-                    sd_image_f32_to_ggml_tensor(resized_image, init_img, false);
+                    sd_image_f32_to_ggml_tensor(resized_image, init_img, false, n_threads);
                     free(resized_image.data);
                     resized_image.data = nullptr;
                 } else {
-                    sd_image_to_ggml_tensor(init_image, init_img);
+                    sd_image_to_ggml_tensor(init_image, init_img, true, n_threads);
                 }
                 if (augmentation_level > 0.f) {
                     struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, init_img);
-                    ggml_ext_im_set_randn_f32(noise, rng);
+                    ggml_ext_im_set_randn_f32(noise, rng, n_threads);
                     // encode_pixels += torch.randn_like(pixels) * augmentation_level
                     ggml_ext_tensor_scale_inplace(noise, augmentation_level);
                     ggml_ext_tensor_add_inplace(init_img, noise);
@@ -1292,6 +1772,10 @@ public:
 
     // a = a * mask + b * (1 - mask)
     void apply_mask(ggml_tensor* a, ggml_tensor* b, ggml_tensor* mask) {
+        if (LatentKernels::can_blend(a, b, mask)) {
+            LatentKernels(n_threads).blend_mask(a, b, mask);
+            return;
+        }
         for (int64_t i0 = 0; i0 < a->ne[0]; i0++) {
             for (int64_t i1 = 0; i1 < a->ne[1]; i1++) {
                 for (int64_t i2 = 0; i2 < a->ne[2]; i2++) {
@@ -1453,7 +1937,7 @@ public:
                 images[i].width   = result->ne[0];
                 images[i].height  = result->ne[1];
                 images[i].channel = 3;
-                images[i].data    = ggml_tensor_to_sd_image(result, i, ggml_n_dims(latents) == 4);
+                images[i].data    = ggml_tensor_to_sd_image(result, i, ggml_n_dims(latents) == 4, n_threads);
             }
 
             step_callback(step, frames, images, is_noisy, step_callback_data);
@@ -1576,6 +2060,69 @@ public:
             out_img_cond = ggml_dup_tensor(work_ctx, x);
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
+        LatentKernels latent_kernels(n_threads);
+
+        // images stacked along ne[3], the conditions are stacked the same way by the caller
+        int64_t image_batch = work_diffusion_model->supports_batched_conditions() ? x->ne[3] : 1;
+
+        // batched cfg: cond, uncond and img_cond go through the diffusion model as one batch
+        int batched_count    = 1 + (has_unconditioned ? 1 : 0) + (has_img_cond ? 1 : 0);
+        bool use_batched_cfg = batched_cfg &&
+                               batched_count > 1 &&
+                               work_diffusion_model->supports_batched_conditions() &&
+                               control_hint == nullptr &&
+                               !easycache_enabled;
+        struct ggml_tensor* batched_x        = nullptr;
+        struct ggml_tensor* batched_out      = nullptr;
+        struct ggml_tensor* batched_context  = nullptr;
+        struct ggml_tensor* batched_c_concat = nullptr;
+        struct ggml_tensor* batched_y        = nullptr;
+        const SDCondition* batched_condition = nullptr;
+        bool batched_condition_ok            = false;
+        if (use_batched_cfg) {
+            batched_x   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x->ne[0], x->ne[1], x->ne[2], x->ne[3] * batched_count);
+            batched_out = ggml_dup_tensor(work_ctx, batched_x);
+        }
+
+        // stacks {active, uncond, img_cond}; fails if their shapes differ, e.g. prompts of different token lengths
+        auto prepare_batched_conditions = [&](const SDCondition* active_condition) -> bool {
+            if (active_condition == batched_condition) {
+                return batched_condition_ok;
+            }
+            batched_condition    = active_condition;
+            batched_condition_ok = false;
+
+            std::vector<ggml_tensor*> contexts  = {active_condition->c_crossattn};
+            std::vector<ggml_tensor*> c_concats = {cond.c_concat};
+            std::vector<ggml_tensor*> ys        = {active_condition->c_vector};
+            if (has_unconditioned) {
+                contexts.push_back(uncond.c_crossattn);
+                c_concats.push_back(uncond.c_concat);
+                ys.push_back(uncond.c_vector);
+            }
+            if (has_img_cond) {
+                contexts.push_back(img_cond.c_crossattn);
+                c_concats.push_back(img_cond.c_concat);
+                ys.push_back(img_cond.c_vector);
+            }
+
+            auto stack_optional = [&](const std::vector<ggml_tensor*>& tensors, int dim, ggml_tensor** result) -> bool {
+                *result = nullptr;
+                if (std::all_of(tensors.begin(), tensors.end(), [](ggml_tensor* t) { return t == nullptr; })) {
+                    return true;
+                }
+                *result = ggml_ext_tensor_stack(work_ctx, tensors, dim);
+                return *result != nullptr;
+            };
+
+            batched_condition_ok = stack_optional(contexts, 2, &batched_context) &&
+                                   stack_optional(c_concats, 3, &batched_c_concat) &&
+                                   stack_optional(ys, 1, &batched_y);
+            if (!batched_condition_ok) {
+                LOG_WARN("conditions have mismatched shapes, falling back to unbatched cfg");
+            }
+            return batched_condition_ok;
+        };
 
         int64_t t0 = ggml_time_us();
 
@@ -1605,6 +2152,9 @@ public:
         }
 
         auto denoise = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
+            if (cancel.check()) {
+                return nullptr;
+            }
             auto sd_preview_cb      = sd_get_preview_callback();
             auto sd_preview_cb_data = sd_get_preview_callback_data();
             auto sd_preview_mode    = sd_get_preview_mode();
@@ -1664,9 +2214,12 @@ public:
                 timesteps_vec.assign(1, t);
             }
 
-            timesteps_vec  = process_timesteps(timesteps_vec, init_latent, denoise_mask);
+            timesteps_vec = process_timesteps(timesteps_vec, init_latent, denoise_mask);
+            if (image_batch > 1 && timesteps_vec.size() == 1) {
+                timesteps_vec.assign(image_batch, timesteps_vec[0]);
+            }
             auto timesteps = vector_to_ggml_tensor(work_ctx, timesteps_vec);
-            std::vector<float> guidance_vec(1, guidance.distilled_guidance);
+            std::vector<float> guidance_vec(image_batch, guidance.distilled_guidance);
             auto guidance_tensor = vector_to_ggml_tensor(work_ctx, guidance_vec);
 
             copy_ggml_tensor(noised_input, input);
@@ -1682,10 +2235,13 @@ public:
                 }
             }
 
+            // leave the threads of a VAE decoding alongside on the same CPU to it
+            int step_n_threads = std::max(1, n_threads - vae_busy_n_threads.load());
+
             std::vector<struct ggml_tensor*> controls;
 
             if (control_hint != nullptr && control_net != nullptr) {
-                if (control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector)) {
+                if (control_net->compute(step_n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector)) {
                     controls = control_net->controls;
                 } else {
                     LOG_ERROR("controlnet compute failed");
@@ -1719,9 +2275,46 @@ public:
                 active_condition          = &id_cond;
             }
 
-            bool skip_model = easycache_before_condition(active_condition, *active_output);
+            // model outputs the guidance is combined from, slices of batched_out after a batched step
+            float* positive_data = (float*)out_cond->data;
+            float* negative_data = has_unconditioned ? (float*)out_uncond->data : nullptr;
+            float* img_cond_data = has_img_cond ? (float*)out_img_cond->data : nullptr;
+
+            bool batched_step = use_batched_cfg &&
+                                timesteps_vec.size() == (size_t)image_batch &&
+                                prepare_batched_conditions(active_condition);
+            if (batched_step) {
+                size_t slice_size = ggml_nbytes(noised_input);
+                for (int i = 0; i < batched_count; i++) {
+                    memcpy((char*)batched_x->data + i * slice_size, noised_input->data, slice_size);
+                }
+                DiffusionParams batched_params = diffusion_params;
+                batched_params.x               = batched_x;
+                batched_params.timesteps       = vector_to_ggml_tensor(work_ctx, std::vector<float>(batched_count * image_batch, timesteps_vec[0]));
+                batched_params.guidance        = vector_to_ggml_tensor(work_ctx, std::vector<float>(batched_count * image_batch, guidance.distilled_guidance));
+                batched_params.context         = batched_context;
+                batched_params.c_concat        = batched_c_concat;
+                batched_params.y               = batched_y;
+                if (!work_diffusion_model->compute(step_n_threads,
+                                                   batched_params,
+                                                   &batched_out)) {
+                    LOG_ERROR("diffusion model compute failed");
+                    return nullptr;
+                }
+                int64_t slice_n = ggml_nelements(out_cond);
+                int index       = 0;
+                positive_data   = (float*)batched_out->data + slice_n * index++;
+                if (has_unconditioned) {
+                    negative_data = (float*)batched_out->data + slice_n * index++;
+                }
+                if (has_img_cond) {
+                    img_cond_data = (float*)batched_out->data + slice_n * index++;
+                }
+            }
+
+            bool skip_model = batched_step || easycache_before_condition(active_condition, *active_output);
             if (!skip_model) {
-                if (!work_diffusion_model->compute(n_threads,
+                if (!work_diffusion_model->compute(step_n_threads,
                                                    diffusion_params,
                                                    active_output)) {
                     LOG_ERROR("diffusion model compute failed");
@@ -1732,11 +2325,10 @@ public:
 
             bool current_step_skipped = easycache_step_is_skipped();
 
-            float* negative_data = nullptr;
             if (has_unconditioned) {
                 // uncond
                 if (!current_step_skipped && control_hint != nullptr && control_net != nullptr) {
-                    if (control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector)) {
+                    if (control_net->compute(step_n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector)) {
                         controls = control_net->controls;
                     } else {
                         LOG_ERROR("controlnet compute failed");
@@ -1747,9 +2339,9 @@ public:
                 diffusion_params.context  = uncond.c_crossattn;
                 diffusion_params.c_concat = uncond.c_concat;
                 diffusion_params.y        = uncond.c_vector;
-                bool skip_uncond          = easycache_before_condition(&uncond, out_uncond);
+                bool skip_uncond          = batched_step || easycache_before_condition(&uncond, out_uncond);
                 if (!skip_uncond) {
-                    if (!work_diffusion_model->compute(n_threads,
+                    if (!work_diffusion_model->compute(step_n_threads,
                                                        diffusion_params,
                                                        &out_uncond)) {
                         LOG_ERROR("diffusion model compute failed");
@@ -1757,17 +2349,15 @@ public:
                     }
                     easycache_after_condition(&uncond, out_uncond);
                 }
-                negative_data = (float*)out_uncond->data;
             }
 
-            float* img_cond_data = nullptr;
             if (has_img_cond) {
                 diffusion_params.context  = img_cond.c_crossattn;
                 diffusion_params.c_concat = img_cond.c_concat;
                 diffusion_params.y        = img_cond.c_vector;
-                bool skip_img_cond        = easycache_before_condition(&img_cond, out_img_cond);
+                bool skip_img_cond        = batched_step || easycache_before_condition(&img_cond, out_img_cond);
                 if (!skip_img_cond) {
-                    if (!work_diffusion_model->compute(n_threads,
+                    if (!work_diffusion_model->compute(step_n_threads,
                                                        diffusion_params,
                                                        &out_img_cond)) {
                         LOG_ERROR("diffusion model compute failed");
@@ -1775,7 +2365,6 @@ public:
                     }
                     easycache_after_condition(&img_cond, out_img_cond);
                 }
-                img_cond_data = (float*)out_img_cond->data;
             }
 
             int step_count         = sigmas.size();
@@ -1789,7 +2378,7 @@ public:
                     diffusion_params.c_concat    = cond.c_concat;
                     diffusion_params.y           = cond.c_vector;
                     diffusion_params.skip_layers = skip_layers;
-                    if (!work_diffusion_model->compute(n_threads,
+                    if (!work_diffusion_model->compute(step_n_threads,
                                                        diffusion_params,
                                                        &out_skip)) {
                         LOG_ERROR("diffusion model compute failed");
@@ -1798,11 +2387,6 @@ public:
                 }
                 skip_layer_data = (float*)out_skip->data;
             }
-            float* vec_denoised  = (float*)denoised->data;
-            float* vec_input     = (float*)input->data;
-            float* positive_data = (float*)out_cond->data;
-            int ne_elements      = (int)ggml_nelements(denoised);
-
             if (shifted_timestep > 0 && sd_version_is_sdxl(version)) {
                 int64_t shifted_t_idx              = static_cast<int64_t>(roundf(timesteps_vec[0]));
                 float shifted_sigma                = denoiser->t_to_sigma((float)shifted_t_idx);
@@ -1815,30 +2399,52 @@ public:
                 c_out  = shifted_c_out;
             }
 
-            for (int i = 0; i < ne_elements; i++) {
-                float latent_result = positive_data[i];
-                if (has_unconditioned) {
-                    // out_uncond + cfg_scale * (out_cond - out_uncond)
-                    if (has_img_cond) {
-                        // out_uncond + text_cfg_scale * (out_cond - out_img_cond) + image_cfg_scale * (out_img_cond - out_uncond)
-                        latent_result = negative_data[i] + img_cfg_scale * (img_cond_data[i] - negative_data[i]) + cfg_scale * (positive_data[i] - img_cond_data[i]);
-                    } else {
-                        // img_cfg_scale == cfg_scale
-                        latent_result = negative_data[i] + cfg_scale * (positive_data[i] - negative_data[i]);
-                    }
-                } else if (has_img_cond) {
-                    // img_cfg_scale == 1
-                    latent_result = img_cond_data[i] + cfg_scale * (positive_data[i] - img_cond_data[i]);
-                }
-                if (is_skiplayer_step) {
-                    latent_result = latent_result + (positive_data[i] - skip_layer_data[i]) * slg_scale;
+            // guidance as one weighted sum of the model outputs
+            float w_cond   = 1.f;
+            float w_uncond = 0.f;
+            float w_img    = 0.f;
+            if (has_unconditioned) {
+                // out_uncond + cfg_scale * (out_cond - out_uncond)
+                if (has_img_cond) {
+                    // out_uncond + text_cfg_scale * (out_cond - out_img_cond) + image_cfg_scale * (out_img_cond - out_uncond)
+                    w_cond   = cfg_scale;
+                    w_uncond = 1.f - img_cfg_scale;
+                    w_img    = img_cfg_scale - cfg_scale;
+                } else {
+                    // img_cfg_scale == cfg_scale
+                    w_cond   = cfg_scale;
+                    w_uncond = 1.f - cfg_scale;
                 }
-                // v = latent_result, eps = latent_result
-                // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
-                vec_denoised[i] = latent_result * c_out + vec_input[i] * c_skip;
+            } else if (has_img_cond) {
+                // img_cfg_scale == 1
+                w_cond = cfg_scale;
+                w_img  = 1.f - cfg_scale;
+            }
+            float w_skip = 0.f;
+            if (is_skiplayer_step) {
+                // + (out_cond - out_skip) * slg_scale
+                w_cond += slg_scale;
+                w_skip = -slg_scale;
             }
 
-            if (denoise_mask != nullptr) {
+            // v = latent_result, eps = latent_result
+            // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
+            bool fuse_mask = denoise_mask != nullptr && LatentKernels::can_blend(denoised, init_latent, denoise_mask);
+            latent_kernels.guided_denoise(denoised,
+                                          input,
+                                          positive_data,
+                                          negative_data,
+                                          img_cond_data,
+                                          is_skiplayer_step ? skip_layer_data : nullptr,
+                                          w_cond,
+                                          w_uncond,
+                                          w_img,
+                                          w_skip,
+                                          c_out,
+                                          c_skip,
+                                          fuse_mask ? init_latent : nullptr,
+                                          fuse_mask ? denoise_mask : nullptr);
+            if (denoise_mask != nullptr && !fuse_mask) {
                 apply_mask(denoised, init_latent, denoise_mask);
             }
 
@@ -1857,13 +2463,15 @@ public:
             return denoised;
         };
 
-        if (!sample_k_diffusion(method, denoise, work_ctx, x, sigmas, sampler_rng, eta)) {
-            LOG_ERROR("Diffusion model sampling failed");
+        if (!sample_k_diffusion(method, denoise, work_ctx, x, sigmas, sampler_rng, eta, n_threads)) {
+            if (!cancel.stopped) {
+                LOG_ERROR("Diffusion model sampling failed");
+            }
             if (control_net) {
                 control_net->free_control_ctx();
                 control_net->free_compute_buffer();
             }
-            diffusion_model->free_compute_buffer();
+            work_diffusion_model->free_compute_buffer();
             return NULL;
         }
 
@@ -1939,6 +2547,31 @@ public:
         return latent_channel;
     }
 
+    // work_ctx memory of one text condition, sized from the conditioner's output width and the
+    // token count of the prompt, plus room for tensor objects and small outputs like pooled vectors
+    size_t get_condition_mem_size(const ConditionerParams& condition_params) {
+        return cond_stage_model->get_condition_mem_size(condition_params) + static_cast<size_t>(1024) * 1024;
+    }
+
+    // Upper bound of the work_ctx memory of one generate_image/generate_video call: the
+    // latents and sampler state of every image, the input, mask, control and decoded images,
+    // and cond_size per text condition, see get_condition_mem_size.
+    // extra_size covers inputs of other sizes, like reference images.
+    size_t get_work_ctx_size(int width, int height, int frames, int batch_count, size_t cond_size, size_t extra_size = 0) {
+        int vae_scale_factor = get_vae_scale_factor();
+        int latent_width     = width / vae_scale_factor + 1;
+        int latent_height    = height / vae_scale_factor + 1;
+        int latent_frames    = sd_version_is_wan(version) ? (frames - 1) / 4 + 1 : frames;
+        size_t latent_size   = sizeof(float) * get_latent_channel() * latent_width * latent_height * latent_frames;
+        size_t image_size    = sizeof(float) * width * height * 3 * frames;
+
+        size_t size = 32 * latent_size * batch_count;
+        size += (5 + 2 * batch_count) * image_size;
+        size += 3 * (2 * batch_count + 1) * cond_size;
+        size += extra_size + static_cast<size_t>(64) * 1024 * 1024;
+        return size;
+    }
+
     int get_image_seq_len(int h, int w) {
         int vae_scale_factor = get_vae_scale_factor();
         return (h / vae_scale_factor) * (w / vae_scale_factor);
@@ -2172,9 +2805,18 @@ public:
                 LOG_DEBUG("VAE Tile size: %dx%d", tile_size_x, tile_size_y);
 
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    if (cancel.check()) {
+                        return;
+                    }
                     first_stage_model->compute(n_threads, in, false, &out, work_ctx);
                 };
-                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling);
+                auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                    if (cancel.check()) {
+                        return;
+                    }
+                    first_stage_model->compute_tiles(n_threads, in, false, out);
+                };
+                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling, vae_tiling_params.parallel_tiles, on_tiles);
             } else {
                 first_stage_model->compute(n_threads, x, false, &result, work_ctx);
             }
@@ -2183,9 +2825,18 @@ public:
             if (vae_tiling_params.enabled && !encode_video) {
                 // split latent in 32x32 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    if (cancel.check()) {
+                        return;
+                    }
                     tae_first_stage->compute(n_threads, in, false, &out, nullptr);
                 };
-                sd_tiling(x, result, vae_scale_factor, 64, 0.5f, on_tiling);
+                auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                    if (cancel.check()) {
+                        return;
+                    }
+                    tae_first_stage->compute_tiles(n_threads, in, false, out);
+                };
+                sd_tiling(x, result, vae_scale_factor, 64, 0.5f, on_tiling, vae_tiling_params.parallel_tiles, on_tiles);
             } else {
                 tae_first_stage->compute(n_threads, x, false, &result, work_ctx);
             }
@@ -2201,7 +2852,7 @@ public:
         // ldm.modules.distributions.distributions.DiagonalGaussianDistribution.sample
         ggml_tensor* latent       = ggml_new_tensor_4d(work_ctx, moments->type, moments->ne[0], moments->ne[1], moments->ne[2] / 2, moments->ne[3]);
         struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, latent);
-        ggml_ext_im_set_randn_f32(noise, rng);
+        ggml_ext_im_set_randn_f32(noise, rng, n_threads);
         {
             float mean   = 0;
             float logvar = 0;
@@ -2266,6 +2917,7 @@ public:
         int64_t H                  = x->ne[1] * vae_scale_factor;
         int64_t C                  = 3;
         ggml_tensor* result        = nullptr;
+        bool success               = true;
         if (decode_video) {
             int T = x->ne[2];
             if (sd_version_is_wan(version)) {
@@ -2301,11 +2953,20 @@ public:
 
                 // split latent in 32x32 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    if (cancel.check()) {
+                        return;
+                    }
                     first_stage_model->compute(n_threads, in, true, &out, nullptr);
                 };
-                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling);
+                auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                    if (cancel.check()) {
+                        return;
+                    }
+                    first_stage_model->compute_tiles(n_threads, in, true, out);
+                };
+                sd_tiling_non_square(x, result, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling, vae_tiling_params.parallel_tiles, on_tiles);
             } else {
-                first_stage_model->compute(n_threads, x, true, &result, work_ctx);
+                success = first_stage_model->compute(n_threads, x, true, &result, work_ctx);
             }
             first_stage_model->free_compute_buffer();
             process_vae_output_tensor(result);
@@ -2313,20 +2974,156 @@ public:
             if (vae_tiling_params.enabled && !decode_video) {
                 // split latent in 64x64 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    if (cancel.check()) {
+                        return;
+                    }
                     tae_first_stage->compute(n_threads, in, true, &out);
                 };
-                sd_tiling(x, result, vae_scale_factor, 64, 0.5f, on_tiling);
+                auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                    if (cancel.check()) {
+                        return;
+                    }
+                    tae_first_stage->compute_tiles(n_threads, in, true, out);
+                };
+                sd_tiling(x, result, vae_scale_factor, 64, 0.5f, on_tiling, vae_tiling_params.parallel_tiles, on_tiles);
             } else {
-                tae_first_stage->compute(n_threads, x, true, &result);
+                success = tae_first_stage->compute(n_threads, x, true, &result);
             }
             tae_first_stage->free_compute_buffer();
         }
 
         int64_t t1 = ggml_time_ms();
         LOG_DEBUG("computing vae decode graph completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+        if (!success || cancel.stopped) {
+            // skipped tiles leave the result incomplete
+            return nullptr;
+        }
         ggml_ext_tensor_clamp_inplace(result, 0.0f, 1.0f);
         return result;
     }
+
+    // Decodes a single latent and hands the RGB8 image to on_rows top to bottom.
+    // With VAE tiling only one row of tiles is kept in memory.
+    void decode_first_stage_rows(ggml_context* work_ctx,
+                                 ggml_tensor* x,
+                                 const std::function<void(int y, int rows, const uint8_t* data)>& on_rows) {
+        if (!vae_tiling_params.enabled) {
+            ggml_tensor* result = decode_first_stage(work_ctx, x);
+            if (result == nullptr) {
+                return;
+            }
+            uint8_t* data = ggml_tensor_to_sd_image(result, nullptr, n_threads);
+            on_rows(0, (int)result->ne[1], data);
+            free(data);
+            return;
+        }
+
+        const int vae_scale_factor = get_vae_scale_factor();
+        int64_t W                  = x->ne[0] * vae_scale_factor;
+        GGML_ASSERT(x->ne[3] == 1);
+
+        std::vector<uint8_t> rows_data;
+        auto on_band_rows = [&](ggml_tensor* band, int y, int rows) {
+            rows_data.resize(W * rows * 3);
+            for (int iy = 0; iy < rows; iy++) {
+                for (int ix = 0; ix < W; ix++) {
+                    for (int k = 0; k < 3; k++) {
+                        float value = ggml_ext_tensor_get_f32(band, ix, iy, k);
+                        if (!use_tiny_autoencoder) {
+                            value = (value + 1.0f) * 0.5f;
+                        }
+                        value                            = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+                        rows_data[(iy * W + ix) * 3 + k] = (uint8_t)(value * 255.0f);
+                    }
+                }
+            }
+            on_rows(y, rows, rows_data.data());
+        };
+
+        int64_t t0 = ggml_time_ms();
+        if (!use_tiny_autoencoder) {
+            if (sd_version_is_qwen_image(version)) {
+                x = ggml_reshape_4d(work_ctx, x, x->ne[0], x->ne[1], 1, x->ne[2] * x->ne[3]);
+            }
+            process_latent_out(x);
+            float tile_overlap;
+            int tile_size_x, tile_size_y;
+            get_tile_sizes(tile_size_x, tile_size_y, tile_overlap, vae_tiling_params, x->ne[0], x->ne[1]);
+
+            LOG_DEBUG("VAE Tile size: %dx%d", tile_size_x, tile_size_y);
+
+            auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                if (cancel.check()) {
+                    return;
+                }
+                first_stage_model->compute(n_threads, in, true, &out, nullptr);
+            };
+            auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                if (cancel.check()) {
+                    return;
+                }
+                first_stage_model->compute_tiles(n_threads, in, true, out);
+            };
+            sd_tiling_streaming(x, 3, 1, vae_scale_factor, tile_size_x, tile_size_y, tile_overlap, on_tiling, on_band_rows, vae_tiling_params.parallel_tiles, on_tiles);
+            first_stage_model->free_compute_buffer();
+        } else {
+            auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                if (cancel.check()) {
+                    return;
+                }
+                tae_first_stage->compute(n_threads, in, true, &out);
+            };
+            auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+                if (cancel.check()) {
+                    return;
+                }
+                tae_first_stage->compute_tiles(n_threads, in, true, out);
+            };
+            sd_tiling_streaming(x, 3, 1, vae_scale_factor, 64, 64, 0.5f, on_tiling, on_band_rows, vae_tiling_params.parallel_tiles, on_tiles);
+            tae_first_stage->free_compute_buffer();
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing streaming vae decode completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+    }
+
+    // Decodes a video latent and hands the RGB8 frames to on_frame in order. The Wan VAE
+    // decodes one latent frame per step, so only the frames of that step are held.
+    bool decode_video_frames(ggml_context* work_ctx,
+                             ggml_tensor* x,
+                             const std::function<void(int frame, const uint8_t* data)>& on_frame) {
+        int frame = 0;
+        std::vector<uint8_t> frame_data;
+        auto emit_frames = [&](ggml_tensor* frames) {
+            frame_data.resize(frames->ne[0] * frames->ne[1] * 3);
+            for (int64_t i = 0; i < frames->ne[2]; i++) {
+                ggml_ext_tensor_to_image(frames, frame_data.data(), (int)i, true, n_threads);
+                on_frame(frame++, frame_data.data());
+            }
+        };
+
+        if (use_tiny_autoencoder) {
+            ggml_tensor* frames = decode_first_stage(work_ctx, x, true);
+            if (frames == nullptr) {
+                return false;
+            }
+            emit_frames(frames);
+            return true;
+        }
+
+        int64_t t0 = ggml_time_ms();
+        process_latent_out(x);
+        auto on_frames = [&](ggml_tensor* frames) {
+            process_vae_output_tensor(frames);
+            ggml_ext_tensor_clamp_inplace(frames, 0.0f, 1.0f);
+            emit_frames(frames);
+            return !cancel.check();
+        };
+        bool res = first_stage_model->decode_frames(n_threads, x, work_ctx, on_frames);
+        first_stage_model->free_compute_buffer();
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing vae decode graph completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+        return res;
+    }
 };
 
 /*================================================= SD API ==================================================*/
@@ -2510,24 +3307,34 @@ void sd_easycache_params_init(sd_easycache_params_t* easycache_params) {
 }
 
 void sd_ctx_params_init(sd_ctx_params_t* sd_ctx_params) {
-    *sd_ctx_params                         = {};
-    sd_ctx_params->vae_decode_only         = true;
-    sd_ctx_params->free_params_immediately = true;
-    sd_ctx_params->n_threads               = sd_get_num_physical_cores();
-    sd_ctx_params->wtype                   = SD_TYPE_COUNT;
-    sd_ctx_params->rng_type                = CUDA_RNG;
-    sd_ctx_params->sampler_rng_type        = RNG_TYPE_COUNT;
-    sd_ctx_params->prediction              = PREDICTION_COUNT;
-    sd_ctx_params->lora_apply_mode         = LORA_APPLY_AUTO;
-    sd_ctx_params->offload_params_to_cpu   = false;
-    sd_ctx_params->keep_clip_on_cpu        = false;
-    sd_ctx_params->keep_control_net_on_cpu = false;
-    sd_ctx_params->keep_vae_on_cpu         = false;
-    sd_ctx_params->diffusion_flash_attn    = false;
-    sd_ctx_params->chroma_use_dit_mask     = true;
-    sd_ctx_params->chroma_use_t5_mask      = false;
-    sd_ctx_params->chroma_t5_mask_pad      = 1;
-    sd_ctx_params->flow_shift              = INFINITY;
+    *sd_ctx_params                          = {};
+    sd_ctx_params->vae_decode_only          = true;
+    sd_ctx_params->free_params_immediately  = true;
+    sd_ctx_params->n_threads                = sd_get_num_physical_cores();
+    sd_ctx_params->wtype                    = SD_TYPE_COUNT;
+    sd_ctx_params->rng_type                 = CUDA_RNG;
+    sd_ctx_params->sampler_rng_type         = RNG_TYPE_COUNT;
+    sd_ctx_params->prediction               = PREDICTION_COUNT;
+    sd_ctx_params->lora_apply_mode          = LORA_APPLY_AUTO;
+    sd_ctx_params->offload_params_to_cpu    = false;
+    sd_ctx_params->keep_clip_on_cpu         = false;
+    sd_ctx_params->keep_control_net_on_cpu  = false;
+    sd_ctx_params->keep_vae_on_cpu          = false;
+    sd_ctx_params->diffusion_flash_attn     = false;
+    sd_ctx_params->chroma_use_dit_mask      = true;
+    sd_ctx_params->chroma_use_t5_mask       = false;
+    sd_ctx_params->chroma_t5_mask_pad       = 1;
+    sd_ctx_params->flow_shift               = INFINITY;
+    sd_ctx_params->diffusion_batched_cfg    = false;
+    sd_ctx_params->enable_mmap              = true;
+    sd_ctx_params->prompt_cache_mb          = 64;
+    sd_ctx_params->diffusion_batched_images = false;
+    sd_ctx_params->vae_pipeline             = false;
+    sd_ctx_params->lora_cache_mb            = 0;
+    sd_ctx_params->lora_snapshots           = false;
+    sd_ctx_params->cpu_mask                 = nullptr;
+    sd_ctx_params->numa_node                = -1;
+    sd_ctx_params->threadpool_poll          = 50;
 }
 
 char* sd_ctx_params_to_str(const sd_ctx_params_t* sd_ctx_params) {
@@ -2565,7 +3372,17 @@ char* sd_ctx_params_to_str(const sd_ctx_params_t* sd_ctx_params) {
              "diffusion_flash_attn: %s\n"
              "chroma_use_dit_mask: %s\n"
              "chroma_use_t5_mask: %s\n"
-             "chroma_t5_mask_pad: %d\n",
+             "chroma_t5_mask_pad: %d\n"
+             "diffusion_batched_cfg: %s\n"
+             "enable_mmap: %s\n"
+             "prompt_cache_mb: %d\n"
+             "diffusion_batched_images: %s\n"
+             "vae_pipeline: %s\n"
+             "lora_cache_mb: %d\n"
+             "lora_snapshots: %s\n"
+             "cpu_mask: %s\n"
+             "numa_node: %d\n"
+             "threadpool_poll: %d\n",
              SAFE_STR(sd_ctx_params->model_path),
              SAFE_STR(sd_ctx_params->clip_l_path),
              SAFE_STR(sd_ctx_params->clip_g_path),
@@ -2594,7 +3411,17 @@ char* sd_ctx_params_to_str(const sd_ctx_params_t* sd_ctx_params) {
              BOOL_STR(sd_ctx_params->diffusion_flash_attn),
              BOOL_STR(sd_ctx_params->chroma_use_dit_mask),
              BOOL_STR(sd_ctx_params->chroma_use_t5_mask),
-             sd_ctx_params->chroma_t5_mask_pad);
+             sd_ctx_params->chroma_t5_mask_pad,
+             BOOL_STR(sd_ctx_params->diffusion_batched_cfg),
+             BOOL_STR(sd_ctx_params->enable_mmap),
+             sd_ctx_params->prompt_cache_mb,
+             BOOL_STR(sd_ctx_params->diffusion_batched_images),
+             BOOL_STR(sd_ctx_params->vae_pipeline),
+             sd_ctx_params->lora_cache_mb,
+             BOOL_STR(sd_ctx_params->lora_snapshots),
+             SAFE_STR(sd_ctx_params->cpu_mask),
+             sd_ctx_params->numa_node,
+             sd_ctx_params->threadpool_poll);
 
     return buf;
 }
@@ -2664,7 +3491,7 @@ void sd_img_gen_params_init(sd_img_gen_params_t* sd_img_gen_params) {
     sd_img_gen_params->batch_count       = 1;
     sd_img_gen_params->control_strength  = 0.9f;
     sd_img_gen_params->pm_params         = {nullptr, 0, nullptr, 20.f};
-    sd_img_gen_params->vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f};
+    sd_img_gen_params->vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f, 1};
     sd_easycache_params_init(&sd_img_gen_params->easycache);
 }
 
@@ -2715,6 +3542,9 @@ char* sd_img_gen_params_to_str(const sd_img_gen_params_t* sd_img_gen_params) {
              sd_img_gen_params->easycache.reuse_threshold,
              sd_img_gen_params->easycache.start_percent,
              sd_img_gen_params->easycache.end_percent);
+    snprintf(buf + strlen(buf), 4096 - strlen(buf),
+             "deadline_ms: %" PRId64 "\n",
+             sd_img_gen_params->deadline_ms);
     free(sample_params_str);
     return buf;
 }
@@ -2734,6 +3564,24 @@ void sd_vid_gen_params_init(sd_vid_gen_params_t* sd_vid_gen_params) {
     sd_easycache_params_init(&sd_vid_gen_params->easycache);
 }
 
+sd_cancel_token_t* sd_cancel_token_new(void) {
+    return new sd_cancel_token_t();
+}
+
+void sd_cancel_token_free(sd_cancel_token_t* token) {
+    delete token;
+}
+
+void sd_cancel_token_cancel(sd_cancel_token_t* token) {
+    if (token != nullptr) {
+        token->cancelled = true;
+    }
+}
+
+bool sd_cancel_token_is_cancelled(const sd_cancel_token_t* token) {
+    return token != nullptr && token->cancelled;
+}
+
 struct sd_ctx_t {
     StableDiffusionGGML* sd = nullptr;
 };
@@ -2786,6 +3634,44 @@ enum scheduler_t sd_get_default_scheduler(const sd_ctx_t* sd_ctx) {
     return DISCRETE_SCHEDULER;
 }
 
+void sd_get_prompt_cache_stats(sd_ctx_t* sd_ctx, sd_prompt_cache_stats_t* stats) {
+    if (stats == nullptr) {
+        return;
+    }
+    *stats = {};
+    if (sd_ctx == nullptr || sd_ctx->sd == nullptr) {
+        return;
+    }
+    ConditionCache& cache = sd_ctx->sd->condition_cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    stats->hits      = cache.hits;
+    stats->misses    = cache.misses;
+    stats->entries   = (uint32_t)cache.entries.size();
+    stats->bytes     = cache.cur_bytes;
+    stats->max_bytes = cache.max_bytes;
+}
+
+void sd_clear_prompt_cache(sd_ctx_t* sd_ctx) {
+    if (sd_ctx != nullptr && sd_ctx->sd != nullptr) {
+        sd_ctx->sd->condition_cache.clear();
+    }
+}
+
+// Repeats every tensor of the condition n times along its batch dim, false if one can't be stacked.
+static bool repeat_condition(ggml_context* work_ctx, const SDCondition& condition, int n, SDCondition* result) {
+    auto repeat = [&](ggml_tensor* tensor, int dim, ggml_tensor** out) -> bool {
+        *out = nullptr;
+        if (tensor == nullptr) {
+            return true;
+        }
+        *out = ggml_ext_tensor_stack(work_ctx, std::vector<ggml_tensor*>(n, tensor), dim);
+        return *out != nullptr;
+    };
+    return repeat(condition.c_crossattn, 2, &result->c_crossattn) &&
+           repeat(condition.c_vector, 1, &result->c_vector) &&
+           repeat(condition.c_concat, 3, &result->c_concat);
+}
+
 sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
                                     struct ggml_context* work_ctx,
                                     ggml_tensor* init_latent,
@@ -2872,10 +3758,9 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
                 processed_id_images.push_back(processed_id_image);
             }
 
-            ggml_ext_tensor_iter(init_img, [&](ggml_tensor* init_img, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-                float value = sd_image_get_f32(processed_id_images[i3], i0, i1, i2, false);
-                ggml_ext_tensor_set_f32(init_img, value, i0, i1, i2, i3);
-            });
+            for (int i = 0; i < processed_id_images.size(); i++) {
+                ggml_ext_image_to_tensor(processed_id_images[i].data, init_img, i, false, false, sd_ctx->sd->n_threads);
+            }
 
             for (auto& image : processed_id_images) {
                 free(image.data);
@@ -2931,9 +3816,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
     // Get learned condition
     condition_params.text            = prompt;
     condition_params.zero_out_masked = false;
-    SDCondition cond                 = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                           sd_ctx->sd->n_threads,
-                                                                                           condition_params);
+    SDCondition cond                 = sd_ctx->sd->get_learned_condition(work_ctx, condition_params);
 
     SDCondition uncond;
     if (guidance.txt_cfg != 1.0 ||
@@ -2944,9 +3827,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         }
         condition_params.text            = negative_prompt;
         condition_params.zero_out_masked = zero_out_masked;
-        uncond                           = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                               sd_ctx->sd->n_threads,
-                                                                                               condition_params);
+        uncond                           = sd_ctx->sd->get_learned_condition(work_ctx, condition_params);
     }
     int64_t t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
@@ -2959,7 +3840,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
     struct ggml_tensor* image_hint = nullptr;
     if (control_image.data != nullptr) {
         image_hint = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-        sd_image_to_ggml_tensor(control_image, image_hint);
+        sd_image_to_ggml_tensor(control_image, image_hint, true, sd_ctx->sd->n_threads);
     }
 
     // Sample
@@ -3057,7 +3938,156 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         (sd_version_is_inpaint_or_unet_edit(sd_ctx->sd->version) && guidance.txt_cfg != guidance.img_cfg)) {
         img_cond = SDCondition(uncond.c_crossattn, uncond.c_vector, cond.c_concat);
     }
-    for (int b = 0; b < batch_count; b++) {
+
+    // sample the whole batch at once, with the init latent and conditions repeated per image
+    bool batch_images = batch_count > 1 &&
+                        sd_ctx->sd->batched_images &&
+                        sd_ctx->sd->control_net == nullptr &&
+                        !sd_ctx->sd->stacked_id &&
+                        ref_latents.empty() &&
+                        denoise_mask == nullptr &&
+                        (easycache_params == nullptr || !easycache_params->enabled);
+    SDCondition batch_cond;
+    SDCondition batch_uncond;
+    SDCondition batch_img_cond;
+    struct ggml_tensor* batch_latent = nullptr;
+    if (batch_images) {
+        batch_latent = ggml_ext_tensor_stack(work_ctx, std::vector<ggml_tensor*>(batch_count, init_latent), 3);
+        batch_images = batch_latent != nullptr &&
+                       repeat_condition(work_ctx, cond, batch_count, &batch_cond) &&
+                       repeat_condition(work_ctx, uncond, batch_count, &batch_uncond) &&
+                       repeat_condition(work_ctx, img_cond, batch_count, &batch_img_cond);
+        if (!batch_images) {
+            LOG_WARN("can not stack the batch, sampling images one by one");
+        }
+    }
+
+    sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
+    if (result_images == nullptr) {
+        sd_ctx->sd->work_ctx_pool.release(work_ctx);
+        return nullptr;
+    }
+
+    // Decodes latent i into result_images[i]. Every latent gets its own context, so it can
+    // be decoded on another thread while the next one is sampled into work_ctx. The latent
+    // is passed by value, final_latents may grow while the decoder thread runs. A non zero
+    // vae_n_threads caps the VAE while sampling runs with the rest of the CPU threads.
+    auto image_rows_cb      = sd_get_image_rows_callback();
+    auto image_rows_cb_data = sd_get_image_rows_callback_data();
+    auto image_done_cb      = sd_get_image_done_callback();
+    auto image_done_cb_data = sd_get_image_done_callback_data();
+    auto decode_latent      = [&](size_t i, ggml_tensor* latent, int vae_n_threads) {
+        if (sd_ctx->sd->cancel.check()) {
+            return;
+        }
+        int64_t decode_start = ggml_time_ms();
+
+        struct ggml_init_params params;
+        params.mem_size   = static_cast<size_t>(width) * height * 3 * sizeof(float) + 1024 * 1024;
+        params.mem_buffer = nullptr;
+        params.no_alloc   = false;
+
+        struct ggml_context* decode_ctx = ggml_init(params);
+        if (!decode_ctx) {
+            LOG_ERROR("ggml_init() failed");
+            return;
+        }
+        sd_ctx->sd->set_vae_busy_n_threads(vae_n_threads);
+        if (image_rows_cb != nullptr) {
+            auto on_rows = [&](int y, int rows, const uint8_t* data) {
+                sd_image_t stripe = {(uint32_t)width, (uint32_t)rows, 3, (uint8_t*)data};
+                image_rows_cb((int)i, y, &stripe, image_rows_cb_data);
+            };
+            sd_ctx->sd->decode_first_stage_rows(decode_ctx, latent, on_rows);
+        } else {
+            struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(decode_ctx, latent /* x_0 */);
+            // print_ggml_tensor(img);
+            result_images[i].data = img != nullptr ? ggml_tensor_to_sd_image(img, nullptr, sd_ctx->sd->n_threads) : nullptr;
+        }
+        sd_ctx->sd->set_vae_busy_n_threads(0);
+        result_images[i].width   = width;
+        result_images[i].height  = height;
+        result_images[i].channel = 3;
+        ggml_free(decode_ctx);
+
+        int64_t decode_end = ggml_time_ms();
+        LOG_INFO("latent %zu decoded, taking %.2fs", i + 1, (decode_end - decode_start) * 1.0f / 1000);
+        if (image_done_cb != nullptr) {
+            image_done_cb((int)i, &result_images[i], image_done_cb_data);
+        }
+    };
+
+    // decode image b while image b + 1 is sampled, unless the VAE is busy with previews
+    auto preview_mode = sd_get_preview_mode();
+    bool vae_previews = sd_get_preview_callback() != nullptr && (preview_mode == PREVIEW_VAE || preview_mode == PREVIEW_TAE);
+    bool pipeline     = sd_ctx->sd->vae_pipeline && batch_count > 1 && !batch_images && !vae_previews;
+    std::thread decode_thread;
+
+    if (batch_images) {
+        int64_t sampling_start = ggml_time_ms();
+        LOG_INFO("generating %d images in one batch - seeds %" PRId64 "-%" PRId64, batch_count, seed, seed + batch_count - 1);
+
+        // every image draws its noise from its own generators, exactly as when sampled alone
+        std::vector<struct ggml_tensor*> noises;
+        std::vector<std::shared_ptr<RNG>> sampler_rngs;
+        for (int b = 0; b < batch_count; b++) {
+            int64_t cur_seed = seed + b;
+            auto image_rng   = sd_ctx->sd->get_rng(sd_ctx->sd->rng_type);
+            image_rng->manual_seed(cur_seed);
+            struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+            ggml_ext_im_set_randn_f32(noise, image_rng, sd_ctx->sd->n_threads);
+            noises.push_back(noise);
+            if (sd_ctx->sd->sampler_rng == sd_ctx->sd->rng) {
+                // the sampler continues the stream the noise came from
+                sampler_rngs.push_back(image_rng);
+            } else {
+                auto sampler_rng = sd_ctx->sd->get_rng(sd_ctx->sd->sampler_rng_type);
+                sampler_rng->manual_seed(cur_seed);
+                sampler_rngs.push_back(sampler_rng);
+            }
+        }
+        struct ggml_tensor* noise = ggml_ext_tensor_stack(work_ctx, noises, 3);
+
+        std::shared_ptr<RNG> sampler_rng = sd_ctx->sd->sampler_rng;
+        sd_ctx->sd->sampler_rng          = std::make_shared<BatchedRNG>(sampler_rngs);
+        struct ggml_tensor* x_0          = sd_ctx->sd->sample(work_ctx,
+                                                              sd_ctx->sd->diffusion_model,
+                                                              true,
+                                                              batch_latent,
+                                                              noise,
+                                                              batch_cond,
+                                                              batch_uncond,
+                                                              batch_img_cond,
+                                                              image_hint,
+                                                              control_strength,
+                                                              guidance,
+                                                              eta,
+                                                              shifted_timestep,
+                                                              sample_method,
+                                                              sigmas,
+                                                              -1,
+                                                              id_cond,
+                                                              ref_latents,
+                                                              increase_ref_index,
+                                                              denoise_mask,
+                                                              nullptr,
+                                                              1.0f,
+                                                              easycache_params);
+        sd_ctx->sd->sampler_rng          = sampler_rng;
+        int64_t sampling_end             = ggml_time_ms();
+        if (x_0 != nullptr) {
+            LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+            for (int b = 0; b < batch_count; b++) {
+                struct ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x_0->ne[0], x_0->ne[1], x_0->ne[2], 1);
+                ggml_ext_tensor_unstack(latent, x_0, b);
+                final_latents.push_back(latent);
+            }
+        } else {
+            LOG_ERROR("sampling for %d images failed after %.2fs", batch_count, (sampling_end - sampling_start) * 1.0f / 1000);
+        }
+    }
+
+    for (int b = 0; b < batch_count && !batch_images && !sd_ctx->sd->cancel.check(); b++) {
         int64_t sampling_start = ggml_time_ms();
         int64_t cur_seed       = seed + b;
         LOG_INFO("generating image: %i/%i - seed %" PRId64, b + 1, batch_count, cur_seed);
@@ -3066,7 +4096,7 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         sd_ctx->sd->sampler_rng->manual_seed(cur_seed);
         struct ggml_tensor* x_t   = init_latent;
         struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-        ggml_ext_im_set_randn_f32(noise, sd_ctx->sd->rng);
+        ggml_ext_im_set_randn_f32(noise, sd_ctx->sd->rng, sd_ctx->sd->n_threads);
 
         int start_merge_step = -1;
         if (sd_ctx->sd->stacked_id) {
@@ -3103,6 +4133,14 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
         if (x_0 != nullptr) {
             // print_ggml_tensor(x_0);
             LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+            if (pipeline) {
+                if (decode_thread.joinable()) {
+                    decode_thread.join();
+                }
+                // the last image decodes after sampling, with all threads
+                int vae_n_threads = b + 1 < batch_count ? sd_ctx->sd->vae_pipeline_n_threads : 0;
+                decode_thread     = std::thread(decode_latent, final_latents.size(), x_0, vae_n_threads);
+            }
             final_latents.push_back(x_0);
         } else {
             LOG_ERROR("sampling for image %d/%d failed after %.2fs", b + 1, batch_count, (sampling_end - sampling_start) * 1.0f / 1000);
@@ -3116,17 +4154,15 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
     LOG_INFO("generating %" PRId64 " latent images completed, taking %.2fs", final_latents.size(), (t3 - t1) * 1.0f / 1000);
 
     // Decode to image
-    LOG_INFO("decoding %zu latents", final_latents.size());
-    std::vector<struct ggml_tensor*> decoded_images;  // collect decoded images
-    for (size_t i = 0; i < final_latents.size(); i++) {
-        t1                      = ggml_time_ms();
-        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents[i] /* x_0 */);
-        // print_ggml_tensor(img);
-        if (img != nullptr) {
-            decoded_images.push_back(img);
+    if (pipeline) {
+        if (decode_thread.joinable()) {
+            decode_thread.join();
+        }
+    } else {
+        LOG_INFO("decoding %zu latents", final_latents.size());
+        for (size_t i = 0; i < final_latents.size(); i++) {
+            decode_latent(i, final_latents[i], 0);
         }
-        int64_t t2 = ggml_time_ms();
-        LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
     }
 
     int64_t t4 = ggml_time_ms();
@@ -3137,24 +4173,23 @@ sd_image_t* generate_image_internal(sd_ctx_t* sd_ctx,
 
     sd_ctx->sd->lora_stat();
 
-    sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
-    if (result_images == nullptr) {
-        ggml_free(work_ctx);
-        return nullptr;
-    }
+    sd_ctx->sd->work_ctx_pool.release(work_ctx);
 
-    for (size_t i = 0; i < decoded_images.size(); i++) {
-        result_images[i].width   = width;
-        result_images[i].height  = height;
-        result_images[i].channel = 3;
-        result_images[i].data    = ggml_tensor_to_sd_image(decoded_images[i]);
+    if (sd_ctx->sd->cancel.stopped) {
+        for (int i = 0; i < batch_count; i++) {
+            free(result_images[i].data);
+        }
+        free(result_images);
+        return nullptr;
     }
-    ggml_free(work_ctx);
 
     return result_images;
 }
 
 sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_gen_params) {
+    if (sd_profiling_enabled()) {
+        sd_profile_reset();
+    }
     sd_ctx->sd->vae_tiling_params = sd_img_gen_params->vae_tiling_params;
     int width                     = sd_img_gen_params->width;
     int height                    = sd_img_gen_params->height;
@@ -3175,14 +4210,27 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_g
     if (sd_ctx == nullptr || sd_img_gen_params == nullptr) {
         return nullptr;
     }
+    sd_ctx->sd->cancel.start(sd_img_gen_params->cancel_token, sd_img_gen_params->deadline_ms);
 
-    struct ggml_init_params params;
-    params.mem_size   = static_cast<size_t>(1024 * 1024) * 1024;  // 1G
-    params.mem_buffer = nullptr;
-    params.no_alloc   = false;
-    // LOG_DEBUG("mem_size %u ", params.mem_size);
+    size_t ref_images_size = 0;
+    for (int i = 0; i < sd_img_gen_params->ref_images_count; i++) {
+        const sd_image_t& ref_image = sd_img_gen_params->ref_images[i];
+        size_t ref_pixels           = std::max(static_cast<size_t>(ref_image.width) * ref_image.height, static_cast<size_t>(width) * height);
+        ref_images_size += 2 * ref_pixels * 3 * sizeof(float);  // image and its latents
+    }
 
-    struct ggml_context* work_ctx = ggml_init(params);
+    ConditionerParams condition_params;
+    for (int i = 0; i < sd_img_gen_params->ref_images_count; i++) {
+        condition_params.ref_images.push_back(&sd_img_gen_params->ref_images[i]);
+    }
+    condition_params.text = SAFE_STR(sd_img_gen_params->prompt);
+    size_t cond_size      = sd_ctx->sd->get_condition_mem_size(condition_params);
+    condition_params.text = SAFE_STR(sd_img_gen_params->negative_prompt);
+    cond_size             = std::max(cond_size, sd_ctx->sd->get_condition_mem_size(condition_params));
+
+    size_t work_ctx_size = sd_ctx->sd->get_work_ctx_size(width, height, 1, sd_img_gen_params->batch_count, cond_size, ref_images_size);
+
+    struct ggml_context* work_ctx = sd_ctx->sd->work_ctx_pool.acquire(work_ctx_size);
     if (!work_ctx) {
         LOG_ERROR("ggml_init() failed");
         return nullptr;
@@ -3240,8 +4288,8 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_g
         ggml_tensor* init_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
         ggml_tensor* mask_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 1, 1);
 
-        sd_image_to_ggml_tensor(sd_img_gen_params->mask_image, mask_img);
-        sd_image_to_ggml_tensor(sd_img_gen_params->init_image, init_img);
+        sd_image_to_ggml_tensor(sd_img_gen_params->mask_image, mask_img, true, sd_ctx->sd->n_threads);
+        sd_image_to_ggml_tensor(sd_img_gen_params->init_image, init_img, true, sd_ctx->sd->n_threads);
 
         if (sd_version_is_inpaint(sd_ctx->sd->version)) {
             int64_t mask_channels = 1;
@@ -3255,14 +4303,14 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_g
             if (sd_ctx->sd->version != VERSION_FLEX_2) {
                 // most inpaint models mask before vae
                 ggml_tensor* masked_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-                ggml_ext_tensor_apply_mask(init_img, mask_img, masked_img);
+                ggml_ext_tensor_apply_mask(init_img, mask_img, masked_img, 0.5f, sd_ctx->sd->n_threads);
                 masked_latent = sd_ctx->sd->encode_first_stage(work_ctx, masked_img);
                 init_latent   = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
             } else {
                 // mask after vae
                 init_latent   = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
                 masked_latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, init_latent->ne[0], init_latent->ne[1], init_latent->ne[2], 1);
-                ggml_ext_tensor_apply_mask(init_latent, mask_img, masked_latent, 0.);
+                ggml_ext_tensor_apply_mask(init_latent, mask_img, masked_latent, 0.f, sd_ctx->sd->n_threads);
             }
             concat_latent = ggml_new_tensor_4d(work_ctx,
                                                GGML_TYPE_F32,
@@ -3385,7 +4433,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_g
                                      resized_image.height,
                                      3,
                                      1);
-            sd_image_f32_to_ggml_tensor(resized_image, img);
+            sd_image_f32_to_ggml_tensor(resized_image, img, true, sd_ctx->sd->n_threads);
             free(resized_image.data);
             resized_image.data = nullptr;
         } else {
@@ -3395,7 +4443,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_g
                                      ref_images[i]->height,
                                      3,
                                      1);
-            sd_image_to_ggml_tensor(*ref_images[i], img);
+            sd_image_to_ggml_tensor(*ref_images[i], img, true, sd_ctx->sd->n_threads);
         }
 
         // print_ggml_tensor(img, false, "img");
@@ -3445,6 +4493,10 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
     if (sd_ctx == nullptr || sd_vid_gen_params == nullptr) {
         return nullptr;
     }
+    if (sd_profiling_enabled()) {
+        sd_profile_reset();
+    }
+    sd_ctx->sd->cancel.start(sd_vid_gen_params->cancel_token, sd_vid_gen_params->deadline_ms);
 
     std::string prompt          = SAFE_STR(sd_vid_gen_params->prompt);
     std::string negative_prompt = SAFE_STR(sd_vid_gen_params->negative_prompt);
@@ -3519,13 +4571,14 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
         LOG_DEBUG("switching from high noise model at step %d", high_noise_sample_steps);
     }
 
-    struct ggml_init_params params;
-    params.mem_size   = static_cast<size_t>(1024 * 1024) * 1024;  // 1G
-    params.mem_buffer = nullptr;
-    params.no_alloc   = false;
-    // LOG_DEBUG("mem_size %u ", params.mem_size);
+    ConditionerParams condition_params;
+    condition_params.text = prompt;
+    size_t cond_size      = sd_ctx->sd->get_condition_mem_size(condition_params);
+    condition_params.text = negative_prompt;
+    cond_size             = std::max(cond_size, sd_ctx->sd->get_condition_mem_size(condition_params));
 
-    struct ggml_context* work_ctx = ggml_init(params);
+    size_t work_ctx_size          = sd_ctx->sd->get_work_ctx_size(width, height, frames, 1, cond_size);
+    struct ggml_context* work_ctx = sd_ctx->sd->work_ctx_pool.acquire(work_ctx_size);
     if (!work_ctx) {
         LOG_ERROR("ggml_init() failed");
         return nullptr;
@@ -3620,7 +4673,7 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
 
         int64_t t1            = ggml_time_ms();
         ggml_tensor* init_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-        sd_image_to_ggml_tensor(sd_vid_gen_params->init_image, init_img);
+        sd_image_to_ggml_tensor(sd_vid_gen_params->init_image, init_img, true, sd_ctx->sd->n_threads);
         init_img = ggml_reshape_4d(work_ctx, init_img, width, height, 1, 3);
 
         auto init_image_latent = sd_ctx->sd->vae_encode(work_ctx, init_img);  // [b*c, 1, h/16, w/16]
@@ -3652,7 +4705,7 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
         ggml_tensor* ref_image_latent = nullptr;
         if (sd_vid_gen_params->init_image.data) {
             ggml_tensor* ref_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-            sd_image_to_ggml_tensor(sd_vid_gen_params->init_image, ref_img);
+            sd_image_to_ggml_tensor(sd_vid_gen_params->init_image, ref_img, true, sd_ctx->sd->n_threads);
             ref_img = ggml_reshape_4d(work_ctx, ref_img, width, height, 1, 3);
 
             ref_image_latent = sd_ctx->sd->encode_first_stage(work_ctx, ref_img);  // [b*c, 1, h/16, w/16]
@@ -3662,26 +4715,28 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
         }
 
         ggml_tensor* control_video = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, frames, 3);
-        ggml_ext_tensor_iter(control_video, [&](ggml_tensor* control_video, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-            float value = 0.5f;
-            if (i2 < sd_vid_gen_params->control_frames_size) {
-                value = sd_image_get_f32(sd_vid_gen_params->control_frames[i2], i0, i1, i3);
-            }
-            ggml_ext_tensor_set_f32(control_video, value, i0, i1, i2, i3);
-        });
+        ggml_set_f32(control_video, 0.5f);
+        for (int i = 0; i < std::min(frames, sd_vid_gen_params->control_frames_size); i++) {
+            ggml_ext_image_to_tensor(sd_vid_gen_params->control_frames[i].data, control_video, i, true, true, sd_ctx->sd->n_threads);
+        }
         ggml_tensor* mask = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, frames, 1);
         ggml_set_f32(mask, 1.0f);
         ggml_tensor* inactive = ggml_dup_tensor(work_ctx, control_video);
         ggml_tensor* reactive = ggml_dup_tensor(work_ctx, control_video);
 
-        ggml_ext_tensor_iter(control_video, [&](ggml_tensor* t, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-            float control_video_value = ggml_ext_tensor_get_f32(t, i0, i1, i2, i3) - 0.5f;
-            float mask_value          = ggml_ext_tensor_get_f32(mask, i0, i1, i2, 0);
-            float inactive_value      = (control_video_value * (1.f - mask_value)) + 0.5f;
-            float reactive_value      = (control_video_value * mask_value) + 0.5f;
-
-            ggml_ext_tensor_set_f32(inactive, inactive_value, i0, i1, i2, i3);
-            ggml_ext_tensor_set_f32(reactive, reactive_value, i0, i1, i2, i3);
+        int64_t plane_size = ggml_nelements(mask);
+        sd_parallel_for(sd_ctx->sd->n_threads, plane_size, control_video->ne[3], [&](int64_t begin, int64_t end) {
+            const float* mask_data = (const float*)mask->data;
+            for (int64_t c = 0; c < control_video->ne[3]; c++) {
+                const float* control_video_data = (const float*)control_video->data + c * plane_size;
+                float* inactive_data            = (float*)inactive->data + c * plane_size;
+                float* reactive_data            = (float*)reactive->data + c * plane_size;
+                for (int64_t i = begin; i < end; i++) {
+                    float control_video_value = control_video_data[i] - 0.5f;
+                    inactive_data[i]          = (control_video_value * (1.f - mask_data[i])) + 0.5f;
+                    reactive_data[i]          = (control_video_value * mask_data[i]) + 0.5f;
+                }
+            }
         });
 
         inactive = sd_ctx->sd->encode_first_stage(work_ctx, inactive);  // [b*c, t, h/vae_scale_factor, w/vae_scale_factor]
@@ -3727,23 +4782,18 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
     }
 
     // Get learned condition
-    ConditionerParams condition_params;
     condition_params.clip_skip       = sd_vid_gen_params->clip_skip;
     condition_params.zero_out_masked = true;
     condition_params.text            = prompt;
 
     int64_t t1       = ggml_time_ms();
-    SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                           sd_ctx->sd->n_threads,
-                                                                           condition_params);
+    SDCondition cond = sd_ctx->sd->get_learned_condition(work_ctx, condition_params);
     cond.c_concat    = concat_latent;
     cond.c_vector    = clip_vision_output;
     SDCondition uncond;
     if (sd_vid_gen_params->sample_params.guidance.txt_cfg != 1.0 || sd_vid_gen_params->high_noise_sample_params.guidance.txt_cfg != 1.0) {
         condition_params.text = negative_prompt;
-        uncond                = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                                    sd_ctx->sd->n_threads,
-                                                                                    condition_params);
+        uncond                = sd_ctx->sd->get_learned_condition(work_ctx, condition_params);
         uncond.c_concat       = concat_latent;
         uncond.c_vector       = clip_vision_output;
     }
@@ -3762,7 +4812,7 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
     struct ggml_tensor* final_latent;
     struct ggml_tensor* x_t   = init_latent;
     struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, T, C);
-    ggml_ext_im_set_randn_f32(noise, sd_ctx->sd->rng);
+    ggml_ext_im_set_randn_f32(noise, sd_ctx->sd->rng, sd_ctx->sd->n_threads);
     // High Noise Sample
     if (high_noise_sample_steps > 0) {
         LOG_DEBUG("sample(high noise) %dx%dx%d", W, H, T);
@@ -3802,10 +4852,15 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
                                  &sd_vid_gen_params->easycache);
 
         int64_t sampling_end = ggml_time_ms();
-        LOG_INFO("sampling(high noise) completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
         if (sd_ctx->sd->free_params_immediately) {
             sd_ctx->sd->high_noise_diffusion_model->free_params_buffer();
         }
+        if (x_t == nullptr) {
+            LOG_ERROR("sampling(high noise) failed after %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+            sd_ctx->sd->work_ctx_pool.release(work_ctx);
+            return nullptr;
+        }
+        LOG_INFO("sampling(high noise) completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
         noise = nullptr;
     }
 
@@ -3839,10 +4894,15 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
                                           &sd_vid_gen_params->easycache);
 
         int64_t sampling_end = ggml_time_ms();
-        LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
         if (sd_ctx->sd->free_params_immediately) {
             sd_ctx->sd->diffusion_model->free_params_buffer();
         }
+        if (final_latent == nullptr) {
+            LOG_ERROR("sampling failed after %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+            sd_ctx->sd->work_ctx_pool.release(work_ctx);
+            return nullptr;
+        }
+        LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
     }
 
     if (ref_image_num > 0) {
@@ -3861,29 +4921,58 @@ SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* s
 
     int64_t t4 = ggml_time_ms();
     LOG_INFO("generating latent video completed, taking %.2fs", (t4 - t2) * 1.0f / 1000);
-    struct ggml_tensor* vid = sd_ctx->sd->decode_first_stage(work_ctx, final_latent, true);
-    int64_t t5              = ggml_time_ms();
+    int frame_count          = (int)(final_latent->ne[2] - 1) * 4 + 1;
+    auto video_frame_cb      = sd_get_video_frame_callback();
+    auto video_frame_cb_data = sd_get_video_frame_callback_data();
+
+    sd_image_t* result_images = (sd_image_t*)calloc(frame_count, sizeof(sd_image_t));
+    if (result_images == nullptr) {
+        sd_ctx->sd->work_ctx_pool.release(work_ctx);
+        return nullptr;
+    }
+    for (int i = 0; i < frame_count; i++) {
+        result_images[i].width   = width;
+        result_images[i].height  = height;
+        result_images[i].channel = 3;
+    }
+
+    // frames go to the callback as they are decoded, or are kept for the caller
+    auto on_frame = [&](int i, const uint8_t* data) {
+        if (i >= frame_count) {
+            return;
+        }
+        if (video_frame_cb != nullptr) {
+            sd_image_t frame = {(uint32_t)width, (uint32_t)height, 3, (uint8_t*)data};
+            video_frame_cb(i, frame_count, &frame, video_frame_cb_data);
+            return;
+        }
+        size_t frame_size     = (size_t)width * height * 3;
+        result_images[i].data = (uint8_t*)malloc(frame_size);
+        if (result_images[i].data != nullptr) {
+            memcpy(result_images[i].data, data, frame_size);
+        }
+    };
+    bool decoded = sd_ctx->sd->decode_video_frames(work_ctx, final_latent, on_frame);
+    int64_t t5   = ggml_time_ms();
     LOG_INFO("decode_first_stage completed, taking %.2fs", (t5 - t4) * 1.0f / 1000);
     if (sd_ctx->sd->free_params_immediately && !sd_ctx->sd->use_tiny_autoencoder) {
         sd_ctx->sd->first_stage_model->free_params_buffer();
     }
 
     sd_ctx->sd->lora_stat();
+    sd_ctx->sd->work_ctx_pool.release(work_ctx);
 
-    sd_image_t* result_images = (sd_image_t*)calloc(vid->ne[2], sizeof(sd_image_t));
-    if (result_images == nullptr) {
-        ggml_free(work_ctx);
+    if (!decoded || sd_ctx->sd->cancel.stopped) {
+        if (!sd_ctx->sd->cancel.stopped) {
+            LOG_ERROR("decode video failed");
+        }
+        for (int i = 0; i < frame_count; i++) {
+            free(result_images[i].data);
+        }
+        free(result_images);
         return nullptr;
     }
-    *num_frames_out = vid->ne[2];
-
-    for (size_t i = 0; i < vid->ne[2]; i++) {
-        result_images[i].width   = vid->ne[0];
-        result_images[i].height  = vid->ne[1];
-        result_images[i].channel = 3;
-        result_images[i].data    = ggml_tensor_to_sd_image(vid, i, true);
-    }
-    ggml_free(work_ctx);
+    *num_frames_out = frame_count;
 
     LOG_INFO("generate_video completed in %.2fs", (t5 - t0) * 1.0f / 1000);
 
@@ -148,6 +148,7 @@ typedef struct {
     float target_overlap;
     float rel_size_x;
     float rel_size_y;
+    int parallel_tiles;  // tiles processed concurrently on the CPU backend, <= 1 for one at a time
 } sd_tiling_params_t;
 
 typedef struct {
@@ -193,6 +194,16 @@ typedef struct {
     bool chroma_use_t5_mask;
     int chroma_t5_mask_pad;
     float flow_shift;
+    bool diffusion_batched_cfg;
+    bool enable_mmap;
+    int prompt_cache_mb;  // memory budget of the prompt embedding cache, 0 disables it
+    bool diffusion_batched_images;
+    bool vae_pipeline;  // decode finished images while the next one is sampled
+    int lora_cache_mb;    // memory budget of parsed LoRAs kept loaded while unused, 0 keeps only the LoRAs in use
+    bool lora_snapshots;  // immediate mode: keep the original weights LoRAs modify, switching LoRAs restores them
+    const char* cpu_mask;  // CPUs the compute threads run on, e.g. "0-7,16-23", empty for any
+    int numa_node;         // keep the compute threads on the CPUs of this NUMA node, -1 for any
+    int threadpool_poll;   // 0 lets idle compute threads sleep, up to 100 busy waits longer for the next graph
 } sd_ctx_params_t;
 
 typedef struct {
@@ -202,6 +213,10 @@ typedef struct {
     uint8_t* data;
 } sd_image_t;
 
+// Cooperative cancellation of generate_image/generate_video: the call checks the token
+// between sampling steps, VAE tiles and batch items and returns NULL once it is cancelled.
+typedef struct sd_cancel_token_t sd_cancel_token_t;
+
 typedef struct {
     int* layers;
     size_t layer_count;
@@ -271,6 +286,8 @@ typedef struct {
     sd_pm_params_t pm_params;
     sd_tiling_params_t vae_tiling_params;
     sd_easycache_params_t easycache;
+    const sd_cancel_token_t* cancel_token;  // aborts the call once cancelled, NULL for none
+    int64_t deadline_ms;                    // aborts the call after this many ms, 0 for no deadline
 } sd_img_gen_params_t;
 
 typedef struct {
@@ -293,17 +310,53 @@ typedef struct {
     int video_frames;
     float vace_strength;
     sd_easycache_params_t easycache;
+    const sd_cancel_token_t* cancel_token;  // aborts the call once cancelled, NULL for none
+    int64_t deadline_ms;                    // aborts the call after this many ms, 0 for no deadline
 } sd_vid_gen_params_t;
 
 typedef struct sd_ctx_t sd_ctx_t;
 
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t entries;
+    uint64_t bytes;
+    uint64_t max_bytes;
+} sd_prompt_cache_stats_t;
+
 typedef void (*sd_log_cb_t)(enum sd_log_level_t level, const char* text, void* data);
 typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
 typedef void (*sd_preview_cb_t)(int step, int frame_count, sd_image_t* frames, bool is_noisy, void* data);
+// rows: RGB8 stripe of image_index, covering rows [y, y + rows->height) of the output image
+typedef void (*sd_image_rows_cb_t)(int image_index, int y, const sd_image_t* rows, void* data);
+// image: entry image_index of the array generate_image will return, owned by the caller of generate_image
+typedef void (*sd_image_done_cb_t)(int image_index, const sd_image_t* image, void* data);
+// frame: frame frame_index of the frame_count generate_video produces, only valid during the call
+typedef void (*sd_video_frame_cb_t)(int frame_index, int frame_count, const sd_image_t* frame, void* data);
 
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
 SD_API void sd_set_preview_callback(sd_preview_cb_t cb, enum preview_t mode, int interval, bool denoised, bool noisy, void* data);
+// When set, generate_image streams each decoded image to cb top to bottom instead of
+// returning it; the returned images then only carry width/height/channel (data == NULL).
+// With VAE tiling the full-size image is never held in memory.
+SD_API void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data);
+// Called by generate_image as soon as each image is decoded, before generate_image returns.
+// With vae_pipeline the call comes from the decoder thread while the next image is sampled.
+SD_API void sd_set_image_done_callback(sd_image_done_cb_t cb, void* data);
+// When set, generate_video hands each frame to cb in order as soon as it is decoded instead of
+// returning it; the returned frames then only carry width/height/channel (data == NULL).
+// The Wan VAE decodes one latent frame at a time, so only a few frames are held in memory.
+SD_API void sd_set_video_frame_callback(sd_video_frame_cb_t cb, void* data);
+// Graph profiling: while enabled, every graph is evaluated one node at a time and the wall
+// time of each node is recorded (slower than a normal run). generate_image and
+// generate_video reset the recorded data when they start.
+SD_API void sd_set_profiling(bool enabled);
+SD_API void sd_profile_reset(void);
+// JSON summary by runner, op and block, max_blocks <= 0 lists every block; free() the result
+SD_API char* sd_profile_report_json(int max_blocks);
+// Chrome trace event JSON for chrome://tracing or Perfetto; free() the result
+SD_API char* sd_profile_chrome_trace(void);
 SD_API int32_t sd_get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -335,11 +388,19 @@ SD_API char* sd_sample_params_to_str(const sd_sample_params_t* sample_params);
 
 SD_API enum sample_method_t sd_get_default_sample_method(const sd_ctx_t* sd_ctx);
 SD_API enum scheduler_t sd_get_default_scheduler(const sd_ctx_t* sd_ctx);
+SD_API void sd_get_prompt_cache_stats(sd_ctx_t* sd_ctx, sd_prompt_cache_stats_t* stats);
+SD_API void sd_clear_prompt_cache(sd_ctx_t* sd_ctx);
 
 SD_API void sd_img_gen_params_init(sd_img_gen_params_t* sd_img_gen_params);
 SD_API char* sd_img_gen_params_to_str(const sd_img_gen_params_t* sd_img_gen_params);
 SD_API sd_image_t* generate_image(sd_ctx_t* sd_ctx, const sd_img_gen_params_t* sd_img_gen_params);
 
+SD_API sd_cancel_token_t* sd_cancel_token_new(void);
+SD_API void sd_cancel_token_free(sd_cancel_token_t* token);
+// safe to call from any thread while a generation uses the token
+SD_API void sd_cancel_token_cancel(sd_cancel_token_t* token);
+SD_API bool sd_cancel_token_is_cancelled(const sd_cancel_token_t* token);
+
 SD_API void sd_vid_gen_params_init(sd_vid_gen_params_t* sd_vid_gen_params);
 SD_API sd_image_t* generate_video(sd_ctx_t* sd_ctx, const sd_vid_gen_params_t* sd_vid_gen_params, int* num_frames_out);
 
@@ -350,6 +411,13 @@ SD_API upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path,
                                         bool direct,
                                         int n_threads,
                                         int tile_size);
+// parallel_tiles: tiles upscaled concurrently on the CPU backend, <= 1 for one at a time
+SD_API upscaler_ctx_t* new_upscaler_ctx_ex(const char* esrgan_path,
+                                           bool offload_params_to_cpu,
+                                           bool direct,
+                                           int n_threads,
+                                           int tile_size,
+                                           int parallel_tiles);
 SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
 SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx,
@@ -369,7 +437,8 @@ SD_API bool preprocess_canny(sd_image_t image,
                              float low_threshold,
                              float weak,
                              float strong,
-                             bool inverse);
+                             bool inverse,
+                             int n_threads);
 
 SD_API const char* sd_commit(void);
 SD_API const char* sd_version(void);
@@ -506,6 +506,20 @@ struct TinyAutoEncoder : public GGMLRunner {
                          struct ggml_context* output_ctx = nullptr) = 0;
 
     virtual bool load_from_file(const std::string& file_path, int n_threads) = 0;
+
+    // processes independent tiles, concurrently where the runner supports it
+    virtual bool compute_tiles(const int n_threads,
+                               const std::vector<struct ggml_tensor*>& inputs,
+                               bool decode_graph,
+                               const std::vector<struct ggml_tensor*>& outputs) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            struct ggml_tensor* output = outputs[i];
+            if (!compute(n_threads, inputs[i], decode_graph, &output)) {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 struct TinyImageAutoEncoder : public TinyAutoEncoder {
@@ -575,6 +589,19 @@ struct TinyImageAutoEncoder : public TinyAutoEncoder {
 
         return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
+
+    bool compute_tiles(const int n_threads,
+                       const std::vector<struct ggml_tensor*>& inputs,
+                       bool decode_graph,
+                       const std::vector<struct ggml_tensor*>& outputs) override {
+        std::vector<get_graph_cb_t> get_graphs;
+        for (auto z : inputs) {
+            get_graphs.push_back([this, z, decode_graph]() -> struct ggml_cgraph* {
+                return build_graph(z, decode_graph);
+            });
+        }
+        return compute_parallel(get_graphs, n_threads, outputs);
+    }
 };
 
 struct TinyVideoAutoEncoder : public TinyAutoEncoder {
@@ -665,7 +665,9 @@ struct UNetModelRunner : public GGMLRunner {
             return build_graph(x, timesteps, context, c_concat, y, num_video_frames, controls, control_strength);
         };
 
-        return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        // controls live in the control net's buffers, a graph using them is rebuilt every call
+        std::string graph_key = std::to_string(num_video_frames) + "," + std::to_string(control_strength);
+        return GGMLRunner::compute_with_graph_cache(get_graph, n_threads, {x, timesteps, context, c_concat, y}, graph_key, output, output_ctx);
     }
 
     void test() {
@@ -9,15 +9,18 @@ struct UpscalerGGML {
     std::shared_ptr<ESRGAN> esrgan_upscaler;
     std::string esrgan_path;
     int n_threads;
-    bool direct   = false;
-    int tile_size = 128;
+    bool direct        = false;
+    int tile_size      = 128;
+    int parallel_tiles = 1;
 
     UpscalerGGML(int n_threads,
-                 bool direct   = false,
-                 int tile_size = 128)
+                 bool direct        = false,
+                 int tile_size      = 128,
+                 int parallel_tiles = 1)
         : n_threads(n_threads),
           direct(direct),
-          tile_size(tile_size) {
+          tile_size(tile_size),
+          parallel_tiles(parallel_tiles) {
     }
 
     bool load_from_file(const std::string& esrgan_path,
@@ -85,17 +88,20 @@ struct UpscalerGGML {
         }
         // LOG_DEBUG("upscale work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
         ggml_tensor* input_image_tensor = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, input_image.width, input_image.height, 3, 1);
-        sd_image_to_ggml_tensor(input_image, input_image_tensor);
+        sd_image_to_ggml_tensor(input_image, input_image_tensor, true, n_threads);
 
         ggml_tensor* upscaled = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, output_width, output_height, 3, 1);
         auto on_tiling        = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
             esrgan_upscaler->compute(n_threads, in, &out);
         };
+        auto on_tiles = [&](const std::vector<ggml_tensor*>& in, const std::vector<ggml_tensor*>& out) {
+            esrgan_upscaler->compute_tiles(n_threads, in, out);
+        };
         int64_t t0 = ggml_time_ms();
-        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, esrgan_upscaler->tile_size, 0.25f, on_tiling);
+        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, esrgan_upscaler->tile_size, 0.25f, on_tiling, parallel_tiles, on_tiles);
         esrgan_upscaler->free_compute_buffer();
         ggml_ext_tensor_clamp_inplace(upscaled, 0.f, 1.f);
-        uint8_t* upscaled_data = ggml_tensor_to_sd_image(upscaled);
+        uint8_t* upscaled_data = ggml_tensor_to_sd_image(upscaled, nullptr, n_threads);
         ggml_free(upscale_ctx);
         int64_t t3 = ggml_time_ms();
         LOG_INFO("input_image_tensor upscaled, taking %.2fs", (t3 - t0) / 1000.0f);
@@ -118,13 +124,22 @@ upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path_c_str,
                                  bool direct,
                                  int n_threads,
                                  int tile_size) {
+    return new_upscaler_ctx_ex(esrgan_path_c_str, offload_params_to_cpu, direct, n_threads, tile_size, 1);
+}
+
+upscaler_ctx_t* new_upscaler_ctx_ex(const char* esrgan_path_c_str,
+                                    bool offload_params_to_cpu,
+                                    bool direct,
+                                    int n_threads,
+                                    int tile_size,
+                                    int parallel_tiles) {
     upscaler_ctx_t* upscaler_ctx = (upscaler_ctx_t*)malloc(sizeof(upscaler_ctx_t));
     if (upscaler_ctx == nullptr) {
         return nullptr;
     }
     std::string esrgan_path(esrgan_path_c_str);
 
-    upscaler_ctx->upscaler = new UpscalerGGML(n_threads, direct, tile_size);
+    upscaler_ctx->upscaler = new UpscalerGGML(n_threads, direct, tile_size, parallel_tiles);
     if (upscaler_ctx->upscaler == nullptr) {
         return nullptr;
     }
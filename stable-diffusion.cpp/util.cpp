@@ -1,16 +1,22 @@
 #include "util.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <codecvt>
 #include <cstdarg>
 #include <fstream>
 #include <locale>
+#include <map>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include "json.hpp"
 #include "preprocessing.hpp"
 
 #if defined(__APPLE__) && defined(__MACH__)
@@ -81,6 +87,26 @@ int round_up_to(int value, int base) {
     }
 }
 
+void sd_parallel_for(int n_threads, int64_t n, int64_t cost, const std::function<void(int64_t, int64_t)>& fn, int64_t align) {
+    // below this many elements per thread, starting the thread costs more than the work
+    const int64_t min_cost_per_thread = 64 * 1024;
+    int64_t n_chunks                  = std::min<int64_t>(n_threads, n * cost / min_cost_per_thread);
+    if (n_chunks <= 1) {
+        fn(0, n);
+        return;
+    }
+    int64_t chunk = (n + n_chunks - 1) / n_chunks;
+    chunk         = (chunk + align - 1) / align * align;
+    std::vector<std::thread> workers;
+    for (int64_t begin = chunk; begin < n; begin += chunk) {
+        workers.emplace_back(fn, begin, std::min(n, begin + chunk));
+    }
+    fn(0, std::min(n, chunk));
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
 #ifdef _WIN32  // code for windows
 #define NOMINMAX
 #include <windows.h>
@@ -95,8 +121,55 @@ bool is_directory(const std::string& path) {
     return (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
 }
 
+bool MmapFile::open(const std::string& path) {
+    close();
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        return false;
+    }
+    void* addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (addr == nullptr) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle_    = file;
+    mapping_handle_ = mapping;
+    data_           = (const uint8_t*)addr;
+    size_           = (size_t)file_size.QuadPart;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+    if (mapping_handle_ != nullptr) {
+        CloseHandle((HANDLE)mapping_handle_);
+        mapping_handle_ = nullptr;
+    }
+    if (file_handle_ != nullptr) {
+        CloseHandle((HANDLE)file_handle_);
+        file_handle_ = nullptr;
+    }
+}
+
 #else  // Unix
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 bool file_exists(const std::string& filename) {
@@ -109,7 +182,44 @@ bool is_directory(const std::string& path) {
     return (stat(path.c_str(), &buffer) == 0 && S_ISDIR(buffer.st_mode));
 }
 
+bool MmapFile::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
 #endif
+    data_ = (const uint8_t*)addr;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != nullptr) {
+        munmap((void*)data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+#endif
+
+MmapFile::~MmapFile() {
+    close();
+}
 
 // get_num_physical_cores is copy from
 // https://github.com/ggerganov/llama.cpp/blob/master/examples/common.cpp
@@ -159,6 +269,31 @@ int sd_preview_interval              = 1;
 bool sd_preview_denoised             = true;
 bool sd_preview_noisy                = false;
 
+static sd_image_rows_cb_t sd_image_rows_cb = nullptr;
+static void* sd_image_rows_cb_data         = nullptr;
+
+static sd_image_done_cb_t sd_image_done_cb = nullptr;
+static void* sd_image_done_cb_data         = nullptr;
+
+static sd_video_frame_cb_t sd_video_frame_cb = nullptr;
+static void* sd_video_frame_cb_data          = nullptr;
+
+// profiler events, strings are interned to keep the per-node records small
+struct ProfileEvent {
+    uint32_t runner;
+    uint32_t op;
+    uint32_t block;
+    int64_t start_us;
+    int64_t dur_us;
+};
+
+static std::atomic<bool> sd_profiling(false);
+static std::mutex sd_profile_mutex;
+static std::vector<std::string> sd_profile_strings;
+static std::unordered_map<std::string, uint32_t> sd_profile_string_ids;
+static std::vector<ProfileEvent> sd_profile_events;
+static uint64_t sd_profile_graphs = 0;
+
 std::u32string utf8_to_utf32(const std::string& utf8_str) {
     std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> converter;
     return converter.from_bytes(utf8_str);
@@ -321,6 +456,176 @@ void* sd_get_preview_callback_data() {
     return sd_preview_cb_data;
 }
 
+void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data) {
+    sd_image_rows_cb      = cb;
+    sd_image_rows_cb_data = data;
+}
+sd_image_rows_cb_t sd_get_image_rows_callback() {
+    return sd_image_rows_cb;
+}
+void* sd_get_image_rows_callback_data() {
+    return sd_image_rows_cb_data;
+}
+
+void sd_set_image_done_callback(sd_image_done_cb_t cb, void* data) {
+    sd_image_done_cb      = cb;
+    sd_image_done_cb_data = data;
+}
+sd_image_done_cb_t sd_get_image_done_callback() {
+    return sd_image_done_cb;
+}
+void* sd_get_image_done_callback_data() {
+    return sd_image_done_cb_data;
+}
+
+void sd_set_video_frame_callback(sd_video_frame_cb_t cb, void* data) {
+    sd_video_frame_cb      = cb;
+    sd_video_frame_cb_data = data;
+}
+sd_video_frame_cb_t sd_get_video_frame_callback() {
+    return sd_video_frame_cb;
+}
+void* sd_get_video_frame_callback_data() {
+    return sd_video_frame_cb_data;
+}
+
+void sd_set_profiling(bool enabled) {
+    sd_profiling = enabled;
+}
+
+bool sd_profiling_enabled() {
+    return sd_profiling;
+}
+
+void sd_profile_reset() {
+    std::lock_guard<std::mutex> lock(sd_profile_mutex);
+    sd_profile_strings.clear();
+    sd_profile_string_ids.clear();
+    sd_profile_events.clear();
+    sd_profile_graphs = 0;
+}
+
+static uint32_t sd_profile_intern(const std::string& str) {
+    auto it = sd_profile_string_ids.find(str);
+    if (it != sd_profile_string_ids.end()) {
+        return it->second;
+    }
+    uint32_t id = (uint32_t)sd_profile_strings.size();
+    sd_profile_strings.push_back(str);
+    sd_profile_string_ids[str] = id;
+    return id;
+}
+
+void sd_profile_record_graph(const std::string& runner, const std::vector<sd_profile_node_t>& nodes) {
+    std::lock_guard<std::mutex> lock(sd_profile_mutex);
+    uint32_t runner_id = sd_profile_intern(runner);
+    for (const auto& node : nodes) {
+        ProfileEvent event;
+        event.runner   = runner_id;
+        event.op       = sd_profile_intern(node.op);
+        event.block    = sd_profile_intern(node.block.empty() ? runner : node.block);
+        event.start_us = node.start_us;
+        event.dur_us   = node.dur_us;
+        sd_profile_events.push_back(event);
+    }
+    sd_profile_graphs++;
+}
+
+static char* sd_profile_strdup(const std::string& str) {
+    char* result = (char*)malloc(str.size() + 1);
+    if (result != nullptr) {
+        memcpy(result, str.c_str(), str.size() + 1);
+    }
+    return result;
+}
+
+char* sd_profile_report_json(int max_blocks) {
+    struct Stat {
+        uint64_t count = 0;
+        int64_t us     = 0;
+    };
+    std::lock_guard<std::mutex> lock(sd_profile_mutex);
+    std::map<uint32_t, Stat> by_runner, by_op, by_block;
+    int64_t total_us = 0;
+    auto add = [](Stat& stat, int64_t us) {
+        stat.count++;
+        stat.us += us;
+    };
+    for (const auto& event : sd_profile_events) {
+        add(by_runner[event.runner], event.dur_us);
+        add(by_op[event.op], event.dur_us);
+        add(by_block[event.block], event.dur_us);
+        total_us += event.dur_us;
+    }
+
+    auto to_json = [&](const std::map<uint32_t, Stat>& stats, const char* key_name, int limit) {
+        std::vector<std::pair<uint32_t, Stat>> sorted(stats.begin(), stats.end());
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint32_t, Stat>& a, const std::pair<uint32_t, Stat>& b) {
+            return a.second.us > b.second.us;
+        });
+        if (limit > 0 && sorted.size() > (size_t)limit) {
+            sorted.resize(limit);
+        }
+        nlohmann::json result = nlohmann::json::array();
+        for (const auto& kv : sorted) {
+            result.push_back({
+                {key_name, sd_profile_strings[kv.first]},
+                {"count", kv.second.count},
+                {"ms", kv.second.us / 1000.0},
+                {"percent", total_us > 0 ? 100.0 * kv.second.us / total_us : 0.0},
+            });
+        }
+        return result;
+    };
+
+    nlohmann::json report;
+    report["graphs"]    = sd_profile_graphs;
+    report["nodes"]     = sd_profile_events.size();
+    report["total_ms"]  = total_us / 1000.0;
+    report["by_runner"] = to_json(by_runner, "runner", 0);
+    report["by_op"]     = to_json(by_op, "op", 0);
+    report["by_block"]  = to_json(by_block, "block", max_blocks);
+    return sd_profile_strdup(report.dump());
+}
+
+char* sd_profile_chrome_trace(void) {
+    std::lock_guard<std::mutex> lock(sd_profile_mutex);
+    // the trace can hold millions of nodes, write it directly instead of building a json tree
+    std::vector<std::string> quoted;
+    for (const auto& str : sd_profile_strings) {
+        quoted.push_back(nlohmann::json(str).dump());
+    }
+    int64_t t0 = sd_profile_events.empty() ? 0 : sd_profile_events[0].start_us;
+    for (const auto& event : sd_profile_events) {
+        t0 = std::min(t0, event.start_us);
+    }
+
+    std::string trace = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::set<uint32_t> runners;
+    for (const auto& event : sd_profile_events) {
+        runners.insert(event.runner);
+    }
+    bool first = true;
+    for (uint32_t runner : runners) {
+        trace += sd_format("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":%s}}",
+                           first ? "" : ",", runner, quoted[runner].c_str());
+        first = false;
+    }
+    for (const auto& event : sd_profile_events) {
+        trace += sd_format("%s{\"name\":%s,\"cat\":%s,\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,\"args\":{\"block\":%s}}",
+                           first ? "" : ",",
+                           quoted[event.op].c_str(),
+                           quoted[event.runner].c_str(),
+                           event.runner,
+                           (long long)(event.start_us - t0),
+                           (long long)event.dur_us,
+                           quoted[event.block].c_str());
+        first = false;
+    }
+    trace += "]}";
+    return sd_profile_strdup(trace);
+}
+
 preview_t sd_get_preview_mode() {
     return sd_preview_mode;
 }
@@ -2,6 +2,7 @@
 #define __UTIL_H__
 
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -20,9 +21,36 @@ void replace_all_chars(std::string& str, char target, char replacement);
 
 int round_up_to(int value, int base);
 
+// Calls fn(begin, end) on disjoint slices of [0, n) from up to n_threads threads, as long as
+// every thread gets enough work. cost is the number of elements one item touches; slices
+// start on multiples of align.
+void sd_parallel_for(int n_threads, int64_t n, int64_t cost, const std::function<void(int64_t, int64_t)>& fn, int64_t align = 1);
+
 bool file_exists(const std::string& filename);
 bool is_directory(const std::string& path);
 
+// Read-only memory mapping of a whole file
+class MmapFile {
+public:
+    MmapFile() = default;
+    ~MmapFile();
+    MmapFile(const MmapFile&)            = delete;
+    MmapFile& operator=(const MmapFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_         = 0;
+#ifdef _WIN32
+    void* file_handle_    = nullptr;
+    void* mapping_handle_ = nullptr;
+#endif
+};
+
 std::u32string utf8_to_utf32(const std::string& utf8_str);
 std::string utf32_to_utf8(const std::u32string& utf32_str);
 std::u32string unicode_value_to_utf32(int unicode_value);
@@ -58,11 +86,28 @@ void* sd_get_progress_callback_data();
 
 sd_preview_cb_t sd_get_preview_callback();
 void* sd_get_preview_callback_data();
+sd_image_rows_cb_t sd_get_image_rows_callback();
+void* sd_get_image_rows_callback_data();
+sd_image_done_cb_t sd_get_image_done_callback();
+void* sd_get_image_done_callback_data();
+sd_video_frame_cb_t sd_get_video_frame_callback();
+void* sd_get_video_frame_callback_data();
 preview_t sd_get_preview_mode();
 int sd_get_preview_interval();
 bool sd_should_preview_denoised();
 bool sd_should_preview_noisy();
 
+// one evaluated graph node, see sd_set_profiling()
+struct sd_profile_node_t {
+    std::string op;
+    std::string block;  // owning GGMLBlock prefix, empty for the runner itself
+    int64_t start_us;
+    int64_t dur_us;
+};
+
+bool sd_profiling_enabled();
+void sd_profile_record_graph(const std::string& runner, const std::vector<sd_profile_node_t>& nodes);
+
 #define LOG_DEBUG(format, ...) log_printf(SD_LOG_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_INFO(format, ...) log_printf(SD_LOG_INFO, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_WARN(format, ...) log_printf(SD_LOG_WARN, __FILE__, __LINE__, format, ##__VA_ARGS__)
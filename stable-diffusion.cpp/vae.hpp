@@ -624,6 +624,34 @@ struct VAE : public GGMLRunner {
                          struct ggml_context* output_ctx)                                                         = 0;
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors, const std::string prefix) = 0;
     virtual void set_conv2d_scale(float scale) { SD_UNUSED(scale); };
+
+    // processes independent tiles, concurrently where the runner supports it
+    virtual bool compute_tiles(const int n_threads,
+                               const std::vector<struct ggml_tensor*>& inputs,
+                               bool decode_graph,
+                               const std::vector<struct ggml_tensor*>& outputs) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            struct ggml_tensor* output = outputs[i];
+            if (!compute(n_threads, inputs[i], decode_graph, &output, nullptr)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Decodes a video latent, on_frames gets the [W, H, n, C] frames of every step in order
+    // and returns false to stop the decode. Runners that can't split the video decode it in
+    // a single step.
+    virtual bool decode_frames(const int n_threads,
+                               struct ggml_tensor* z,
+                               struct ggml_context* work_ctx,
+                               const std::function<bool(struct ggml_tensor* frames)>& on_frames) {
+        struct ggml_tensor* frames = nullptr;
+        if (!compute(n_threads, z, true, &frames, work_ctx)) {
+            return false;
+        }
+        return on_frames(frames);
+    }
 };
 
 struct FakeVAE : public VAE {
@@ -726,6 +754,20 @@ struct AutoEncoderKL : public VAE {
         return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
 
+    bool compute_tiles(const int n_threads,
+                       const std::vector<struct ggml_tensor*>& inputs,
+                       bool decode_graph,
+                       const std::vector<struct ggml_tensor*>& outputs) override {
+        GGML_ASSERT(!decode_only || decode_graph);
+        std::vector<get_graph_cb_t> get_graphs;
+        for (auto z : inputs) {
+            get_graphs.push_back([this, z, decode_graph]() -> struct ggml_cgraph* {
+                return build_graph(z, decode_graph);
+            });
+        }
+        return compute_parallel(get_graphs, n_threads, outputs);
+    }
+
     void test() {
         struct ggml_init_params params;
         params.mem_size   = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
@@ -1099,8 +1099,9 @@ namespace WAN {
             auto decoder = std::dynamic_pointer_cast<Decoder3d>(blocks["decoder"]);
             auto conv2   = std::dynamic_pointer_cast<CausalConv3d>(blocks["conv2"]);
 
-            auto x    = conv2->forward(ctx, z);
-            auto in   = ggml_ext_slice(ctx->ggml_ctx, x, 2, i, i + 1);  // [b*c, 1, h, w]
+            // conv2 is 1x1x1, only the decoded frame goes through it
+            auto in   = ggml_ext_slice(ctx->ggml_ctx, z, 2, i, i + 1);  // [b*c, 1, h, w]
+            in        = conv2->forward(ctx, in);
             _conv_idx = 0;
             auto out  = decoder->forward(ctx, in, b, _feat_map, _conv_idx, i);
             if (wan2_2) {
@@ -1146,7 +1147,9 @@ namespace WAN {
             return gf;
         }
 
-        struct ggml_cgraph* build_graph_partial(struct ggml_tensor* z, bool decode_graph, int64_t i) {
+        // Graph of latent frame i. The causal conv caches of the previous frames are read
+        // from the cache buffer and the updated ones are written back to it.
+        struct ggml_cgraph* build_graph_partial(struct ggml_tensor* z, int64_t i) {
             struct ggml_cgraph* gf = new_graph_custom(20480);
 
             ae.clear_cache();
@@ -1160,11 +1163,17 @@ namespace WAN {
 
             auto runner_ctx = get_context();
 
-            struct ggml_tensor* out = decode_graph ? ae.decode_partial(&runner_ctx, z, i) : ae.encode(&runner_ctx, z);
+            struct ggml_tensor* out = ae.decode_partial(&runner_ctx, z, i);
 
             for (int64_t feat_idx = 0; feat_idx < ae._feat_map.size(); feat_idx++) {
                 ggml_tensor* feat_cache = ae._feat_map[feat_idx];
                 if (feat_cache != nullptr) {
+                    // a single frame cache is the conv input itself, keep the allocator
+                    // from reusing its memory before it is copied out
+                    if (feat_cache->view_src != nullptr) {
+                        feat_cache = ggml_cont(compute_ctx, feat_cache);
+                    }
+                    ggml_set_output(feat_cache);
                     cache("feat_idx:" + std::to_string(feat_idx), feat_cache);
                     ggml_build_forward_expand(gf, feat_cache);
                 }
@@ -1175,59 +1184,81 @@ namespace WAN {
             return gf;
         }
 
-        bool compute(const int n_threads,
-                     struct ggml_tensor* z,
-                     bool decode_graph,
-                     struct ggml_tensor** output,
-                     struct ggml_context* output_ctx = nullptr) override {
-            if (true) {
+        // Decodes one latent frame per graph (the first frame gives one image, the others
+        // four each), so the compute buffer doesn't grow with the video length.
+        bool decode_chunked(const int n_threads,
+                            struct ggml_tensor* z,
+                            const std::function<bool(struct ggml_tensor* frames)>& on_frames) {
+            bool res = true;
+            free_cache_ctx_and_buffer();
+            for (int64_t i = 0; i < z->ne[2] && res; i++) {
                 auto get_graph = [&]() -> struct ggml_cgraph* {
-                    return build_graph(z, decode_graph);
+                    return build_graph_partial(z, i);
                 };
-                return GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
-            } else {  // chunk 1 result is weird
-                ae.clear_cache();
-                int64_t t      = z->ne[2];
-                int64_t i      = 0;
-                auto get_graph = [&]() -> struct ggml_cgraph* {
-                    return build_graph_partial(z, decode_graph, i);
-                };
-                struct ggml_tensor* out = nullptr;
-                bool res                = GGMLRunner::compute(get_graph, n_threads, true, &out, output_ctx);
-                ae.clear_cache();
-                if (t == 1) {
-                    *output = out;
-                    return res;
+                res = GGMLRunner::compute(get_graph, n_threads, false);
+                if (!res) {
+                    break;
                 }
+                auto out = ggml_get_tensor(compute_ctx, final_result_name.c_str());  // [c, f, h, w]
+                GGML_ASSERT(out->type == GGML_TYPE_F32 && ggml_is_contiguous(out));
 
-                *output = ggml_new_tensor_4d(output_ctx, GGML_TYPE_F32, out->ne[0], out->ne[1], (t - 1) * 4 + 1, out->ne[3]);
-
-                auto copy_to_output = [&]() {
-                    for (int64_t i3 = 0; i3 < out->ne[3]; i3++) {
-                        for (int64_t i2 = 0; i2 < out->ne[2]; i2++) {
-                            for (int64_t i1 = 0; i1 < out->ne[1]; i1++) {
-                                for (int64_t i0 = 0; i0 < out->ne[0]; i0++) {
-                                    float value    = ggml_ext_tensor_get_f32(out, i0, i1, i2, i3);
-                                    int64_t offset = (i == 0) ? 0 : (1 + (i - 1) * 4);
-                                    ggml_ext_tensor_set_f32(*output, value, i0, i1, offset + i2, i3);
-                                }
-                            }
-                        }
-                    }
-                };
+                struct ggml_init_params params;
+                params.mem_size   = ggml_nbytes(out) + ggml_tensor_overhead();
+                params.mem_buffer = nullptr;
+                params.no_alloc   = false;
 
-                copy_to_output();
+                struct ggml_context* frames_ctx = ggml_init(params);
+                GGML_ASSERT(frames_ctx != nullptr);
+                struct ggml_tensor* frames = ggml_dup_tensor(frames_ctx, out);
+                ggml_ext_backend_tensor_get_and_sync(runtime_backend, out, frames->data, 0, ggml_nbytes(out));
+                res = on_frames(frames);
+                ggml_free(frames_ctx);
+            }
+            free_compute_buffer();
+            free_cache_ctx_and_buffer();
+            return res;
+        }
 
-                out = ggml_new_tensor_4d(output_ctx, GGML_TYPE_F32, out->ne[0], out->ne[1], 4, out->ne[3]);
+        bool decode_frames(const int n_threads,
+                           struct ggml_tensor* z,
+                           struct ggml_context* work_ctx,
+                           const std::function<bool(struct ggml_tensor* frames)>& on_frames) override {
+            if (z->ne[2] <= 1) {
+                return VAE::decode_frames(n_threads, z, work_ctx, on_frames);
+            }
+            return decode_chunked(n_threads, z, on_frames);
+        }
 
-                for (i = 1; i < t; i++) {
-                    res = res || GGMLRunner::compute(get_graph, n_threads, true, &out);
-                    ae.clear_cache();
-                    copy_to_output();
-                }
-                free_cache_ctx_and_buffer();
-                return res;
+        bool compute(const int n_threads,
+                     struct ggml_tensor* z,
+                     bool decode_graph,
+                     struct ggml_tensor** output,
+                     struct ggml_context* output_ctx = nullptr) override {
+            if (decode_graph && z->ne[2] > 1) {
+                // assemble the chunks into [W, H, 1 + (t - 1) * 4, C]
+                int64_t out_t  = 1 + (z->ne[2] - 1) * 4;
+                int64_t frame  = 0;
+                auto on_frames = [&](struct ggml_tensor* frames) {
+                    if (*output == nullptr) {
+                        *output = ggml_new_tensor_4d(output_ctx, GGML_TYPE_F32, frames->ne[0], frames->ne[1], out_t, frames->ne[3]);
+                    }
+                    GGML_ASSERT(frames->ne[0] == (*output)->ne[0] && frames->ne[1] == (*output)->ne[1] && frames->ne[3] == (*output)->ne[3]);
+                    GGML_ASSERT(frame + frames->ne[2] <= (*output)->ne[2]);
+                    size_t frame_size = frames->ne[0] * frames->ne[1] * sizeof(float);
+                    for (int64_t c = 0; c < frames->ne[3]; c++) {
+                        memcpy((char*)(*output)->data + (c * (*output)->ne[2] + frame) * frame_size,
+                               (char*)frames->data + c * frames->ne[2] * frame_size,
+                               frames->ne[2] * frame_size);
+                    }
+                    frame += frames->ne[2];
+                    return true;
+                };
+                return decode_chunked(n_threads, z, on_frames);
             }
+            auto get_graph = [&]() -> struct ggml_cgraph* {
+                return build_graph(z, decode_graph);
+            };
+            return GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
         }
 
         void test() {
@@ -2017,7 +2048,7 @@ namespace WAN {
         std::string desc = "wan";
         WanParams wan_params;
         Wan wan;
-        std::vector<float> pe_vec;
+        Rope::PECache pe_cache;
         SDVersion version;
 
         WanRunner(ggml_backend_t backend,
@@ -2157,22 +2188,26 @@ namespace WAN {
             time_dim_concat = to_backend(time_dim_concat);
             vace_context    = to_backend(vace_context);
 
-            pe_vec      = Rope::gen_wan_pe(x->ne[2],
-                                           x->ne[1],
-                                           x->ne[0],
-                                           std::get<0>(wan_params.patch_size),
-                                           std::get<1>(wan_params.patch_size),
-                                           std::get<2>(wan_params.patch_size),
-                                           1,
-                                           wan_params.theta,
-                                           wan_params.axes_dim);
+            std::string pe_key               = Rope::pe_cache_key({x->ne[0], x->ne[1], x->ne[2]});
+            const std::vector<float>& pe_vec = pe_cache.get(pe_key, [&]() {
+                return Rope::gen_wan_pe(x->ne[2],
+                                        x->ne[1],
+                                        x->ne[0],
+                                        std::get<0>(wan_params.patch_size),
+                                        std::get<1>(wan_params.patch_size),
+                                        std::get<2>(wan_params.patch_size),
+                                        1,
+                                        wan_params.theta,
+                                        wan_params.axes_dim,
+                                        build_n_threads);
+            });
             int pos_len = pe_vec.size() / wan_params.axes_dim_sum / 2;
             // LOG_DEBUG("pos_len %d", pos_len);
             auto pe = ggml_new_tensor_4d(compute_ctx, GGML_TYPE_F32, 2, 2, wan_params.axes_dim_sum / 2, pos_len);
             // pe->data = pe_vec.data();
             // print_ggml_tensor(pe);
             // pe->data = nullptr;
-            set_backend_tensor_data(pe, pe_vec.data());
+            set_backend_tensor_resident_data(pe, pe_vec.data());
 
             if (c_concat != nullptr) {
                 x = ggml_concat(compute_ctx, x, c_concat, 3);
@@ -2210,7 +2245,12 @@ namespace WAN {
                 return build_graph(x, timesteps, context, clip_fea, c_concat, time_dim_concat, vace_context, vace_strength);
             };
 
-            return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+            return GGMLRunner::compute_with_graph_cache(get_graph,
+                                                        n_threads,
+                                                        {x, timesteps, context, clip_fea, c_concat, time_dim_concat, vace_context},
+                                                        std::to_string(vace_strength),
+                                                        output,
+                                                        output_ctx);
         }
 
         void test() {
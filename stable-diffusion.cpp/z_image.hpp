@@ -505,7 +505,7 @@ namespace ZImage {
     public:
         ZImageParams z_image_params;
         ZImageModel z_image;
-        std::vector<float> pe_vec;
+        Rope::PECache pe_cache;
         std::vector<float> timestep_vec;
         SDVersion version;
 
@@ -543,23 +543,27 @@ namespace ZImage {
                 ref_latents[i] = to_backend(ref_latents[i]);
             }
 
-            pe_vec      = Rope::gen_z_image_pe(x->ne[1],
-                                               x->ne[0],
-                                               z_image_params.patch_size,
-                                               x->ne[3],
-                                               context->ne[1],
-                                               SEQ_MULTI_OF,
-                                               ref_latents,
-                                               increase_ref_index,
-                                               z_image_params.theta,
-                                               z_image_params.axes_dim);
+            std::string pe_key               = Rope::pe_cache_key({x->ne[0], x->ne[1], x->ne[3], context->ne[1], increase_ref_index}, ref_latents);
+            const std::vector<float>& pe_vec = pe_cache.get(pe_key, [&]() {
+                return Rope::gen_z_image_pe(x->ne[1],
+                                            x->ne[0],
+                                            z_image_params.patch_size,
+                                            x->ne[3],
+                                            context->ne[1],
+                                            SEQ_MULTI_OF,
+                                            ref_latents,
+                                            increase_ref_index,
+                                            z_image_params.theta,
+                                            z_image_params.axes_dim,
+                                            build_n_threads);
+            });
             int pos_len = pe_vec.size() / z_image_params.axes_dim_sum / 2;
             // LOG_DEBUG("pos_len %d", pos_len);
             auto pe = ggml_new_tensor_4d(compute_ctx, GGML_TYPE_F32, 2, 2, z_image_params.axes_dim_sum / 2, pos_len);
             // pe->data = pe_vec.data();
             // print_ggml_tensor(pe, true, "pe");
             // pe->data = nullptr;
-            set_backend_tensor_data(pe, pe_vec.data());
+            set_backend_tensor_resident_data(pe, pe_vec.data());
             auto runner_ctx = get_context();
 
             struct ggml_tensor* out = z_image.forward(&runner_ctx,
@@ -589,7 +593,9 @@ namespace ZImage {
                 return build_graph(x, timesteps, context, ref_latents, increase_ref_index);
             };
 
-            return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+            std::vector<struct ggml_tensor*> inputs = {x, timesteps, context};
+            inputs.insert(inputs.end(), ref_latents.begin(), ref_latents.end());
+            return GGMLRunner::compute_with_graph_cache(get_graph, n_threads, inputs, std::to_string(increase_ref_index), output, output_ctx);
         }
 
         void test() {